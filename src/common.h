@@ -1,22 +1,14 @@
 #ifndef COMMON_H
 #define COMMON_H
 
-typedef unsigned char U8;
-typedef unsigned short U16;
-typedef unsigned int U32;
-typedef unsigned long U64;
-
-typedef char I8;
-typedef short I16;
-typedef int I32;
-typedef long I64;
-
-typedef float F32;
+#include "types.h"
+#include "hashmap.h"
 
 typedef enum EVENT {
     EVENT_STARTED = 0,
     EVENT_COMPLETED,
-    EVENT_STOPPED
+    EVENT_STOPPED,
+    EVENT_NONE
 } EVENT;
 
 typedef enum StorageType {
@@ -27,30 +19,42 @@ typedef enum StorageType {
 
 typedef struct account_info_t {
     char auth_key[20];
-    U32 totalDownload;
-    U32 totalUploads;
+    U64 totalDownload;
+    U64 totalUploads;
+    U64 journal_lsn;    //lsn of the last journal record applied
 } account_info_t;
 
+//ip (4) + port (2), both in network order, exactly as sent in announce responses
+#define COMPACT_PEER_LEN 6
+
+typedef struct peer_info_t {
+    char peer_id[20];
+    U32 last_seen;      //tracker clock seconds of the last announce
+    I32 timer;          //expiry node in the partition's timing wheel
+    U8 seeder;          //left was 0 in its last announce, counted in seeders instead of lecheers
+    U64 uploaded;       //last reported totals, credited to the account as deltas
+    U64 downloaded;
+} peer_info_t;
+
+typedef struct peer_cache_t peer_cache_t;
+
 typedef struct torrentfile_t {
     char info_hash[20];
+    //kept by peer state changes, next to the key so a scrape reads one cache line
     U32 seeders;
     U32 lecheers;
     U32 completed;
+    U64 journal_lsn;    //lsn of the last journal record applied
 
-} torrentfile_t;
+    U32 peer_count;
+    U32 peer_capacity;
+    U8* compact_peers;          //peer_count * COMPACT_PEER_LEN bytes
+    peer_info_t* peer_info;     //parallel to compact_peers
+    hashmap_t peers;            //peer_id -> slot
 
-typedef struct userinfo_t {
-    char peer_id[20];
-    U32 address;
-    U16 port;
-    U32 downloads;
-    U32 uploads;
-    U32 left;
-    EVENT event;
-    U32 numwant;
-    torrentfile_t* torrent;
-    account_info_t* account;
-} userinfo_t;
+    U32 epoch;                  //counts changes to the set of compact peers
+    peer_cache_t* peer_cache;   //pre-sampled peer lists of large swarms, NULL until needed
+} torrentfile_t;
 
 
 #ifndef _MSC_VER
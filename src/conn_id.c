@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+
+#include "conn_id.h"
+
+#include "logger.h"
+#include "siphash.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/random.h>
+
+//connection ids are siphash(address, port, time bucket) under a per-bucket secret,
+//so nothing has to be stored per client. A secret slot is reused every second bucket,
+//writers bump seq around the update and readers retry on a torn read.
+typedef struct conn_secret_t {
+    U32 seq;
+    U64 bucket;
+    U64 k0;
+    U64 k1;
+} __attribute__((aligned(64))) conn_secret_t;
+
+static conn_secret_t secrets[2];
+
+
+static void random_key(conn_secret_t* s, U64* key) {
+    if (getrandom(key, 2 * sizeof(U64), 0) != 2 * sizeof(U64)) {
+        LOG_ERROR("getrandom(): %s", strerror(errno));
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        key[0] ^= (U64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        key[1] ^= (U64)s;
+    }
+}
+
+//both slots start out as bucket 0, which is a valid bucket during the first minutes after boot
+void conn_id_init() {
+    for (U32 i = 0; i < 2; i++) {
+        U64 key[2];
+        random_key(&secrets[i], key);
+        secrets[i].k0 = key[0];
+        secrets[i].k1 = key[1];
+    }
+}
+
+U64 conn_id_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static void rotate_secret(U64 bucket) {
+    conn_secret_t* s = &secrets[bucket & 1];
+
+    U32 seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if ((seq & 1) || __atomic_load_n(&s->bucket, __ATOMIC_RELAXED) >= bucket)
+        return;
+
+    if (!__atomic_compare_exchange_n(&s->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+
+    U64 key[2];
+    random_key(s, key);
+
+    __atomic_store_n(&s->k0, key[0], __ATOMIC_RELAXED);
+    __atomic_store_n(&s->k1, key[1], __ATOMIC_RELAXED);
+    __atomic_store_n(&s->bucket, bucket, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+//returns the secret's bucket, which differs from the asked one if the slot is stale or already reused
+static U64 load_secret(U64 bucket, U64* k0, U64* k1) {
+    conn_secret_t* s = &secrets[bucket & 1];
+
+    while (1) {
+        U32 seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+
+        U64 b = __atomic_load_n(&s->bucket, __ATOMIC_RELAXED);
+        *k0 = __atomic_load_n(&s->k0, __ATOMIC_RELAXED);
+        *k1 = __atomic_load_n(&s->k1, __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+            return b;
+    }
+}
+
+static inline int64_t hash_connection_id(const struct sockaddr_in* addr, U64 bucket, U64 k0, U64 k1) {
+    U8 msg[16];
+    memcpy(msg, &addr->sin_addr.s_addr, 4);
+    memcpy(msg + 4, &addr->sin_port, 2);
+    memset(msg + 6, 0, 2);
+    memcpy(msg + 8, &bucket, 8);
+
+    return (int64_t)siphash24(msg, sizeof msg, k0, k1);
+}
+
+int64_t make_connection_id(const struct sockaddr_in* addr, U64 now) {
+    U64 bucket = now / CONN_ID_BUCKET_SECS;
+    U64 k0, k1;
+
+    while (load_secret(bucket, &k0, &k1) < bucket)
+        rotate_secret(bucket);
+
+    return hash_connection_id(addr, bucket, k0, k1);
+}
+
+int verify_connection_id(const struct sockaddr_in* addr, int64_t connection_id, U64 now) {
+    U64 bucket = now / CONN_ID_BUCKET_SECS;
+    U64 k0, k1;
+
+    U64 cur_ok = load_secret(bucket, &k0, &k1) == bucket;
+    int64_t cur = hash_connection_id(addr, bucket, k0, k1);
+
+    U64 prev_ok = load_secret(bucket - 1, &k0, &k1) == bucket - 1;
+    int64_t prev = hash_connection_id(addr, bucket - 1, k0, k1);
+
+    //no early exit, both candidates are always computed and compared
+    U64 match = ((U64)(cur ^ connection_id) == 0) & cur_ok;
+    match |= ((U64)(prev ^ connection_id) == 0) & prev_ok;
+
+    return (int)match;
+}
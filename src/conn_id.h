@@ -0,0 +1,24 @@
+#ifndef CONN_ID_H
+#define CONN_ID_H
+
+#include "types.h"
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+//BEP 15 trackers accept an id for two minutes after sending it, an id issued at the
+//end of a bucket is still good for the whole next one
+#define CONN_ID_BUCKET_SECS 120
+
+//seeds both secret slots, ids are never derived from a zero key
+void conn_id_init();
+
+//seconds of CLOCK_MONOTONIC_COARSE, the clock the buckets are counted in
+U64 conn_id_now();
+
+int64_t make_connection_id(const struct sockaddr_in* addr, U64 now);
+
+//accepts ids from the current and the previous bucket, so an id lives 2-4 minutes
+int verify_connection_id(const struct sockaddr_in* addr, int64_t connection_id, U64 now);
+
+#endif
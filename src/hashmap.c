@@ -0,0 +1,299 @@
+#include "hashmap.h"
+
+#include "logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define HASH_EMPTY 0
+#define HASH_MOVED 1
+
+#define MIN_CAPACITY 4
+#define MIGRATE_STEP 16
+//x86-64 huge page, tables this large are aligned to it so they can be backed by one
+#define HUGE_TABLE_SIZE ((size_t)2 << 20)
+
+static inline U64 rotl(U64 x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+//peer ids are not random (client prefix), so all 20 bytes get mixed
+static inline U64 hash_key(const char* key) {
+    U64 a, b;
+    U32 c;
+    memcpy(&a, key, sizeof a);
+    memcpy(&b, key + 8, sizeof b);
+    memcpy(&c, key + 16, sizeof c);
+
+    U64 h = a * 0x9e3779b97f4a7c15ULL;
+    h ^= rotl(b * 0xc2b2ae3d27d4eb4fULL, 31);
+    h ^= (U64)c * 0x165667b19e3779f9ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    //0 and 1 mark empty and moved buckets
+    return h <= HASH_MOVED ? h + 2 : h;
+}
+
+//a probe lands on a random bucket, on a big table every lookup would miss the TLB
+static I32 table_alloc(hashmap_table_t* t, U32 capacity) {
+    size_t size = (size_t)capacity * sizeof(hashmap_entry_t);
+
+    if (size >= HUGE_TABLE_SIZE) {
+        if (posix_memalign((void**)&t->entries, HUGE_TABLE_SIZE, size) != 0)
+            return -1;
+#ifdef MADV_HUGEPAGE
+        madvise(t->entries, size, MADV_HUGEPAGE);
+#endif
+        memset(t->entries, 0, size);
+    } else {
+        t->entries = calloc(capacity, sizeof(hashmap_entry_t));
+        if (t->entries == NULL)
+            return -1;
+    }
+
+    t->capacity = capacity;
+    t->size = 0;
+    return 0;
+}
+
+static I32 table_find(hashmap_t* map, hashmap_table_t* t, U64 hash, const char* key) {
+
+    if (t->entries == NULL)
+        return -1;
+
+    U32 mask = t->capacity - 1;
+    U32 i = hash & mask;
+
+    while (t->entries[i].hash != HASH_EMPTY) {
+        hashmap_entry_t* e = &t->entries[i];
+        if (e->hash == hash && memcmp(map->get_key(map->ctx, e->value), key, HASHMAP_KEY_LEN) == 0)
+            return i;
+
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+static void table_put(hashmap_table_t* t, U64 hash, U32 value) {
+
+    U32 mask = t->capacity - 1;
+    U32 i = hash & mask;
+
+    while (t->entries[i].hash != HASH_EMPTY)
+        i = (i + 1) & mask;
+
+    t->entries[i].hash = hash;
+    t->entries[i].value = value;
+    t->size++;
+}
+
+//backward shift deletion, the active table never holds tombstones
+static void table_erase(hashmap_table_t* t, U32 i) {
+
+    U32 mask = t->capacity - 1;
+    U32 j = i;
+
+    while (1) {
+        j = (j + 1) & mask;
+        if (t->entries[j].hash == HASH_EMPTY)
+            break;
+
+        U32 home = t->entries[j].hash & mask;
+        U32 inside = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if (inside)
+            continue;
+
+        t->entries[i] = t->entries[j];
+        i = j;
+    }
+
+    t->entries[i].hash = HASH_EMPTY;
+    t->size--;
+}
+
+static void migrate(hashmap_t* map, U32 steps) {
+
+    hashmap_table_t* old = &map->old;
+
+    while (steps-- > 0 && map->migrate_pos < old->capacity && old->size > 0) {
+        hashmap_entry_t* e = &old->entries[map->migrate_pos++];
+        if (e->hash <= HASH_MOVED)
+            continue;
+
+        table_put(&map->table, e->hash, e->value);
+        //keep the bucket occupied so probe chains through it stay intact
+        e->hash = HASH_MOVED;
+        old->size--;
+    }
+
+    if (old->size == 0 || map->migrate_pos == old->capacity) {
+        free(old->entries);
+        memset(old, 0, sizeof *old);
+        map->migrate_pos = 0;
+    }
+}
+
+static I32 grow(hashmap_t* map) {
+
+    if (map->old.entries != NULL)
+        migrate(map, map->old.capacity);
+
+    U32 capacity = map->table.capacity ? map->table.capacity * 2 : MIN_CAPACITY;
+
+    hashmap_table_t table;
+    if (table_alloc(&table, capacity) != 0)
+        return -1;
+
+    if (map->table.size == 0) {
+        free(map->table.entries);
+        map->table = table;
+        return 0;
+    }
+
+    map->old = map->table;
+    map->table = table;
+    map->migrate_pos = 0;
+    return 0;
+}
+
+
+void hashmap_init(hashmap_t* map, U32 capacity, hashmap_key_fn get_key, void* ctx) {
+
+    memset(map, 0, sizeof *map);
+    map->get_key = get_key;
+    map->ctx = ctx;
+
+    if (capacity == 0)
+        return;
+
+    U32 size = MIN_CAPACITY;
+    while (size < capacity)
+        size <<= 1;
+
+    if (table_alloc(&map->table, size) != 0)
+        LOG_ERROR("hashmap_init(): failed to allocate %u buckets", size);
+}
+
+void hashmap_deinit(hashmap_t* map) {
+    free(map->table.entries);
+    free(map->old.entries);
+    memset(&map->table, 0, sizeof map->table);
+    memset(&map->old, 0, sizeof map->old);
+    map->migrate_pos = 0;
+}
+
+I32 hashmap_get(hashmap_t* map, const char* key) {
+    return hashmap_get_hashed(map, key, hash_key(key));
+}
+
+U64 hashmap_hash(const char* key) {
+    return hash_key(key);
+}
+
+void hashmap_prefetch(const hashmap_t* map, U64 hash) {
+    if (map->table.entries != NULL)
+        __builtin_prefetch(&map->table.entries[hash & (map->table.capacity - 1)]);
+}
+
+I32 hashmap_peek(const hashmap_t* map, U64 hash) {
+
+    const hashmap_table_t* t = &map->table;
+    if (t->entries == NULL)
+        return -1;
+
+    U32 mask = t->capacity - 1;
+    for (U32 i = hash & mask; t->entries[i].hash != HASH_EMPTY; i = (i + 1) & mask) {
+        if (t->entries[i].hash == hash)
+            return t->entries[i].value;
+    }
+    return -1;
+}
+
+I32 hashmap_get_hashed(hashmap_t* map, const char* key, U64 hash) {
+
+    I32 i = table_find(map, &map->table, hash, key);
+    if (i >= 0)
+        return map->table.entries[i].value;
+
+    i = table_find(map, &map->old, hash, key);
+    if (i >= 0)
+        return map->old.entries[i].value;
+
+    return -1;
+}
+
+I32 hashmap_insert(hashmap_t* map, const char* key, U32 value) {
+
+    U64 hash = hash_key(key);
+
+    I32 i = table_find(map, &map->table, hash, key);
+    if (i >= 0) {
+        map->table.entries[i].value = value;
+        return 0;
+    }
+
+    i = table_find(map, &map->old, hash, key);
+    if (i >= 0) {
+        map->old.entries[i].value = value;
+        return 0;
+    }
+
+    U64 count = (U64)map->table.size + map->old.size + 1;
+    if (count * 4 > (U64)map->table.capacity * 3 && grow(map) != 0) {
+        LOG_ERROR("hashmap_insert(): failed to grow table");
+        return -1;
+    }
+
+    table_put(&map->table, hash, value);
+
+    if (map->old.entries != NULL)
+        migrate(map, MIGRATE_STEP);
+
+    return 0;
+}
+
+I32 hashmap_remove(hashmap_t* map, const char* key) {
+
+    U64 hash = hash_key(key);
+    I32 value = -1;
+
+    I32 i = table_find(map, &map->table, hash, key);
+    if (i >= 0) {
+        value = map->table.entries[i].value;
+        table_erase(&map->table, i);
+    }
+    else if ((i = table_find(map, &map->old, hash, key)) >= 0) {
+        value = map->old.entries[i].value;
+        map->old.entries[i].hash = HASH_MOVED;
+        map->old.size--;
+    }
+
+    if (map->old.entries != NULL)
+        migrate(map, MIGRATE_STEP);
+
+    return value;
+}
+
+U32 hashmap_size(const hashmap_t* map) {
+    return map->table.size + map->old.size;
+}
+
+I32 hashmap_next(const hashmap_t* map, U32* it) {
+
+    while (*it < map->table.capacity) {
+        const hashmap_entry_t* e = &map->table.entries[(*it)++];
+        if (e->hash > HASH_MOVED)
+            return e->value;
+    }
+
+    while (*it - map->table.capacity < map->old.capacity) {
+        const hashmap_entry_t* e = &map->old.entries[(*it)++ - map->table.capacity];
+        if (e->hash > HASH_MOVED)
+            return e->value;
+    }
+
+    return -1;
+}
@@ -0,0 +1,57 @@
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include "types.h"
+
+#define HASHMAP_KEY_LEN 20
+
+//returns the full 20-byte key stored behind a value (pool index, slot, ...)
+typedef const char* (*hashmap_key_fn)(void* ctx, U32 value);
+
+typedef struct hashmap_entry_t {
+    U64 hash;
+    U32 value;
+    U32 reserved;
+} hashmap_entry_t;
+
+typedef struct hashmap_table_t {
+    hashmap_entry_t* entries;
+    U32 capacity;
+    U32 size;
+} hashmap_table_t;
+
+/*
+ * Open addressing (linear probing) index keyed by 20-byte ids. Entries keep the
+ * 64-bit hash inline, the full key is only fetched through get_key on a hash match.
+ * Growing allocates a table twice the size and moves the old entries over a few
+ * buckets per insert/remove, lookups check both tables until the old one is drained.
+ */
+typedef struct hashmap_t {
+    hashmap_table_t table;
+    hashmap_table_t old;
+    U32 migrate_pos;
+    hashmap_key_fn get_key;
+    void* ctx;
+} hashmap_t;
+
+
+void hashmap_init(hashmap_t* map, U32 capacity, hashmap_key_fn get_key, void* ctx);
+void hashmap_deinit(hashmap_t* map);
+
+I32 hashmap_get(hashmap_t* map, const char* key);
+
+//batched lookups: hash every key, prefetch every home bucket, then look them up
+U64 hashmap_hash(const char* key);
+void hashmap_prefetch(const hashmap_t* map, U64 hash);
+//value of the first entry with this hash, keys are not compared so it is only a hint for prefetching
+I32 hashmap_peek(const hashmap_t* map, U64 hash);
+I32 hashmap_get_hashed(hashmap_t* map, const char* key, U64 hash);
+I32 hashmap_insert(hashmap_t* map, const char* key, U32 value);
+I32 hashmap_remove(hashmap_t* map, const char* key);
+
+U32 hashmap_size(const hashmap_t* map);
+
+//iterate over all values, start with *it = 0, returns -1 at the end
+I32 hashmap_next(const hashmap_t* map, U32* it);
+
+#endif
@@ -0,0 +1,186 @@
+#include "full_scrape.h"
+
+#include "../logger.h"
+#include "../tracker_logic.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ENTRIES_INITIAL_CAPACITY 4096
+//"20:" hash "d8:completei" u32 "e10:downloadedi" u32 "e10:incompletei" u32 "ee"
+#define ENTRY_MAX_LEN (3 + 20 + 12 + 10 + 15 + 10 + 15 + 10 + 2)
+
+typedef struct scrape_entry_t {
+    char info_hash[20];
+    U32 seeders;
+    U32 leechers;
+    U32 completed;
+} scrape_entry_t;
+
+typedef struct entry_list_t {
+    scrape_entry_t* entries;
+    U32 count;
+    U32 capacity;
+    I32 failed;
+} entry_list_t;
+
+static full_scrape_t* current;
+static full_scrape_t* built;
+static U64 build_count;
+
+static uv_timer_t timer;
+static uv_work_t work;
+static int running;
+
+static void collect_torrent(void* ctx, const torrentfile_t* torrent, U32 now);
+static int compare_entries(const void* a, const void* b);
+static U32 write_u32(char* dest, U32 value);
+static full_scrape_t* build();
+static void build_work_cb(uv_work_t* req);
+static void build_after_cb(uv_work_t* req, int status);
+static void on_build_timer(uv_timer_t* handle);
+
+
+void full_scrape_init(uv_loop_t* loop, U32 interval_ms) {
+    uv_timer_init(loop, &timer);
+    uv_timer_start(&timer, on_build_timer, 0, interval_ms);
+}
+
+full_scrape_t* full_scrape_acquire() {
+    if (current != NULL)
+        current->refs++;
+    return current;
+}
+
+void full_scrape_release(full_scrape_t* scrape) {
+    if (scrape != NULL && --scrape->refs == 0)
+        free(scrape);
+}
+
+//runs under the partition lock, so it only copies the counters
+static void collect_torrent(void* ctx, const torrentfile_t* torrent, U32 now) {
+    entry_list_t* list = ctx;
+
+    if (list->failed)
+        return;
+
+    if (list->count == list->capacity) {
+        U32 capacity = list->capacity ? list->capacity * 2 : ENTRIES_INITIAL_CAPACITY;
+        scrape_entry_t* entries = realloc(list->entries, (size_t)capacity * sizeof(scrape_entry_t));
+        if (entries == NULL) {
+            list->failed = 1;
+            return;
+        }
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+
+    scrape_entry_t* entry = &list->entries[list->count++];
+    memcpy(entry->info_hash, torrent->info_hash, sizeof entry->info_hash);
+    entry->seeders = torrent->seeders;
+    entry->leechers = torrent->lecheers;
+    entry->completed = torrent->completed;
+}
+
+static int compare_entries(const void* a, const void* b) {
+    return memcmp(((const scrape_entry_t*)a)->info_hash, ((const scrape_entry_t*)b)->info_hash, 20);
+}
+
+static U32 write_u32(char* dest, U32 value) {
+    char digits[10];
+    U32 n = 0;
+
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+
+    for (U32 i = 0; i < n; i++)
+        dest[i] = digits[n - 1 - i];
+    return n;
+}
+
+#define APPEND(pos, str) (memcpy(pos, str, sizeof(str) - 1), pos += sizeof(str) - 1)
+
+//bencoded dictionaries need sorted keys, so the counters are copied out first and sorted unlocked
+static full_scrape_t* build() {
+
+    entry_list_t list = {0};
+
+    for (U32 i = 0; i < tracker_partition_count(); i++)
+        tracker_visit_partition(i, collect_torrent, &list);
+
+    if (list.failed) {
+        free(list.entries);
+        return NULL;
+    }
+
+    qsort(list.entries, list.count, sizeof(scrape_entry_t), compare_entries);
+
+    full_scrape_t* scrape = malloc(sizeof(full_scrape_t) + (size_t)list.count * ENTRY_MAX_LEN + 16);
+    if (scrape == NULL) {
+        free(list.entries);
+        return NULL;
+    }
+
+    char* pos = scrape->data;
+    APPEND(pos, "d5:filesd");
+
+    for (U32 i = 0; i < list.count; i++) {
+        const scrape_entry_t* entry = &list.entries[i];
+
+        APPEND(pos, "20:");
+        memcpy(pos, entry->info_hash, sizeof entry->info_hash);
+        pos += sizeof entry->info_hash;
+
+        APPEND(pos, "d8:completei");
+        pos += write_u32(pos, entry->seeders);
+        APPEND(pos, "e10:downloadedi");
+        pos += write_u32(pos, entry->completed);
+        APPEND(pos, "e10:incompletei");
+        pos += write_u32(pos, entry->leechers);
+        APPEND(pos, "ee");
+    }
+
+    APPEND(pos, "ee");
+
+    scrape->refs = 1;
+    scrape->torrent_count = list.count;
+    scrape->created = time(NULL);
+    scrape->len = pos - scrape->data;
+
+    free(list.entries);
+    return scrape;
+}
+
+static void build_work_cb(uv_work_t* req) {
+    built = build();
+}
+
+//the new body is swapped in on the loop thread, responses still writing the old one keep it alive
+static void build_after_cb(uv_work_t* req, int status) {
+    running = 0;
+
+    if (built == NULL) {
+        LOG_ERROR("full scrape: build failed");
+        return;
+    }
+
+    built->etag_len = snprintf(built->etag, sizeof built->etag, "\"%lx-%lx\"", built->created, ++build_count);
+
+    LOG_INFO("full scrape: %u torrents, %zu bytes", built->torrent_count, built->len);
+
+    full_scrape_release(current);
+    current = built;
+    built = NULL;
+}
+
+static void on_build_timer(uv_timer_t* handle) {
+    if (running)
+        return;
+
+    running = 1;
+    uv_queue_work(handle->loop, &work, build_work_cb, build_after_cb);
+}
@@ -0,0 +1,33 @@
+#ifndef FULL_SCRAPE_H
+#define FULL_SCRAPE_H
+
+#include <uv.h>
+
+#include "../types.h"
+
+#define FULL_SCRAPE_DEFAULT_INTERVAL_MS 300000
+
+/*
+ * Bencoded /scrape body for every torrent (BEP 48). It is built on the libuv thread
+ * pool from one partition at a time and published on the loop thread, responses
+ * write straight out of it and hold a reference until the write completes.
+ */
+typedef struct full_scrape_t {
+    U32 refs;               //loop thread only
+    U32 torrent_count;
+    U64 created;            //unix seconds
+    char etag[32];          //quoted, changes with every build
+    U32 etag_len;
+    size_t len;
+    char data[];
+} full_scrape_t;
+
+
+//builds the first body right away and a new one every interval_ms
+void full_scrape_init(uv_loop_t* loop, U32 interval_ms);
+
+//current body or NULL before the first build finished, loop thread only
+full_scrape_t* full_scrape_acquire();
+void full_scrape_release(full_scrape_t* scrape);
+
+#endif
@@ -0,0 +1,115 @@
+#include "http_scan.h"
+
+#include "../logger.h"
+
+#ifdef HTTP_SCAN_X86
+#include <immintrin.h>
+#endif
+
+http_scan_fn http_scan;
+
+static U8 delimiter_table[256];
+
+//branchless, every position is written and only kept when it is a delimiter
+static inline U32 scan_tail(const char* buf, U32 i, U32 len, U16* positions, U32 count) {
+    for (; i < len; i++) {
+        positions[count] = i;
+        count += delimiter_table[(U8)buf[i]];
+    }
+    return count;
+}
+
+U32 http_scan_scalar(const char* buf, U32 len, U16* positions) {
+    return scan_tail(buf, 0, len, positions, 0);
+}
+
+#ifdef HTTP_SCAN_X86
+
+static inline U32 emit_positions(U32 mask, U32 offset, U16* positions, U32 count) {
+    while (mask) {
+        positions[count++] = offset + __builtin_ctz(mask);
+        mask &= mask - 1;
+    }
+    return count;
+}
+
+U32 http_scan_sse2(const char* buf, U32 len, U16* positions) {
+
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i question = _mm_set1_epi8('?');
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i eq = _mm_set1_epi8('=');
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+
+    U32 count = 0;
+    U32 i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, question));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, eq)));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, cr)));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, lf));
+
+        count = emit_positions(_mm_movemask_epi8(m), i, positions, count);
+    }
+
+    return scan_tail(buf, i, len, positions, count);
+}
+
+__attribute__((target("avx2")))
+U32 http_scan_avx2(const char* buf, U32 len, U16* positions) {
+
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i question = _mm256_set1_epi8('?');
+    const __m256i amp = _mm256_set1_epi8('&');
+    const __m256i eq = _mm256_set1_epi8('=');
+    const __m256i colon = _mm256_set1_epi8(':');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+
+    U32 count = 0;
+    U32 i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(buf + i));
+
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, question));
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, eq)));
+        m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, colon), _mm256_cmpeq_epi8(v, cr)));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, lf));
+
+        count = emit_positions((U32)_mm256_movemask_epi8(m), i, positions, count);
+    }
+
+    return scan_tail(buf, i, len, positions, count);
+}
+
+#endif
+
+void http_scan_init() {
+
+    const char* delimiters = " ?&=:\r\n";
+    for (const char* c = delimiters; *c; c++)
+        delimiter_table[(U8)*c] = 1;
+
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        http_scan = http_scan_avx2;
+        LOG_INFO("http request scanner: avx2");
+        return;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        http_scan = http_scan_sse2;
+        LOG_INFO("http request scanner: sse2");
+        return;
+    }
+#endif
+
+    http_scan = http_scan_scalar;
+    LOG_INFO("http request scanner: scalar");
+}
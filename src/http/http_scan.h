@@ -0,0 +1,28 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#include "../types.h"
+
+/*
+ * Finds every ' ', '?', '&', '=', ':', '\r' and '\n' in buf in one pass and stores
+ * their offsets in positions, which has to hold len entries. Returns the count.
+ * len must fit in U16, requests are bounded by the read buffer.
+ */
+typedef U32 (*http_scan_fn)(const char* buf, U32 len, U16* positions);
+
+//picks the widest implementation the cpu supports
+void http_scan_init();
+
+extern http_scan_fn http_scan;
+
+//the implementations to pick from, they all need http_scan_init to have run once.
+//The simd ones only exist on x86 and must not be called on a cpu without them
+U32 http_scan_scalar(const char* buf, U32 len, U16* positions);
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HTTP_SCAN_X86
+U32 http_scan_sse2(const char* buf, U32 len, U16* positions);
+U32 http_scan_avx2(const char* buf, U32 len, U16* positions);
+#endif
+
+#endif
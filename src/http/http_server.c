@@ -1,21 +1,29 @@
+#define _GNU_SOURCE
+
 #include "http_server.h"
 
 #include "../logger.h"
 #include "../common.h"
 #include <immintrin.h>
 #include <string.h>
+#include <strings.h>
 #include <signal.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "../tracker_logic.h"
+#include "../slab_pool.h"
+#include "http_scan.h"
+#include "url_decode.h"
+#include "full_scrape.h"
 
 #define HTTP_PORT 8080
-#define MAX_HEADERS 5
+#define MAX_HEADERS 16
 
 #define PEER_ID_LEN 20
 #define AUTH_ID_LEN 40
+#define AUTH_KEY_LEN (AUTH_ID_LEN / 2)
 #define INFO_HASH_LEN 20
 
 typedef struct {
@@ -34,26 +42,111 @@ typedef struct http_headers_t {
 
 typedef http_headers_t http_param_t;
 
+#define HTTP_RESPONSE_HEADER_SIZE 192
+//a scrape of TRACKER_MAX_SCRAPE torrents has to fit, SCRAPE_ENTRY_MAX bytes each
+#define HTTP_RESPONSE_BODY_SIZE 8192
+#define SCRAPE_ENTRY_MAX 100
+_Static_assert(TRACKER_MAX_SCRAPE * SCRAPE_ENTRY_MAX + 16 <= HTTP_RESPONSE_BODY_SIZE, "scrape response does not fit");
+
+//a request line plus headers has to fit, pipelined requests are parsed out of it one by one
+#define HTTP_READ_BUFFER_SIZE 8192
+
+//parse_uri result for a conditional GET whose ETag still matches
+#define HTTP_NOT_MODIFIED 304
+
+typedef struct http_response_t {
+    uv_write_t req;
+    U32 header_len;
+    U32 body_len;
+    U8 keep_alive;
+    full_scrape_t* scrape;      //full scrape responses write its body instead of body
+    char header[HTTP_RESPONSE_HEADER_SIZE];
+    char body[HTTP_RESPONSE_BODY_SIZE];
+} http_response_t;
+
+typedef struct http_client_t {
+    uv_tcp_t handle;
+    uv_timer_t idle_timer;
+    char* buf;
+    U32 buf_len;
+    U32 requests;
+    U32 pending_writes;
+    U8 open_handles;
+    U8 closing;
+    U8 close_after_write;
+    U8 read_paused;         //MAX_PENDING_WRITES reached, on_write resumes
+    U32 scan_len;           //bytes of buf already run through http_scan
+    U32 scan_count;         //delimiters found in them
+    U32 end_cursor;         //first delimiter not yet checked for the end of a request
+} http_client_t;
+
+
+//responses in flight per connection before it stops reading and parsing
+#define MAX_PENDING_WRITES 8
+#define SLAB_OBJECTS 64
 
 static uv_tcp_t server;
 
+static U64 idle_timeout;
+static U32 max_requests;
+
+//clients, read buffers and responses are recycled through these, all owned by the loop thread
+static slab_pool_t client_pool;
+static slab_pool_t read_buffer_pool;
+static slab_pool_t response_pool;
+
+//delimiters of the client buffer being parsed, offsets into base
+static struct {
+    const char* base;
+    const U16* positions;
+    U32 count;
+    U32 cursor;
+} scan;
+
 static void on_new_connection(uv_stream_t *server, int status);
 static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
+static void on_write(uv_write_t* req, int status);
+static void on_idle_timeout(uv_timer_t* timer);
+static void on_client_close(uv_handle_t* handle);
+static void client_close(http_client_t* client);
+static I32 handle_request(http_client_t* client, const char* buf, const char* buf_end, U32 first_position);
+static void process_requests(http_client_t* client);
 
 static void alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf) {
-	*buf = uv_buf_init(malloc(size), size);
+    http_client_t* client = handle->data;
+
+    if (client->buf == NULL)
+        client->buf = slab_pool_alloc(&read_buffer_pool);
+
+    if (client->buf == NULL) {
+        *buf = uv_buf_init(NULL, 0);
+        return;
+    }
+
+	*buf = uv_buf_init(client->buf + client->buf_len, HTTP_READ_BUFFER_SIZE - client->buf_len);
 }
 
-static I32 parse_request(uv_stream_t* stream, const char* buf, const char* buf_end, char* method, http_headers_t* headers);
-static const char* parse_token(const char* buf, const char* buf_end, char search_char, char** token, size_t* token_len);
-static I32 parse_uri(uv_stream_t* stream, const char* buf, const char* buf_end);
-static size_t decode_urlencoded_param(const char* buf, const char* buf_end, char* dest, U32 max_len);
+static I32 parse_request(uv_stream_t* stream, const char* buf, const char* buf_end, char* method, http_headers_t* headers, http_response_t* res);
+static const char* parse_token(const char* buf, const char* buf_end, char search_char, const char** token, size_t* token_len);
+static I32 parse_uri(uv_stream_t* stream, const char* buf, const char* buf_end, const char* if_none_match, size_t if_none_match_len, http_response_t* res);
 
 
-void http_server_init(uv_loop_t* loop) {
+void http_server_init(uv_loop_t* loop, U32 idle_timeout_ms, U32 max_requests_per_connection, U32 max_connections) {
 
     struct sockaddr_in addr;
 
+    idle_timeout = idle_timeout_ms;
+    max_requests = max_requests_per_connection ? max_requests_per_connection : 1;
+
+    http_scan_init();
+    url_decode_init();
+    full_scrape_init(loop, FULL_SCRAPE_DEFAULT_INTERVAL_MS);
+
+    slab_pool_init(&client_pool, sizeof(http_client_t), SLAB_OBJECTS, max_connections);
+    //every read buffer is followed by the delimiter offsets http_scan found in it
+    slab_pool_init(&read_buffer_pool, HTTP_READ_BUFFER_SIZE + HTTP_READ_BUFFER_SIZE * sizeof(U16), SLAB_OBJECTS, max_connections);
+    slab_pool_init(&response_pool, sizeof(http_response_t), SLAB_OBJECTS, max_connections * MAX_PENDING_WRITES);
+
     uv_tcp_init(loop, &server);
 
     uv_ip4_addr("0.0.0.0", 8080, &addr);
@@ -65,7 +158,8 @@ void http_server_init(uv_loop_t* loop) {
         return;
     }
 
-    LOG_INFO("init web server on port: %u", HTTP_PORT);
+    LOG_INFO("init web server on port: %u, idle timeout: %u ms, max requests per connection: %u, max connections: %u",
+        HTTP_PORT, idle_timeout_ms, max_requests, max_connections);
 
 }   
 
@@ -78,75 +172,346 @@ static void on_new_connection(uv_stream_t *server, int status) {
         return;
     }
 
-    uv_tcp_t *client = (uv_tcp_t*) malloc(sizeof(uv_tcp_t));
-    
+    http_client_t* client = slab_pool_alloc(&client_pool);
+    if (client == NULL) {
+        //out of client slots, accept and drop so the backlog does not fill up
+        uv_tcp_t* reject = malloc(sizeof(uv_tcp_t));
+        if (reject == NULL)
+            return;
+
+        uv_tcp_init(server->loop, reject);
+        if (uv_accept(server, (uv_stream_t*)reject) == 0)
+            LOG_WARN("connection limit reached, dropping client");
+        uv_close((uv_handle_t*)reject, (uv_close_cb)free);
+        return;
+    }
+    memset(client, 0, sizeof *client);
+
+    uv_tcp_init(server->loop, &client->handle);
+    uv_timer_init(server->loop, &client->idle_timer);
+    client->handle.data = client;
+    client->idle_timer.data = client;
+    client->open_handles = 2;
+
+    if (uv_accept(server, (uv_stream_t*)&client->handle) != 0) {
+        client_close(client);
+        return;
+    }
+
+    uv_read_start((uv_stream_t*)&client->handle, alloc_cb, on_read);
+    uv_timer_start(&client->idle_timer, on_idle_timeout, idle_timeout, 0);
+}
+
+static void client_close(http_client_t* client) {
+
+    if (client->closing)
+        return;
+    client->closing = 1;
+
+    uv_timer_stop(&client->idle_timer);
+    uv_close((uv_handle_t*)&client->idle_timer, on_client_close);
+    uv_close((uv_handle_t*)&client->handle, on_client_close);
+}
 
-    uv_tcp_init(server->loop, client);
-    if (uv_accept(server, (uv_stream_t*) client) == 0) {
-        uv_read_start((uv_stream_t*) client, alloc_cb, on_read);
+static void on_client_close(uv_handle_t* handle) {
+    http_client_t* client = handle->data;
+
+    if (--client->open_handles > 0)
+        return;
+
+    slab_pool_free(&read_buffer_pool, client->buf);
+    slab_pool_free(&client_pool, client);
+}
+
+static void on_idle_timeout(uv_timer_t* timer) {
+    LOG_DEBUG("closing idle connection");
+    client_close(timer->data);
+}
+
+static const char* failure_reason(I32 code) {
+    switch (code) {
+        case -2: return "not implemented";
+        case -20: return "invalid request";
+        case -21: return "full scrape not ready, retry later";
+        default: return "internal error";
     }
 }
 
+static inline U16* client_positions(http_client_t* client) {
+    return (U16*)(client->buf + HTTP_READ_BUFFER_SIZE);
+}
+
+//only the bytes that arrived since the last read are scanned, a request split over
+//many reads is still scanned once
+static void scan_client(http_client_t* client) {
+    U16* positions = client_positions(client);
+
+    U32 count = http_scan(client->buf + client->scan_len, client->buf_len - client->scan_len, positions + client->scan_count);
+    for (U32 i = client->scan_count; i < client->scan_count + count; i++)
+        positions[i] += client->scan_len;
+
+    client->scan_count += count;
+    client->scan_len = client->buf_len;
+}
+
+//CRLFCRLF is four delimiters at consecutive offsets, so only the delimiters are walked
+static const char* find_request_end(http_client_t* client) {
+    const U16* positions = client_positions(client);
+    const char* buf = client->buf;
+
+    U32 i = client->end_cursor;
+    for (; i + 3 < client->scan_count; i++) {
+        U32 p = positions[i];
+        if (buf[p] == '\r' && positions[i + 3] == p + 3 && buf[p + 1] == '\n' && buf[p + 2] == '\r' && buf[p + 3] == '\n') {
+            client->end_cursor = i + 4;
+            return buf + p + 4;
+        }
+    }
+
+    client->end_cursor = i;
+    return NULL;
+}
+
 static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
 
-    U8* ptr = buf->base;
+    http_client_t* client = stream->data;
+
     if (nread < 0) {
         LOG_DEBUG("disconnected read error: %s", uv_err_name(nread));
-        uv_close((uv_handle_t*)stream, NULL);
-        free(buf->base);
+        client_close(client);
+        return;
+    }
+
+    if (nread == 0 || client->closing)
+        return;
+
+    client->buf_len += nread;
+    uv_timer_start(&client->idle_timer, on_idle_timeout, idle_timeout, 0);
+
+    process_requests(client);
+}
+
+//answers every complete request in the buffer, in order. With MAX_PENDING_WRITES responses
+//in flight the rest stays buffered and reading stops until on_write frees a slot
+static void process_requests(http_client_t* client) {
+
+    uv_stream_t* stream = (uv_stream_t*)&client->handle;
+
+    if (client->buf_len > client->scan_len)
+        scan_client(client);
+
+    const char* start = client->buf;
+    const char* end = client->buf + client->buf_len;
+    const char* request_end;
+    U32 start_position = 0;
+
+    while (!client->close_after_write) {
+        U32 first = client->end_cursor;
+        if ((request_end = find_request_end(client)) == NULL)
+            break;
+
+        if (client->pending_writes >= MAX_PENDING_WRITES) {
+            client->end_cursor = first;
+            if (!client->read_paused) {
+                uv_read_stop(stream);
+                client->read_paused = 1;
+            }
+            break;
+        }
+
+        if (handle_request(client, start, request_end, start_position) != 0) {
+            client_close(client);
+            return;
+        }
+        start = request_end;
+        start_position = client->end_cursor;
+    }
+
+    if (client->close_after_write) {
+        uv_read_stop(stream);
+        if (client->pending_writes == 0)
+            client_close(client);
         return;
     }
-    
+
+    client->buf_len = end - start;
+
+    if (client->buf_len == HTTP_READ_BUFFER_SIZE && !client->read_paused) {
+        LOG_DEBUG("request too large");
+        client_close(client);
+        return;
+    }
+
+    //idle keep-alive connections do not hold a read buffer
+    if (client->buf_len == 0) {
+        slab_pool_free(&read_buffer_pool, client->buf);
+        client->buf = NULL;
+        client->scan_len = 0;
+        client->scan_count = 0;
+        client->end_cursor = 0;
+    }
+    else if (start != client->buf) {
+        //the unparsed rest and its delimiters move to the front
+        U32 consumed = start - client->buf;
+        U16* positions = client_positions(client);
+
+        memmove(client->buf, start, client->buf_len);
+
+        client->scan_count -= start_position;
+        for (U32 i = 0; i < client->scan_count; i++)
+            positions[i] = positions[start_position + i] - consumed;
+        client->end_cursor -= start_position;
+        client->scan_len -= consumed;
+    }
+
+}
+
+//first_position is the index of the first delimiter of the request
+static I32 handle_request(http_client_t* client, const char* buf, const char* buf_end, U32 first_position) {
+
+    uv_stream_t* stream = (uv_stream_t*)&client->handle;
     char method[10];
 
     http_headers_t headers[MAX_HEADERS] = {};
 
+    http_response_t* res = slab_pool_alloc(&response_pool);
+    if (res == NULL)
+        return -1;
 
-    I32 code = parse_request(stream, buf->base, buf->base + buf->len, method, headers);
+    res->body_len = 0;
+    res->keep_alive = 0;
+    res->scrape = NULL;
 
-    const char* res = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 4\r\n\r\ntest";
-    
+    scan.base = client->buf;
+    scan.positions = client_positions(client);
+    scan.count = client->scan_count;
+    scan.cursor = first_position;
 
-    uv_write_t req;
+    I32 code = parse_request(stream, buf, buf_end, method, headers, res);
+
+    const char* status = "200 OK";
+    if (code == -1) {
+        status = "404 Not Found";
+        res->body_len = 0;
+    }
+    else if (code == HTTP_NOT_MODIFIED) {
+        status = "304 Not Modified";
+        res->body_len = 0;
+    }
+    else if (code != 0) {
+        const char* reason = failure_reason(code);
+        res->body_len = snprintf(res->body, sizeof res->body, "d14:failure reason%zu:%se", strlen(reason), reason);
+    }
+
+    if (++client->requests >= max_requests)
+        res->keep_alive = 0;
+
+    if (!res->keep_alive)
+        client->close_after_write = 1;
+
+    uv_buf_t body = uv_buf_init(res->body, res->body_len);
+    size_t content_length = res->body_len;
+    if (res->scrape != NULL && code == 0) {
+        //written straight from the shared body, no copy
+        body = uv_buf_init(res->scrape->data, res->scrape->len);
+        content_length = res->scrape->len;
+    }
+
+    //a 304 has no body, a Content-Length there would describe the body it stands for
+    char length_line[40] = "";
+    if (code != HTTP_NOT_MODIFIED)
+        snprintf(length_line, sizeof length_line, "Content-Length: %zu\r\n", content_length);
+
+    res->header_len = snprintf(res->header, sizeof res->header,
+        "HTTP/1.1 %s\r\nContent-Type: text/plain\r\n%sConnection: %s\r\n%s%s%s\r\n",
+        status, length_line, res->keep_alive ? "keep-alive" : "close",
+        res->scrape ? "ETag: " : "", res->scrape ? res->scrape->etag : "", res->scrape ? "\r\n" : "");
+
+    int r = uv_write(&res->req, stream, (const uv_buf_t[]) {
+        { .base = res->header, .len = res->header_len },
+        body
+    }, 2, on_write);
+
+    if (r != 0) {
+        full_scrape_release(res->scrape);
+        slab_pool_free(&response_pool, res);
+        return -1;
+    }
 
-    uv_write(&req, stream, (const uv_buf_t[]) {
-        { .base = res, .len = strlen(res)}
-    }, 1, NULL);
+    client->pending_writes++;
+    return 0;
+}
+
+static void on_write(uv_write_t* req, int status) {
+
+    //the response goes back to the pool first, process_requests may reuse it
+    uv_stream_t* stream = req->handle;
+    http_client_t* client = stream->data;
+
+    if (status < 0)
+        LOG_DEBUG("write error: %s", uv_err_name(status));
+
+    full_scrape_release(((http_response_t*)req)->scrape);
+    slab_pool_free(&response_pool, req);
+
+    if (--client->pending_writes == 0 && client->close_after_write) {
+        client_close(client);
+        return;
+    }
 
-    uv_close((uv_handle_t*)stream, NULL);
-    free(buf->base);
+    if (client->read_paused && !client->closing) {
+        client->read_paused = 0;
+        process_requests(client);
+        if (!client->read_paused && !client->close_after_write && !client->closing)
+            uv_read_start(stream, alloc_cb, on_read);
+    }
+}
 
+static inline int header_equals(const char* value, size_t value_len, const char* str, size_t str_len) {
+    return value_len == str_len && strncasecmp(value, str, str_len) == 0;
 }
 
-static I32 parse_request(uv_stream_t* stream, const char* buf, const char* buf_end, char* method, http_headers_t* headers) {
+static I32 parse_request(uv_stream_t* stream, const char* buf, const char* buf_end, char* method, http_headers_t* headers, http_response_t* res) {
 
-    char* method_test = NULL;
+    const char* method_test = NULL;
     size_t method_len = 0;
     //method
     buf = parse_token(buf, buf_end, ' ', &method_test, &method_len);
-    if (strncmp(method_test, "GET", method_len) != 0) {
+    if (buf == NULL || method_len != 3 || memcmp(method_test, "GET", 3) != 0) {
         return -2;
     }
 
     //uri
-    char* uri = NULL;
+    const char* uri = NULL;
     size_t uri_len = 0;
 
     buf = parse_token(buf, buf_end, ' ', &uri, &uri_len);
-    LOG_DEBUG("URI: %.*s", uri_len, uri);
+    if (buf == NULL)
+        return -20;
+    LOG_DEBUG("URI: %.*s", (int)uri_len, uri);
 
 
     //http version
-    char* version = NULL;
+    const char* version = NULL;
     size_t version_len = 0;
     buf = parse_token(buf, buf_end, '\n', &version, &version_len);
-    LOG_DEBUG("HTTP VERSION: %.*s", version_len, version);
+    if (buf == NULL)
+        return -20;
+    LOG_DEBUG("HTTP VERSION: %.*s", (int)version_len, version);
+
+    //HTTP/1.1 keeps the connection open by default, HTTP/1.0 has to ask for it
+    res->keep_alive = !(version_len >= 8 && memcmp(version, "HTTP/1.0", 8) == 0);
 
     U32 i = 0;
+    const char* if_none_match = NULL;
+    size_t if_none_match_len = 0;
 
     LOG_DEBUG("parsing headers...");
-    while (buf != buf_end && i < MAX_HEADERS) {
-        char* key = NULL;
+    while (buf < buf_end && i < MAX_HEADERS) {
+        if (buf + 1 < buf_end && buf[0] == '\r' && buf[1] == '\n')
+            break;
+
+        const char* key = NULL;
         size_t key_len = 0;
 
         buf = parse_token(buf, buf_end, ':', &key, &key_len);
@@ -157,7 +522,7 @@ static I32 parse_request(uv_stream_t* stream, const char* buf, const char* buf_e
 
         ++buf;
 
-        char* value = NULL;
+        const char* value = NULL;
         size_t value_len = 0;
 
         buf = parse_token(buf, buf_end, '\r', &value, &value_len);
@@ -166,21 +531,37 @@ static I32 parse_request(uv_stream_t* stream, const char* buf, const char* buf_e
             break;
         }
 
-        if (*++buf == '\n') {
+        if (buf < buf_end && *buf == '\n') {
             buf++;
         }
 
-        LOG_DEBUG("header: %.*s value: %.*s", key_len, key, value_len, value);
+        LOG_DEBUG("header: %.*s value: %.*s", (int)key_len, key, (int)value_len, value);
         
         headers[i].key = key;
         headers[i].key_len = key_len;
         headers[i].value = value;
         headers[i].value_len = value_len;
 
+        if (header_equals(key, key_len, "Connection", 10)) {
+            while (value_len > 0 && *value == ' ') {
+                value++;
+                value_len--;
+            }
+
+            if (header_equals(value, value_len, "close", 5))
+                res->keep_alive = 0;
+            else if (header_equals(value, value_len, "keep-alive", 10))
+                res->keep_alive = 1;
+        }
+        else if (header_equals(key, key_len, "If-None-Match", 13)) {
+            if_none_match = value;
+            if_none_match_len = value_len;
+        }
+
         i++;
     }
 
-    return parse_uri(stream, uri, uri + uri_len);
+    return parse_uri(stream, uri, uri + uri_len, if_none_match, if_none_match_len, res);
 }
 
 
@@ -188,21 +569,21 @@ static const search_value search_values[] = {
     { "auth", 4 }, { "info_hash",  9 }, { "peer_id", 7 }, { "port", 4 }, { "uploaded", 8 }, { "downloaded", 10 }, { "left", 4 }, { "event", 5 }, { "numwant", 7 }
 };
 
-static I32 parse_query(const char** buf, const char** buf_end, char** query, size_t* query_len, char** value, size_t* value_len) {
+//info_hash, peer_id and port
+#define ANNOUNCE_REQUIRED ((1 << 1) | (1 << 2) | (1 << 3))
+
+static I32 parse_query(const char** buf, const char* buf_end, const char** query, size_t* query_len, const char** value, size_t* value_len) {
  
-        *buf = parse_token(*buf, *buf_end, '=', query, query_len);
+        *buf = parse_token(*buf, buf_end, '=', query, query_len);
         if (*buf == NULL) {
             LOG_DEBUG("buf == NULL when parsing query name.");
             return -3;
         }
 
-        *buf = parse_token(*buf, *buf_end, '&', value, value_len);
-        if (*buf == NULL) {
-            LOG_DEBUG("buf == NULL when parsing query value.");
-            return -3;
-        }
+        //the last value runs to the end of the uri, *buf becomes NULL and ends the loop
+        *buf = parse_token(*buf, buf_end, '&', value, value_len);
 
-        search_value* ptr = search_values;
+        const search_value* ptr = search_values;
 
         size_t s = sizeof(search_values) / sizeof(search_value);
 
@@ -217,62 +598,186 @@ static I32 parse_query(const char** buf, const char** buf_end, char** query, siz
     return -1;
 }
 
-static I32 parse_uri(uv_stream_t* stream, const char* buf, const char* buf_end) {
+static U64 parse_number(const char* value, size_t value_len) {
+    U64 n = 0;
+    for (size_t i = 0; i < value_len && value[i] >= '0' && value[i] <= '9'; i++)
+        n = n * 10 + (value[i] - '0');
+    return n;
+}
 
-    char* path = NULL;
-    size_t path_len = 0;
+//auth ids are AUTH_ID_LEN hex characters
+static I32 parse_auth(const char* value, size_t value_len, U8* key) {
+    if (value_len != AUTH_ID_LEN)
+        return -1;
+
+    for (size_t i = 0; i < AUTH_ID_LEN; i++) {
+        char c = value[i] | 0x20;
+        U8 nibble;
+        if (c >= '0' && c <= '9')
+            nibble = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            nibble = c - 'a' + 10;
+        else
+            return -1;
+
+        key[i / 2] = (i & 1) ? (key[i / 2] | nibble) : (nibble << 4);
+    }
+    return 0;
+}
 
-    const char* buf_start = buf;
+static inline int value_equals(const char* value, size_t value_len, const char* str, size_t str_len) {
+    return value_len == str_len && memcmp(value, str, str_len) == 0;
+}
 
-    buf = parse_token(buf, buf_end, '?', &path, &path_len);
-    if (buf == NULL)
+static I32 write_announce(uv_stream_t* stream, tracker_announce_t* announce, http_response_t* res) {
+
+    struct sockaddr_storage peer_addr;
+    int addr_len = sizeof peer_addr;
+
+    if (uv_tcp_getpeername((uv_tcp_t*)stream, (struct sockaddr*)&peer_addr, &addr_len) != 0 || peer_addr.ss_family != AF_INET)
         return -20;
 
+    announce->ip = ((struct sockaddr_in*)&peer_addr)->sin_addr.s_addr;
+
+    U8 peers[TRACKER_MAX_NUMWANT * COMPACT_PEER_LEN];
+    tracker_announce_result_t result;
+
+    if (tracker_announce(announce, peers, TRACKER_MAX_NUMWANT, &result) != 0)
+        return -3;
+
+    U32 peers_len = result.peer_count * COMPACT_PEER_LEN;
+
+    res->body_len = snprintf(res->body, sizeof res->body, "d8:completei%ue10:incompletei%ue8:intervali%ue5:peers%u:",
+        result.seeders, result.leechers, TRACKER_ANNOUNCE_INTERVAL, peers_len);
+
+    memcpy(res->body + res->body_len, peers, peers_len);
+    res->body_len += peers_len;
+    res->body[res->body_len++] = 'e';
+
+    return 0;
+}
+
+//bencoded dictionaries need sorted keys, duplicates and unknown torrents are left out (BEP 48)
+static I32 write_scrape(const U8* info_hashes, U32 count, http_response_t* res) {
+
+    tracker_scrape_result_t results[TRACKER_MAX_SCRAPE];
+    tracker_scrape((const char*)info_hashes, count, results);
+
+    U8 order[TRACKER_MAX_SCRAPE];
+    for (U32 i = 0; i < count; i++) {
+        U32 j = i;
+        for (; j > 0 && memcmp(info_hashes + order[j - 1] * INFO_HASH_LEN, info_hashes + i * INFO_HASH_LEN, INFO_HASH_LEN) > 0; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
 
-    U8 info_hash[INFO_HASH_LEN] = {};
-    U8 peer_id[PEER_ID_LEN] = {};
-    U8 auth[AUTH_ID_LEN] = {};
+    char* body = res->body;
+    U32 len = snprintf(body, sizeof res->body, "d5:filesd");
+
+    for (U32 k = 0; k < count; k++) {
+        U32 i = order[k];
+        const U8* info_hash = info_hashes + i * INFO_HASH_LEN;
+
+        if (!results[i].found)
+            continue;
+        if (k > 0 && memcmp(info_hashes + order[k - 1] * INFO_HASH_LEN, info_hash, INFO_HASH_LEN) == 0)
+            continue;
+
+        len += snprintf(body + len, sizeof res->body - len, "20:");
+        memcpy(body + len, info_hash, INFO_HASH_LEN);
+        len += INFO_HASH_LEN;
+        len += snprintf(body + len, sizeof res->body - len, "d8:completei%ue10:downloadedi%ue10:incompletei%uee",
+            results[i].seeders, results[i].completed, results[i].leechers);
+    }
+
+    body[len++] = 'e';
+    body[len++] = 'e';
+    res->body_len = len;
+
+    return 0;
+}
+
+//full scrape bodies are built in the background, a request only takes a reference to the current one
+static I32 write_full_scrape(const char* if_none_match, size_t if_none_match_len, http_response_t* res) {
+
+    res->scrape = full_scrape_acquire();
+    if (res->scrape == NULL)
+        return -21;
+
+    //If-None-Match may list several tags, any of them matching is enough
+    if (if_none_match != NULL && memmem(if_none_match, if_none_match_len, res->scrape->etag, res->scrape->etag_len) != NULL)
+        return HTTP_NOT_MODIFIED;
+
+    return 0;
+}
+
+static I32 parse_uri(uv_stream_t* stream, const char* buf, const char* buf_end, const char* if_none_match, size_t if_none_match_len, http_response_t* res) {
+
+    const char* path = NULL;
+    size_t path_len = 0;
+
+    //without a '?' the whole uri is the path and there is no query
+    buf = parse_token(buf, buf_end, '?', &path, &path_len);
+
+
+    //scrapes repeat info_hash, announces use the first one
+    U8 info_hashes[TRACKER_MAX_SCRAPE * INFO_HASH_LEN];
+    U32 hash_count = 0;
+    U8 peer_id[PEER_ID_LEN] = {0};
+    U8 auth[AUTH_KEY_LEN] = {0};
     U16 port = 0;
 
-    U32 uploaded = 0;
-    U32 downloaded = 0;
-    U32 left = 0;
+    U64 uploaded = 0;
+    U64 downloaded = 0;
+    U64 left = 0;
+    U32 numwant = TRACKER_DEFAULT_NUMWANT;
 
-    EVENT event = EVENT_STARTED;
+    EVENT event = EVENT_NONE;
 
-    char* query = NULL;
+    const char* query = NULL;
     size_t query_len = 0;
 
-    char* value = NULL;
+    const char* value = NULL;
     size_t value_len = 0;
 
-    while (buf <= buf_end) {
+    U32 found = 0;
+
+    while (buf != NULL && buf < buf_end) {
 
-        I32 res = parse_query(&buf, &buf_end, &query, &query_len, &value, &value_len);
+        I32 res = parse_query(&buf, buf_end, &query, &query_len, &value, &value_len);
         if (res == -3)
             break;
 
+        if (res >= 0)
+            found |= 1 << res;
+
         switch (res)
         {
             case 0: { //auth
+                if (parse_auth(value, value_len, auth) != 0) {
+                    return -20;
+                }
                 break;
             }
 
             case 1: { //info_hash
-                if (decode_urlencoded_param(value, value + value_len, info_hash, INFO_HASH_LEN) != INFO_HASH_LEN) {
+                if (hash_count == TRACKER_MAX_SCRAPE)
+                    return -20;
+                if (url_decode(value, value_len, info_hashes + hash_count * INFO_HASH_LEN, INFO_HASH_LEN) != INFO_HASH_LEN) {
                     return -20;
                 }
+                hash_count++;
                 break;
             }
             case 2: { //peer_id
-                if (decode_urlencoded_param(value, value + value_len, peer_id, PEER_ID_LEN) != PEER_ID_LEN) {
+                if (url_decode(value, value_len, peer_id, PEER_ID_LEN) != PEER_ID_LEN) {
                     return -20;
                 }
 
                 break;
             }
             case 3: { //port
-                port = strtoul(value, (char**)(&value + value_len), 10);
+                port = parse_number(value, value_len);
                 if (port == 0) {
                     return -20;
                 }
@@ -280,41 +785,64 @@ static I32 parse_uri(uv_stream_t* stream, const char* buf, const char* buf_end)
                 break;
             }
             case 4: { //uploaded
-                uploaded = strtoul(value, (char**)(&value + value_len), 10);
+                uploaded = parse_number(value, value_len);
                 break;
             }
             case 5: {
-                downloaded = strtoul(value, (char**)(&value + value_len), 10);
+                downloaded = parse_number(value, value_len);
                 break;
             }
             case 6: { //left
-
+                left = parse_number(value, value_len);
+                break;
             }
             case 7: { //event
-                if (memcmp(value, "started", value_len) == 0)
+                if (value_equals(value, value_len, "started", 7))
                     event = EVENT_STARTED;
-                else if (memcmp(value, "stopped", value_len) == 0)
+                else if (value_equals(value, value_len, "stopped", 7))
                     event = EVENT_STOPPED;
-                else if (memcmp(value, "completed", value_len) == 0)
+                else if (value_equals(value, value_len, "completed", 9))
                     event = EVENT_COMPLETED;
 
                 break;
             }
+            case 8: { //numwant
+                numwant = parse_number(value, value_len);
+                break;
+            }
             case -1:
             default:
                 break;
         }
     }
 
-    if (strncmp(path, "/announce", path_len) == 0) {
-        LOG_DEBUG("info_hash: %x, peer_id: %s, port: %u, downloaded: %u, uploaded: %u, event: %d \n",
-                info_hash, peer_id, port, downloaded, uploaded, event);
-        
-        return 0;
+    if (value_equals(path, path_len, "/announce", 9)) {
+        if ((found & ANNOUNCE_REQUIRED) != ANNOUNCE_REQUIRED)
+            return -20;
+
+        LOG_DEBUG("peer_id: %.20s, port: %u, downloaded: %lu, uploaded: %lu, left: %lu, event: %d",
+                peer_id, port, downloaded, uploaded, left, event);
+
+        tracker_announce_t announce = {
+            .info_hash = (const char*)info_hashes,
+            .peer_id = (const char*)peer_id,
+            .port = htons(port),
+            .left = left,
+            .uploaded = uploaded,
+            .downloaded = downloaded,
+            .event = event,
+            .numwant = numwant,
+            .auth_key = (found & 1) ? (const char*)auth : NULL,
+        };
+
+        return write_announce(stream, &announce, res);
     }
-    else if (strncmp(path, "/scrape", path_len) == 0) {
-        LOG_DEBUG("Scrape not implemented");
-        return -2;
+    else if (value_equals(path, path_len, "/scrape", 7)) {
+        //a scrape without info_hash asks for every torrent
+        if (hash_count == 0)
+            return write_full_scrape(if_none_match, if_none_match_len, res);
+
+        return write_scrape(info_hashes, hash_count, res);
     }
 
     return -1;
@@ -323,61 +851,46 @@ static I32 parse_uri(uv_stream_t* stream, const char* buf, const char* buf_end)
 
 
 
-static unsigned char fromhex(unsigned char x) {
-  x-='0'; if( x<=9) return x;
-  x&=~0x20; x-='A'-'0';
-  if( x<6 ) return x+10;
-  return 0xff;
-}
-
-static size_t decode_urlencoded_param(const char* buf, const char* buf_end, char* dest, U32 max_len) {
-
-    U32 i = 0;
-    U8 hi = 0;
-    U8 lo = 0;
-    U8 res = 0;
-    while (buf <= buf_end && i < max_len) {
-
-        if (*buf++ == '%') {
-            hi = fromhex(*buf++);
-            lo = fromhex(*buf++);
-            *dest++ = (hi << 4) | lo;
-        }
-        else {
-            *dest++ = *buf;
-        }
+static U32 scan_lower_bound(U32 offset) {
+    U32 lo = 0;
+    U32 hi = scan.count;
 
-        i++;
+    while (lo < hi) {
+        U32 mid = (lo + hi) / 2;
+        if (scan.positions[mid] < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-
-    return i;
+    return lo;
 }
 
-static const char* parse_token(const char* buf, const char* buf_end, char search_char, char** token, size_t* token_len) {
+//token is [buf, first search_char before buf_end), returns the byte after it.
+//If there is none the token runs to buf_end and NULL is returned.
+static const char* parse_token(const char* buf, const char* buf_end, char search_char, const char** token, size_t* token_len) {
 
-    char* buf_start = buf;
+    U32 offset = buf - scan.base;
+    U32 end = buf_end - scan.base;
 
-    char* end = strchr(buf, search_char);
-    if (end == NULL)
-        return NULL;
+    //parsing mostly moves forward, only the uri is revisited after the headers
+    U32 i = scan.cursor;
+    if (i > 0 && scan.positions[i - 1] >= offset)
+        i = scan_lower_bound(offset);
 
-    while (1) {
+    while (i < scan.count && scan.positions[i] < offset)
+        i++;
 
-        if (buf == buf_end) {
-            break;
-        }
+    *token = buf;
 
-        if (*buf == search_char) {
-            break;
+    for (; i < scan.count && scan.positions[i] < end; i++) {
+        if (scan.base[scan.positions[i]] == search_char) {
+            *token_len = scan.positions[i] - offset;
+            scan.cursor = i + 1;
+            return scan.base + scan.positions[i] + 1;
         }
-        ++buf;
     }
 
-    *token = buf_start;
-    *token_len = buf - buf_start;
-
-    if (buf + 1 != buf_end)
-        buf++;
-    
-    return buf;
+    *token_len = end - offset;
+    scan.cursor = i;
+    return NULL;
 }
@@ -3,8 +3,14 @@
 
 #include <uv.h>
 
+#include "../types.h"
 
-void http_server_init(uv_loop_t* loop);
+#define HTTP_DEFAULT_IDLE_TIMEOUT 15000
+#define HTTP_DEFAULT_MAX_REQUESTS 100
+#define HTTP_DEFAULT_MAX_CONNECTIONS 16384
+
+
+void http_server_init(uv_loop_t* loop, U32 idle_timeout_ms, U32 max_requests_per_connection, U32 max_connections);
 
 
 
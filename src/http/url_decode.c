@@ -0,0 +1,230 @@
+#include "url_decode.h"
+
+#include "../logger.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define URL_DECODE_X86
+#endif
+
+#define WINDOW 64
+
+/*
+ * Classifies one window of WINDOW bytes (block is zero padded to WINDOW + 32).
+ * pct gets a bit for every '%', hex a bit for every hex digit and out[p] holds the
+ * decoded byte of the escape starting at p, or the raw byte for everything else.
+ */
+typedef void (*classify_fn)(const U8* block, U8* out, U64* pct, U64* hex);
+
+static classify_fn classify;
+
+static U8 nibble_table[256];
+
+static void classify_scalar(const U8* block, U8* out, U64* pct, U64* hex) {
+
+    U64 p = 0;
+    U64 h = 0;
+
+    for (U32 i = 0; i < WINDOW; i++) {
+        p |= (U64)(block[i] == '%') << i;
+        h |= (U64)(nibble_table[block[i]] < 16) << i;
+
+        U8 esc = (nibble_table[block[i + 1]] << 4) | (nibble_table[block[i + 2]] & 0x0f);
+        out[i] = block[i] == '%' ? esc : block[i];
+    }
+
+    *pct = p;
+    *hex = h;
+}
+
+#ifdef URL_DECODE_X86
+
+//hex digit value of every byte, valid gets 0xff where the byte is a hex digit
+static inline __m128i nibbles_sse2(__m128i v, __m128i* valid) {
+
+    __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    __m128i a = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+
+    __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+    __m128i is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(a, _mm_set1_epi8(5)), a);
+
+    *valid = _mm_or_si128(is_digit, is_alpha);
+    return _mm_or_si128(_mm_and_si128(is_digit, d),
+                        _mm_and_si128(is_alpha, _mm_add_epi8(a, _mm_set1_epi8(10))));
+}
+
+static void classify_sse2(const U8* block, U8* out, U64* pct, U64* hex) {
+
+    U64 p = 0;
+    U64 h = 0;
+
+    for (U32 i = 0; i < WINDOW; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(block + i));
+        __m128i hi_valid, lo_valid, valid;
+
+        __m128i hi = nibbles_sse2(_mm_loadu_si128((const __m128i*)(block + i + 1)), &hi_valid);
+        __m128i lo = nibbles_sse2(_mm_loadu_si128((const __m128i*)(block + i + 2)), &lo_valid);
+        nibbles_sse2(v, &valid);
+
+        __m128i esc = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(hi, 4), _mm_set1_epi8(0xf0)), lo);
+        __m128i is_pct = _mm_cmpeq_epi8(v, _mm_set1_epi8('%'));
+
+        _mm_storeu_si128((__m128i*)(out + i), _mm_or_si128(_mm_and_si128(is_pct, esc), _mm_andnot_si128(is_pct, v)));
+
+        p |= (U64)(U16)_mm_movemask_epi8(is_pct) << i;
+        h |= (U64)(U16)_mm_movemask_epi8(valid) << i;
+    }
+
+    *pct = p;
+    *hex = h;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i nibbles_avx2(__m256i v, __m256i* valid) {
+
+    __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+    __m256i a = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+
+    __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+    __m256i is_alpha = _mm256_cmpeq_epi8(_mm256_min_epu8(a, _mm256_set1_epi8(5)), a);
+
+    *valid = _mm256_or_si256(is_digit, is_alpha);
+    return _mm256_or_si256(_mm256_and_si256(is_digit, d),
+                           _mm256_and_si256(is_alpha, _mm256_add_epi8(a, _mm256_set1_epi8(10))));
+}
+
+__attribute__((target("avx2")))
+static void classify_avx2(const U8* block, U8* out, U64* pct, U64* hex) {
+
+    U64 p = 0;
+    U64 h = 0;
+
+    for (U32 i = 0; i < WINDOW; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(block + i));
+        __m256i hi_valid, lo_valid, valid;
+
+        __m256i hi = nibbles_avx2(_mm256_loadu_si256((const __m256i*)(block + i + 1)), &hi_valid);
+        __m256i lo = nibbles_avx2(_mm256_loadu_si256((const __m256i*)(block + i + 2)), &lo_valid);
+        nibbles_avx2(v, &valid);
+
+        __m256i esc = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(hi, 4), _mm256_set1_epi8(0xf0)), lo);
+        __m256i is_pct = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('%'));
+
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_blendv_epi8(v, esc, is_pct));
+
+        p |= (U64)(U32)_mm256_movemask_epi8(is_pct) << i;
+        h |= (U64)(U32)_mm256_movemask_epi8(valid) << i;
+    }
+
+    *pct = p;
+    *hex = h;
+}
+
+#endif
+
+I32 url_decode(const char* buf, U32 len, U8* dest, U32 max_len) {
+
+    U8 block[WINDOW + 32];
+    U8 out[WINDOW];
+
+    U32 written = 0;
+    U32 i = 0;
+
+    while (i < len) {
+        U32 n = len - i < WINDOW ? len - i : WINDOW;
+
+        //the padding is zero, which is neither '%' nor a hex digit
+        memcpy(block, buf + i, n);
+        memset(block + n, 0, sizeof block - n);
+
+        U64 pct, hex;
+        classify(block, out, &pct, &hex);
+
+        U64 valid = n == WINDOW ? ~0ULL : (1ULL << n) - 1;
+        pct &= valid;
+
+        //an escape cut by the window edge is decoded with the next window
+        if (i + n < len) {
+            U64 cut = pct & ~(valid >> 2);
+            if (cut) {
+                n = __builtin_ctzll(cut);
+                valid = (1ULL << n) - 1;
+                pct &= valid;
+            }
+        }
+
+        //every '%' needs two hex digits, also rejects a truncated escape at the end
+        if (pct & ~((hex >> 1) & (hex >> 2)))
+            return -1;
+
+        U64 keep = valid & ~(pct << 1) & ~(pct << 2);
+        U32 count = __builtin_popcountll(keep);
+        if (written + count > max_len)
+            return -1;
+
+        if (keep == valid) {
+            memcpy(dest + written, out, n);
+        }
+        else {
+            U8* d = dest + written;
+            while (keep) {
+                *d++ = out[__builtin_ctzll(keep)];
+                keep &= keep - 1;
+            }
+        }
+
+        written += count;
+        i += n;
+    }
+
+    return written;
+}
+
+void url_decode_init() {
+
+    memset(nibble_table, 0xff, sizeof nibble_table);
+    for (U32 c = 0; c < 10; c++)
+        nibble_table['0' + c] = c;
+    for (U32 c = 0; c < 6; c++) {
+        nibble_table['a' + c] = 10 + c;
+        nibble_table['A' + c] = 10 + c;
+    }
+
+    if (url_decode_select(URL_DECODE_AVX2) == 0) {
+        LOG_INFO("url decoder: avx2");
+    }
+    else if (url_decode_select(URL_DECODE_SSE2) == 0) {
+        LOG_INFO("url decoder: sse2");
+    }
+    else {
+        url_decode_select(URL_DECODE_SCALAR);
+        LOG_INFO("url decoder: scalar");
+    }
+}
+
+I32 url_decode_select(url_decode_impl_t impl) {
+
+    switch (impl) {
+        case URL_DECODE_SCALAR:
+            classify = classify_scalar;
+            return 0;
+#ifdef URL_DECODE_X86
+        case URL_DECODE_SSE2:
+            __builtin_cpu_init();
+            if (!__builtin_cpu_supports("sse2"))
+                return -1;
+            classify = classify_sse2;
+            return 0;
+        case URL_DECODE_AVX2:
+            __builtin_cpu_init();
+            if (!__builtin_cpu_supports("avx2"))
+                return -1;
+            classify = classify_avx2;
+            return 0;
+#endif
+        default:
+            return -1;
+    }
+}
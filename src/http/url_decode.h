@@ -0,0 +1,24 @@
+#ifndef URL_DECODE_H
+#define URL_DECODE_H
+
+#include "../types.h"
+
+/*
+ * Percent-decodes [buf, buf + len) into dest. Returns the decoded length, or -1 when
+ * an escape is not followed by two hex digits or the result does not fit in max_len.
+ */
+I32 url_decode(const char* buf, U32 len, U8* dest, U32 max_len);
+
+typedef enum url_decode_impl_t {
+    URL_DECODE_SCALAR = 0,
+    URL_DECODE_SSE2,
+    URL_DECODE_AVX2
+} url_decode_impl_t;
+
+//picks the widest classifier the cpu supports
+void url_decode_init();
+
+//switches to the given classifier, -1 when the cpu or the build does not have it
+I32 url_decode_select(url_decode_impl_t impl);
+
+#endif
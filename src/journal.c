@@ -0,0 +1,532 @@
+#include "journal.h"
+
+#include "logger.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOURNAL_PATH_LEN 256
+#define QUEUE_INITIAL_CAPACITY 1024
+#define WRITE_RETRY_SECS 1
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    I32 running;
+    I32 stop;
+
+    //producers append to queue, the writer swaps it with batch
+    journal_record_t* queue;
+    U32 count;
+    U32 capacity;
+    journal_record_t* batch;
+    U32 batch_capacity;
+
+    U64 next_lsn;
+    U64 durable_lsn;
+
+    I32 rotate_pending;
+    U32 rotate_at;
+    U32 rotate_segment;
+    U32 next_segment;
+
+    //writer only
+    int fd;
+    off_t segment_size;     //bytes of fd known to be written and synced
+    I32 failed;
+    char path[JOURNAL_PATH_LEN];
+} journal;
+
+static U32 record_checksum(const journal_record_t* record);
+static I32 list_segments(const char* path, U32** segments, U32* count);
+static void segment_path(const char* path, U32 segment, char* dest, size_t size);
+static I32 open_segment(U32 segment);
+static I32 write_batch(const journal_record_t* records, U32 count);
+static I32 discard_partial_write();
+static I32 writer_wait_retry();
+static void* writer_main(void* arg);
+
+
+//FNV-1a
+static U32 record_checksum(const journal_record_t* record) {
+    const U8* p = (const U8*)record;
+    U32 h = 2166136261u;
+
+    for (size_t i = 0; i < offsetof(journal_record_t, checksum); i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void segment_path(const char* path, U32 segment, char* dest, size_t size) {
+    snprintf(dest, size, "%s.%08u", path, segment);
+}
+
+static int compare_u32(const void* a, const void* b) {
+    U32 x = *(const U32*)a;
+    U32 y = *(const U32*)b;
+    return (x > y) - (x < y);
+}
+
+//sorted segment numbers of <path>.<n> files
+static I32 list_segments(const char* path, U32** segments, U32* count) {
+
+    char dir[JOURNAL_PATH_LEN] = ".";
+    const char* base = path;
+
+    const char* slash = strrchr(path, '/');
+    if (slash != NULL) {
+        size_t len = slash - path;
+        if (len >= sizeof dir)
+            return -1;
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+        if (len == 0)
+            strcpy(dir, "/");
+        base = slash + 1;
+    }
+
+    DIR* d = opendir(dir);
+    if (d == NULL)
+        return -1;
+
+    size_t base_len = strlen(base);
+    U32 capacity = 0;
+    *segments = NULL;
+    *count = 0;
+
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        const char* name = entry->d_name;
+        if (strncmp(name, base, base_len) != 0 || name[base_len] != '.')
+            continue;
+
+        char* end;
+        unsigned long segment = strtoul(name + base_len + 1, &end, 10);
+        if (*end != '\0' || end == name + base_len + 1)
+            continue;
+
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            U32* grown = realloc(*segments, capacity * sizeof(U32));
+            if (grown == NULL) {
+                closedir(d);
+                free(*segments);
+                return -1;
+            }
+            *segments = grown;
+        }
+        (*segments)[(*count)++] = (U32)segment;
+    }
+    closedir(d);
+
+    if (*count > 1)
+        qsort(*segments, *count, sizeof(U32), compare_u32);
+    return 0;
+}
+
+I64 journal_replay(const char* path, journal_apply_fn apply, U64* next_lsn) {
+
+    U32* segments;
+    U32 count;
+    if (list_segments(path, &segments, &count) != 0) {
+        LOG_ERROR("journal_replay(): cannot list segments of %s", path);
+        return -1;
+    }
+
+    I64 applied = 0;
+    for (U32 i = 0; i < count; i++) {
+        char name[JOURNAL_PATH_LEN + 16];
+        segment_path(path, segments[i], name, sizeof name);
+
+        int fd = open(name, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            LOG_ERROR("journal_replay(): open(%s): %s", name, strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+
+        size_t records = st.st_size / sizeof(journal_record_t);
+        if (records == 0) {
+            close(fd);
+            continue;
+        }
+
+        const journal_record_t* map = mmap(NULL, records * sizeof(journal_record_t), PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            LOG_ERROR("journal_replay(): mmap(%s): %s", name, strerror(errno));
+            continue;
+        }
+
+        size_t r = 0;
+        for (; r < records; r++) {
+            const journal_record_t* record = &map[r];
+            if (record->lsn == 0 || record->checksum != record_checksum(record))
+                break;
+
+            apply(record);
+            applied++;
+            if (record->lsn >= *next_lsn)
+                *next_lsn = record->lsn + 1;
+        }
+
+        //only the tail of a segment can be torn by a crash
+        if (r < records)
+            LOG_WARN("journal: %s has %lu unreadable records at the end, ignored", name, records - r);
+
+        munmap((void*)map, records * sizeof(journal_record_t));
+    }
+
+    free(segments);
+    LOG_INFO("journal: replayed %ld records from %u segments", applied, count);
+    return applied;
+}
+
+static I32 open_segment(U32 segment) {
+
+    char name[JOURNAL_PATH_LEN + 16];
+    segment_path(journal.path, segment, name, sizeof name);
+
+    if (journal.fd >= 0)
+        close(journal.fd);
+
+    journal.fd = open(name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (journal.fd < 0) {
+        LOG_ERROR("journal: open(%s): %s", name, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    journal.segment_size = fstat(journal.fd, &st) == 0 ? st.st_size : 0;
+
+    //make the new file itself survive a crash
+    char dir[JOURNAL_PATH_LEN] = ".";
+    const char* slash = strrchr(journal.path, '/');
+    if (slash != NULL && slash != journal.path) {
+        memcpy(dir, journal.path, slash - journal.path);
+        dir[slash - journal.path] = '\0';
+    }
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
+
+    return 0;
+}
+
+static I32 write_batch(const journal_record_t* records, U32 count) {
+
+    if (count == 0 || journal.fd < 0)
+        return count == 0 ? 0 : -1;
+
+    const U8* p = (const U8*)records;
+    size_t size = (size_t)count * sizeof(journal_record_t);
+
+    while (size > 0) {
+        ssize_t n = write(journal.fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("journal: write: %s", strerror(errno));
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+
+    if (fdatasync(journal.fd) != 0) {
+        LOG_ERROR("journal: fdatasync: %s", strerror(errno));
+        return -1;
+    }
+
+    journal.segment_size += (off_t)count * sizeof(journal_record_t);
+    return 0;
+}
+
+//replay stops reading a segment at a torn record, so whatever a failed write left behind
+//is cut off. Returns -1 when the segment cannot be cut back
+static I32 discard_partial_write() {
+    if (journal.fd >= 0 && ftruncate(journal.fd, journal.segment_size) == 0)
+        return 0;
+    return -1;
+}
+
+//the batch stays with the writer until it is written, appends keep queueing behind it.
+//Returns -1 once the journal is stopping
+static I32 writer_wait_retry() {
+
+    if (!journal.failed) {
+        LOG_ERROR("journal: writes failing, records stay queued until they succeed");
+        journal.failed = 1;
+    }
+
+    pthread_mutex_lock(&journal.mutex);
+    if (!journal.stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += WRITE_RETRY_SECS;
+        pthread_cond_timedwait(&journal.cond, &journal.mutex, &deadline);
+    }
+    I32 stop = journal.stop;
+    pthread_mutex_unlock(&journal.mutex);
+
+    return stop ? -1 : 0;
+}
+
+static void* writer_main(void* arg) {
+    (void) arg;
+
+    for (;;) {
+        pthread_mutex_lock(&journal.mutex);
+        while (journal.count == 0 && !journal.rotate_pending && !journal.stop)
+            pthread_cond_wait(&journal.cond, &journal.mutex);
+
+        if (journal.stop && journal.count == 0 && !journal.rotate_pending) {
+            pthread_mutex_unlock(&journal.mutex);
+            break;
+        }
+
+        //everything queued while the last batch was syncing goes out together
+        journal_record_t* batch = journal.queue;
+        U32 batch_capacity = journal.capacity;
+        U32 count = journal.count;
+
+        journal.queue = journal.batch;
+        journal.capacity = journal.batch_capacity;
+        journal.batch = batch;
+        journal.batch_capacity = batch_capacity;
+        journal.count = 0;
+
+        I32 rotate = journal.rotate_pending;
+        U32 split = rotate ? journal.rotate_at : count;
+        U32 segment = journal.rotate_segment;
+        journal.rotate_pending = 0;
+
+        pthread_mutex_unlock(&journal.mutex);
+
+        //records before split go to the current segment, the rest after the rotation
+        U32 done = 0;
+        for (;;) {
+            if (done < split && write_batch(batch, split) == 0)
+                done = split;
+            if (done == split && rotate && open_segment(segment) == 0)
+                rotate = 0;
+            if (done == split && !rotate && write_batch(batch + split, count - split) == 0)
+                done = count;
+            if (done == count)
+                break;
+
+            if (writer_wait_retry() != 0) {
+                LOG_ERROR("journal: stopping with %u records not written", count - done);
+                break;
+            }
+            //a failed rotation has no partial write, it opens the same segment again
+            if ((done == split && rotate) || discard_partial_write() == 0)
+                continue;
+
+            //the rest goes to a new segment. With a rotation pending that is the rotation's,
+            //replay skips the records a snapshot already covers
+            if (rotate) {
+                if (open_segment(segment) == 0)
+                    rotate = 0, split = done;
+            } else {
+                pthread_mutex_lock(&journal.mutex);
+                U32 next = journal.next_segment++;
+                pthread_mutex_unlock(&journal.mutex);
+                open_segment(next);
+            }
+        }
+
+        if (done == count && journal.failed) {
+            LOG_INFO("journal: writes succeed again");
+            journal.failed = 0;
+        }
+
+        if (done > 0)
+            __atomic_store_n(&journal.durable_lsn, batch[done - 1].lsn, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+I32 journal_init(const char* path, U64 next_lsn) {
+
+    if (strlen(path) + 10 >= JOURNAL_PATH_LEN) {
+        LOG_ERROR("journal_init(): path too long: %s", path);
+        return -1;
+    }
+
+    U32* segments;
+    U32 count;
+    if (list_segments(path, &segments, &count) != 0) {
+        LOG_ERROR("journal_init(): cannot list segments of %s", path);
+        return -1;
+    }
+    U32 segment = count > 0 ? segments[count - 1] + 1 : 1;
+    free(segments);
+
+    memset(&journal, 0, sizeof journal);
+    strcpy(journal.path, path);
+    journal.fd = -1;
+    journal.next_lsn = next_lsn > 0 ? next_lsn : 1;
+    journal.durable_lsn = journal.next_lsn - 1;
+    journal.next_segment = segment + 1;
+
+    journal.queue = malloc(QUEUE_INITIAL_CAPACITY * sizeof(journal_record_t));
+    journal.batch = malloc(QUEUE_INITIAL_CAPACITY * sizeof(journal_record_t));
+    if (journal.queue == NULL || journal.batch == NULL) {
+        LOG_ERROR("journal_init(): failed to allocate queues");
+        free(journal.queue);
+        free(journal.batch);
+        return -1;
+    }
+    journal.capacity = QUEUE_INITIAL_CAPACITY;
+    journal.batch_capacity = QUEUE_INITIAL_CAPACITY;
+
+    if (open_segment(segment) != 0) {
+        free(journal.queue);
+        free(journal.batch);
+        return -1;
+    }
+
+    pthread_mutex_init(&journal.mutex, NULL);
+    pthread_cond_init(&journal.cond, NULL);
+
+    int r;
+    if ((r = pthread_create(&journal.thread, NULL, writer_main, NULL)) != 0) {
+        LOG_ERROR("pthread_create(): %d", r);
+        close(journal.fd);
+        free(journal.queue);
+        free(journal.batch);
+        return -1;
+    }
+
+    journal.running = 1;
+    LOG_INFO("journal: writing segment %u of %s from lsn %lu", segment, path, journal.next_lsn);
+    return 0;
+}
+
+void journal_deinit() {
+
+    if (!journal.running)
+        return;
+
+    pthread_mutex_lock(&journal.mutex);
+    journal.stop = 1;
+    pthread_cond_signal(&journal.cond);
+    pthread_mutex_unlock(&journal.mutex);
+
+    pthread_join(journal.thread, NULL);
+    journal.running = 0;
+
+    close(journal.fd);
+    journal.fd = -1;
+    free(journal.queue);
+    free(journal.batch);
+    journal.queue = NULL;
+    journal.batch = NULL;
+
+    pthread_cond_destroy(&journal.cond);
+    pthread_mutex_destroy(&journal.mutex);
+}
+
+U64 journal_append(JOURNAL_RECORD type, const char* key, U64 value0, U64 value1) {
+
+    if (!journal.running)
+        return 0;
+
+    journal_record_t record;
+    memcpy(record.key, key, sizeof record.key);
+    record.type = type;
+    record.value0 = value0;
+    record.value1 = value1;
+    record.reserved = 0;
+
+    pthread_mutex_lock(&journal.mutex);
+
+    if (journal.count == journal.capacity) {
+        journal_record_t* queue = realloc(journal.queue, (size_t)journal.capacity * 2 * sizeof(journal_record_t));
+        if (queue == NULL) {
+            pthread_mutex_unlock(&journal.mutex);
+            LOG_ERROR("journal_append(): queue full, record dropped");
+            return 0;
+        }
+        journal.queue = queue;
+        journal.capacity *= 2;
+    }
+
+    record.lsn = journal.next_lsn++;
+    record.checksum = record_checksum(&record);
+    journal.queue[journal.count++] = record;
+
+    //the writer only sleeps on an empty queue
+    if (journal.count == 1)
+        pthread_cond_signal(&journal.cond);
+
+    pthread_mutex_unlock(&journal.mutex);
+    return record.lsn;
+}
+
+U32 journal_rotate() {
+
+    if (!journal.running)
+        return 0;
+
+    pthread_mutex_lock(&journal.mutex);
+
+    if (!journal.rotate_pending) {
+        journal.rotate_pending = 1;
+        journal.rotate_at = journal.count;
+        journal.rotate_segment = journal.next_segment++;
+        pthread_cond_signal(&journal.cond);
+    }
+    U32 segment = journal.rotate_segment;
+
+    pthread_mutex_unlock(&journal.mutex);
+    return segment;
+}
+
+void journal_compact(U32 segment) {
+
+    if (!journal.running)
+        return;
+
+    U32* segments;
+    U32 count;
+    if (list_segments(journal.path, &segments, &count) != 0)
+        return;
+
+    U32 removed = 0;
+    for (U32 i = 0; i < count && segments[i] < segment; i++) {
+        char name[JOURNAL_PATH_LEN + 16];
+        segment_path(journal.path, segments[i], name, sizeof name);
+        if (unlink(name) == 0)
+            removed++;
+        else
+            LOG_ERROR("journal_compact(): unlink(%s): %s", name, strerror(errno));
+    }
+    free(segments);
+
+    if (removed > 0)
+        LOG_INFO("journal: compacted %u segments into the snapshot", removed);
+}
+
+U64 journal_durable_lsn() {
+    return __atomic_load_n(&journal.durable_lsn, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,53 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "types.h"
+
+#define JOURNAL_DEFAULT_PATH "tracker.journal"
+
+typedef enum JOURNAL_RECORD {
+    JOURNAL_COMPLETED = 1,  //key: info_hash, value0: completed delta
+    JOURNAL_TRANSFER        //key: auth key, value0: downloaded delta, value1: uploaded delta
+} JOURNAL_RECORD;
+
+typedef struct journal_record_t {
+    U64 lsn;
+    char key[20];
+    U32 type;
+    U64 value0;
+    U64 value1;
+    U32 reserved;
+    U32 checksum;       //over everything before it, a torn tail fails the check
+} journal_record_t;
+
+typedef void (*journal_apply_fn)(const journal_record_t* record);
+
+/*
+ * Append-only journal of counter deltas, split into numbered segments <path>.<n>.
+ * journal_append only copies the record into a queue, a writer thread writes
+ * everything queued since its last pass with one write and one fdatasync (group
+ * commit), so a crash loses at most the records of the batch being synced.
+ * Every record gets a log sequence number, state stamped with the lsn of its last
+ * record lets replay skip records a snapshot already contains.
+ */
+
+//passes every intact record of every segment to apply in lsn order, sets *next_lsn past the
+//highest lsn seen. Returns the number of records passed.
+I64 journal_replay(const char* path, journal_apply_fn apply, U64* next_lsn);
+
+//opens a new segment after the existing ones and starts the writer thread
+I32 journal_init(const char* path, U64 next_lsn);
+void journal_deinit();
+
+//returns the record's lsn, 0 when the journal is not running
+U64 journal_append(JOURNAL_RECORD type, const char* key, U64 value0, U64 value1);
+
+//records appended after this call go to a new segment, returns its number
+U32 journal_rotate();
+
+//deletes the segments before segment, once a snapshot covers them
+void journal_compact(U32 segment);
+
+U64 journal_durable_lsn();
+
+#endif
@@ -1,16 +1,15 @@
 #include "logger.h"
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <time.h>
-#if defined(_WIN32) || defined(_WIN64)
- #include <winsock2.h>
-#else
- #include <pthread.h>
- #include <sys/time.h>
- #include <sys/syscall.h>
- #include <unistd.h>
-#endif /* defined(_WIN32) || defined(_WIN64) */
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 enum {
     /* Logger type */
@@ -19,103 +18,111 @@ enum {
 
     kMaxFileNameLen = 255, /* without null character */
     kDefaultMaxFileSize = 1048576L, /* 1 MB */
+
+    kRecordSize = 256, /* one ring slot, longer messages are truncated */
+    kRingSize = 1024, /* slots per thread, power of two */
+    kWriteBufferSize = 64 * 1024,
+    kMaxLineLen = kRecordSize + 64, /* message + prefix */
+    kDefaultIdleInterval = 1, /* msec the writer sleeps when every ring is empty */
 };
 
+/*
+ * A record is formatted on the logging thread, the writer only adds the prefix.
+ */
+typedef struct {
+    struct timespec time;
+    const char* file;
+    int line;
+    unsigned short len;
+    char levelc;
+    char msg[kRecordSize - sizeof(struct timespec) - sizeof(const char*) - sizeof(int) - sizeof(unsigned short) - 1];
+} LogRecord;
+
+/*
+ * Single producer (the owning thread), single consumer (the writer) ring.
+ * head and tail sit on their own cache lines so the two sides never share one.
+ */
+typedef struct LogRing {
+    unsigned long long head __attribute__((aligned(64)));
+    unsigned long long tail __attribute__((aligned(64)));
+    unsigned long long dropped __attribute__((aligned(64)));
+    unsigned long long reported; /* writer only */
+    long threadID;
+    struct LogRing* next;
+    LogRecord records[kRingSize];
+} LogRing;
+
 /* Console logger */
 static struct {
-    FILE* output;
-    unsigned long long flushedTime;
+    int fd;
 } s_clog;
 
 /* File logger */
 static struct {
-    FILE* output;
+    int fd;
     char filename[kMaxFileNameLen + 1];
     long maxFileSize;
     unsigned char maxBackupFiles;
     long currentFileSize;
-    unsigned long long flushedTime;
-} s_flog;
+} s_flog = { -1 };
 
 static volatile int s_logger;
 static volatile LogLevel s_logLevel = LogLevel_INFO;
-static volatile long s_flushInterval = 0; /* msec, 0 is auto flush off */
+static volatile long s_flushInterval = kDefaultIdleInterval; /* msec */
 static volatile int s_initialized = 0; /* false */
-#if defined(_WIN32) || defined(_WIN64)
-static CRITICAL_SECTION s_mutex;
-#else
+
+/* taken by the writer around output and by the init functions, never by logging threads */
 static pthread_mutex_t s_mutex;
-#endif /* defined(_WIN32) || defined(_WIN64) */
+
+static LogRing* s_rings; /* every thread that ever logged, push only */
+static __thread LogRing* t_ring;
+
+static pthread_t s_writer;
+static int s_writerStop;
+static unsigned long long s_writerRounds; /* completed drain + write passes */
+
+/* writer only */
+static char s_writeBuffer[kWriteBufferSize];
+static size_t s_writeLen;
+static time_t s_cachedSec = -1;
+static char s_cachedStamp[32];
+
+static void* writerMain(void* arg);
+static void stopWriter(void);
 
 static void init(void)
 {
     if (s_initialized) {
         return;
     }
-#if defined(_WIN32) || defined(_WIN64)
-    InitializeCriticalSection(&s_mutex);
-#else
     pthread_mutex_init(&s_mutex, NULL);
-#endif /* defined(_WIN32) || defined(_WIN64) */
+    if (pthread_create(&s_writer, NULL, writerMain, NULL) != 0) {
+        fprintf(stderr, "ERROR: logger: Failed to start the writer thread\n");
+        return;
+    }
+    atexit(stopWriter);
     s_initialized = 1; /* true */
 }
 
 static void lock(void)
 {
-#if defined(_WIN32) || defined(_WIN64)
-    EnterCriticalSection(&s_mutex);
-#else
     pthread_mutex_lock(&s_mutex);
-#endif /* defined(_WIN32) || defined(_WIN64) */
 }
 
 static void unlock(void)
 {
-#if defined(_WIN32) || defined(_WIN64)
-    LeaveCriticalSection(&s_mutex);
-#else
     pthread_mutex_unlock(&s_mutex);
-#endif /* defined(_WIN32) || defined(_WIN64) */
-}
-
-#if defined(_WIN32) || defined(_WIN64)
-static int gettimeofday(struct timeval* tv, void* tz)
-{
-    const UINT64 epochFileTime = 116444736000000000ULL;
-    FILETIME ft;
-    ULARGE_INTEGER li;
-    UINT64 t;
-
-    if (tv == NULL) {
-        return -1;
-    }
-    GetSystemTimeAsFileTime(&ft);
-    li.LowPart = ft.dwLowDateTime;
-    li.HighPart = ft.dwHighDateTime;
-    t = (li.QuadPart - epochFileTime) / 10;
-    tv->tv_sec = (long) (t / 1000000);
-    tv->tv_usec = t % 1000000;
-    return 0;
 }
 
-static struct tm* localtime_r(const time_t* timep, struct tm* result)
-{
-    localtime_s(result, timep);
-    return result;
-}
-#endif /* defined(_WIN32) || defined(_WIN64) */
-
 static long getCurrentThreadID(void)
 {
-#if defined(_WIN32) || defined(_WIN64)
-    return GetCurrentThreadId();
-#elif __linux__
+#if __linux__
     return syscall(SYS_gettid);
 #elif defined(__APPLE__) && defined(__MACH__)
     return syscall(SYS_thread_selfid);
 #else
     return (long) pthread_self();
-#endif /* defined(_WIN32) || defined(_WIN64) */
+#endif /* __linux__ */
 }
 
 int logger_initConsoleLogger(FILE* output)
@@ -128,7 +135,8 @@ int logger_initConsoleLogger(FILE* output)
 
     init();
     lock();
-    s_clog.output = output;
+    fflush(output);
+    s_clog.fd = fileno(output);
     s_logger |= kConsoleLogger;
     unlock();
     return 1;
@@ -148,6 +156,11 @@ static long getFileSize(const char* filename)
     return size;
 }
 
+static int openLogFile(const char* filename)
+{
+    return open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+}
+
 int logger_initFileLogger(const char* filename, long maxFileSize, unsigned char maxBackupFiles)
 {
     int ok = 0; /* false */
@@ -163,16 +176,17 @@ int logger_initFileLogger(const char* filename, long maxFileSize, unsigned char
 
     init();
     lock();
-    if (s_flog.output != NULL) { /* reinit */
-        fclose(s_flog.output);
+    if (s_flog.fd >= 0) { /* reinit */
+        close(s_flog.fd);
     }
-    s_flog.output = fopen(filename, "a");
-    if (s_flog.output == NULL) {
+    s_flog.fd = openLogFile(filename);
+    if (s_flog.fd < 0) {
         fprintf(stderr, "ERROR: logger: Failed to open file: `%s`\n", filename);
+        s_logger &= ~kFileLogger;
         goto cleanup;
     }
     s_flog.currentFileSize = getFileSize(filename);
-    strncpy(s_flog.filename, filename, sizeof(s_flog.filename));
+    strncpy(s_flog.filename, filename, sizeof(s_flog.filename) - 1);
     s_flog.maxFileSize = (maxFileSize > 0) ? maxFileSize : kDefaultMaxFileSize;
     s_flog.maxBackupFiles = maxBackupFiles;
     s_logger |= kFileLogger;
@@ -199,7 +213,7 @@ int logger_isEnabled(LogLevel level)
 
 void logger_autoFlush(long interval)
 {
-    s_flushInterval = interval > 0 ? interval : 0;
+    s_flushInterval = interval > 0 ? interval : kDefaultIdleInterval;
 }
 
 static int hasFlag(int flags, int flag)
@@ -207,18 +221,38 @@ static int hasFlag(int flags, int flag)
     return (flags & flag) == flag;
 }
 
+unsigned long long logger_getDroppedCount(void)
+{
+    unsigned long long dropped = 0;
+    LogRing* ring;
+
+    for (ring = __atomic_load_n(&s_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    return dropped;
+}
+
 void logger_flush()
 {
+    LogRing* ring;
+    unsigned long long rounds;
+
     if (s_logger == 0 || !s_initialized) {
         assert(0 && "logger is not initialized");
         return;
     }
 
-    if (hasFlag(s_logger, kConsoleLogger)) {
-        fflush(s_clog.output);
+    /* wait until the writer has consumed everything queued before this call */
+    for (ring = __atomic_load_n(&s_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) < head && !__atomic_load_n(&s_writerStop, __ATOMIC_ACQUIRE)) {
+            usleep(1000);
+        }
     }
-    if (hasFlag(s_logger, kFileLogger)) {
-        fflush(s_flog.output);
+    /* records are written at the end of the pass that drained them */
+    rounds = __atomic_load_n(&s_writerRounds, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&s_writerRounds, __ATOMIC_ACQUIRE) == rounds && !__atomic_load_n(&s_writerStop, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
     }
 }
 
@@ -235,42 +269,45 @@ static char getLevelChar(LogLevel level)
     }
 }
 
-static void getTimestamp(const struct timeval* time, char* timestamp, size_t size)
+/* localtime_r and strftime only run when the second changes */
+static size_t getTimestamp(const struct timespec* time, char* timestamp)
 {
-    time_t sec = time->tv_sec; /* a necessary variable to avoid a runtime error on Windows */
-    struct tm calendar;
+    long usec = time->tv_nsec / 1000;
+    int i;
+
+    if (time->tv_sec != s_cachedSec) {
+        time_t sec = time->tv_sec;
+        struct tm calendar;
 
-    assert(size >= 25);
+        localtime_r(&sec, &calendar);
+        strftime(s_cachedStamp, sizeof(s_cachedStamp), "%y-%m-%d %H:%M:%S", &calendar);
+        s_cachedSec = time->tv_sec;
+    }
 
-    localtime_r(&sec, &calendar);
-    strftime(timestamp, size, "%y-%m-%d %H:%M:%S", &calendar);
-    sprintf(&timestamp[17], ".%06ld", (long) time->tv_usec);
+    memcpy(timestamp, s_cachedStamp, 17);
+    timestamp[17] = '.';
+    for (i = 23; i > 17; i--) {
+        timestamp[i] = '0' + usec % 10;
+        usec /= 10;
+    }
+    return 24;
 }
 
 static void getBackupFileName(const char* basename, unsigned char index,
         char* backupname, size_t size)
 {
-    char indexname[5];
+    assert(size >= strlen(basename) + 5);
 
-    assert(size >= strlen(basename) + sizeof(indexname));
-
-    strncpy(backupname, basename, size);
     if (index > 0) {
-        sprintf(indexname, ".%d", index);
-        strncat(backupname, indexname, strlen(indexname));
+        snprintf(backupname, size, "%s.%d", basename, index);
+    } else {
+        snprintf(backupname, size, "%s", basename);
     }
 }
 
 static int isFileExist(const char* filename)
 {
-    FILE* fp;
-
-    if ((fp = fopen(filename, "r")) == NULL) {
-        return 0;
-    } else {
-        fclose(fp);
-        return 1;
-    }
+    return access(filename, F_OK) == 0;
 }
 
 static int rotateLogFiles(void)
@@ -280,9 +317,9 @@ static int rotateLogFiles(void)
     char src[kMaxFileNameLen + 5], dst[kMaxFileNameLen + 5]; /* with null character */
 
     if (s_flog.currentFileSize < s_flog.maxFileSize) {
-        return s_flog.output != NULL;
+        return s_flog.fd >= 0;
     }
-    fclose(s_flog.output);
+    close(s_flog.fd);
     for (i = (int) s_flog.maxBackupFiles; i > 0; i--) {
         getBackupFileName(s_flog.filename, i - 1, src, sizeof(src));
         getBackupFileName(s_flog.filename, i, dst, sizeof(dst));
@@ -297,8 +334,8 @@ static int rotateLogFiles(void)
             }
         }
     }
-    s_flog.output = fopen(s_flog.filename, "a");
-    if (s_flog.output == NULL) {
+    s_flog.fd = openLogFile(s_flog.filename);
+    if (s_flog.fd < 0) {
         fprintf(stderr, "ERROR: logger: Failed to open file: `%s`\n", s_flog.filename);
         return 0;
     }
@@ -306,39 +343,153 @@ static int rotateLogFiles(void)
     return 1;
 }
 
-static long vflog(FILE* fp, char levelc, const char* timestamp, long threadID,
-        const char* file, int line, const char* fmt, va_list arg,
-        unsigned long long currentTime, unsigned long long* flushedTime)
+static void writeAll(int fd, const char* buf, size_t len)
 {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/* one write per output for everything collected since the last call */
+static void emitBuffer(void)
+{
+    if (s_writeLen == 0) {
+        return;
+    }
+
+    lock();
+    if (hasFlag(s_logger, kConsoleLogger)) {
+        writeAll(s_clog.fd, s_writeBuffer, s_writeLen);
+    }
+    if (hasFlag(s_logger, kFileLogger)) {
+        if (rotateLogFiles()) {
+            writeAll(s_flog.fd, s_writeBuffer, s_writeLen);
+            s_flog.currentFileSize += s_writeLen;
+        }
+    }
+    unlock();
+
+    s_writeLen = 0;
+}
+
+static void appendLine(char levelc, const struct timespec* time, long threadID,
+        const char* file, int line, const char* msg, size_t len)
+{
+    char* p;
     int size;
-    long totalsize = 0;
 
-    if ((size = fprintf(fp, "%c %s %ld %s:%d: ", levelc, timestamp, threadID, file, line)) > 0) {
-        totalsize += size;
+    if (s_writeLen + kMaxLineLen > sizeof(s_writeBuffer)) {
+        emitBuffer();
     }
-    if ((size = vfprintf(fp, fmt, arg)) > 0) {
-        totalsize += size;
+
+    p = s_writeBuffer + s_writeLen;
+    *p++ = levelc;
+    *p++ = ' ';
+    p += getTimestamp(time, p);
+    size = snprintf(p, kMaxLineLen - 26, " %ld %s:%d: ", threadID, file, line);
+    p += size > 0 ? size : 0;
+    memcpy(p, msg, len);
+    p += len;
+    *p++ = '\n';
+
+    s_writeLen = p - s_writeBuffer;
+}
+
+/* returns the number of records taken from the ring */
+static size_t drainRing(LogRing* ring)
+{
+    unsigned long long start = ring->tail;
+    unsigned long long tail = start;
+    unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+    for (; tail < head; tail++) {
+        const LogRecord* rec = &ring->records[tail & (kRingSize - 1)];
+        appendLine(rec->levelc, &rec->time, ring->threadID, rec->file, rec->line, rec->msg, rec->len);
     }
-    if ((size = fprintf(fp, "\n")) > 0) {
-        totalsize += size;
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    if (dropped != ring->reported) {
+        char msg[64];
+        struct timespec now;
+        int len;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        len = snprintf(msg, sizeof(msg), "dropped %llu log messages, ring full", dropped - ring->reported);
+        appendLine('W', &now, ring->threadID, "logger.c", __LINE__, msg, len);
+        ring->reported = dropped;
     }
-    if (s_flushInterval > 0) {
-        if (currentTime - *flushedTime > s_flushInterval) {
-            fflush(fp);
-            *flushedTime = currentTime;
+
+    return tail - start;
+}
+
+static void* writerMain(void* arg)
+{
+    (void) arg;
+
+    for (;;) {
+        int stopping = __atomic_load_n(&s_writerStop, __ATOMIC_ACQUIRE);
+        size_t records = 0;
+        LogRing* ring;
+
+        for (ring = __atomic_load_n(&s_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+            records += drainRing(ring);
+        }
+        emitBuffer();
+        __atomic_add_fetch(&s_writerRounds, 1, __ATOMIC_RELEASE);
+
+        if (records == 0) {
+            if (stopping) {
+                break;
+            }
+            usleep(s_flushInterval * 1000);
         }
     }
-    return totalsize;
+    return NULL;
+}
+
+static void stopWriter(void)
+{
+    if (!s_initialized || __atomic_load_n(&s_writerStop, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&s_writerStop, 1, __ATOMIC_RELEASE);
+    pthread_join(s_writer, NULL);
+}
+
+static LogRing* registerRing(void)
+{
+    LogRing* ring;
+
+    if (posix_memalign((void**) &ring, 64, sizeof(LogRing)) != 0) {
+        return NULL;
+    }
+    memset(ring, 0, offsetof(LogRing, records));
+    ring->threadID = getCurrentThreadID();
+
+    ring->next = __atomic_load_n(&s_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&s_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+
+    t_ring = ring;
+    return ring;
 }
 
 void logger_log(LogLevel level, const char* file, int line, const char* fmt, ...)
 {
-    struct timeval now;
-    unsigned long long currentTime; /* milliseconds */
-    char levelc;
-    char timestamp[32];
-    long threadID;
-    va_list carg, farg;
+    LogRing* ring;
+    LogRecord* rec;
+    unsigned long long head;
+    va_list arg;
+    int len;
 
     if (s_logger == 0 || !s_initialized) {
         assert(0 && "logger is not initialized");
@@ -348,31 +499,55 @@ void logger_log(LogLevel level, const char* file, int line, const char* fmt, ...
     if (!logger_isEnabled(level)) {
         return;
     }
-    gettimeofday(&now, NULL);
-    currentTime = now.tv_sec * 1000 + now.tv_usec / 1000;
-    levelc = getLevelChar(level);
-    getTimestamp(&now, timestamp, sizeof(timestamp));
-    threadID = getCurrentThreadID();
-    lock();
-    if (hasFlag(s_logger, kConsoleLogger)) {
-        va_start(carg, fmt);
-        vflog(s_clog.output, levelc, timestamp, threadID,
-                file, line, fmt, carg, currentTime, &s_clog.flushedTime);
-        va_end(carg);
+
+    ring = t_ring != NULL ? t_ring : registerRing();
+    if (ring == NULL) {
+        return;
     }
-    if (hasFlag(s_logger, kFileLogger)) {
-        if (rotateLogFiles()) {
-            va_start(farg, fmt);
-            s_flog.currentFileSize += vflog(s_flog.output, levelc, timestamp, threadID,
-                    file, line, fmt, farg, currentTime, &s_flog.flushedTime);
-            va_end(farg);
-        }
+
+    /* never wait for the writer, a full ring drops the message */
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == kRingSize) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    rec = &ring->records[head & (kRingSize - 1)];
+    clock_gettime(CLOCK_REALTIME, &rec->time);
+    rec->file = file;
+    rec->line = line;
+    rec->levelc = getLevelChar(level);
+
+    va_start(arg, fmt);
+    len = vsnprintf(rec->msg, sizeof(rec->msg), fmt, arg);
+    va_end(arg);
+
+    if (len < 0) {
+        len = 0;
+    } else if ((size_t) len >= sizeof(rec->msg)) {
+        len = sizeof(rec->msg) - 1;
+    }
+    rec->len = len;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    if (level == LogLevel_FATAL) {
+        logger_flush();
     }
-    unlock();
 }
 
 void logger_exitFileLogger()
 {
-    if (s_flog.output)
-        fclose(s_flog.output);
+    if (!s_initialized) {
+        return;
+    }
+    logger_flush();
+
+    lock();
+    if (s_flog.fd >= 0) {
+        close(s_flog.fd);
+        s_flog.fd = -1;
+    }
+    s_logger &= ~kFileLogger;
+    unlock();
 }
\ No newline at end of file
@@ -84,20 +84,31 @@ LogLevel logger_getLevel(void);
 int logger_isEnabled(LogLevel level);
 
 /**
- * Flush automatically.
- * Auto flush is off in default.
+ * Set how long the writer thread sleeps when no messages are queued.
+ * Queued messages reach the output at most this late. The default is 1 ms.
  *
- * @param[in] interval A fulsh interval in milliseconds. Switch off if 0 or a negative integer.
+ * @param[in] interval A flush interval in milliseconds. The default is restored if 0 or a negative integer.
  */
 void logger_autoFlush(long interval);
 
 /**
- * Flush buffered log messages.
+ * Wait until every message queued before the call has been written.
+ * Blocks the calling thread, do not call it from network threads.
  */
 void logger_flush(void);
 
+/**
+ * Number of messages dropped because a thread's ring was full.
+ *
+ * @return The dropped message count since start
+ */
+unsigned long long logger_getDroppedCount(void);
+
 /**
  * Log a message.
+ * The message is formatted into the calling thread's ring buffer and written by a
+ * background thread, the call never blocks. When the ring is full the message is
+ * dropped and counted. FATAL messages are flushed before returning.
  * Make sure to call one of the following initialize functions before starting logging.
  * - logger_initConsoleLogger()
  * - logger_initFileLogger()
@@ -5,14 +5,165 @@
 
 #include "http/http_server.h"
 #include "tracker_logic.h"
+#include "snapshot.h"
+#include "journal.h"
 
+#include <errno.h>
+#include <getopt.h>
 #include <stdlib.h>
+#include <string.h>
 #include <uv.h>
 
 #include "mem_pool.h"
 
 
-int main() {
+static void on_expire_timer(uv_timer_t* handle) {
+    U32 removed = tracker_expire_peers(TRACKER_EXPIRE_BUDGET);
+    if (removed > 0)
+        LOG_DEBUG("expired %u peers", removed);
+}
+
+static uv_work_t snapshot_work;
+static int snapshot_running;
+
+//journal segments before the rotation are covered by the snapshot once it is on disk
+static void snapshot_work_cb(uv_work_t* req) {
+    U32 segment = journal_rotate();
+    if (snapshot_save(SNAPSHOT_DEFAULT_PATH) == 0)
+        journal_compact(segment);
+}
+
+static void snapshot_after_cb(uv_work_t* req, int status) {
+    snapshot_running = 0;
+}
+
+//the snapshot is written on the libuv thread pool, a slow disk never stalls the loop
+static void on_snapshot_timer(uv_timer_t* handle) {
+    if (snapshot_running)
+        return;
+
+    snapshot_running = 1;
+    uv_queue_work(handle->loop, &snapshot_work, snapshot_work_cb, snapshot_after_cb);
+}
+
+//both servers, the timers and the snapshot work all end with the loop
+static void on_signal(uv_signal_t* handle, int signum) {
+    LOG_INFO("signal %d, shutting down", signum);
+    uv_stop(handle->loop);
+}
+
+typedef struct options_t {
+    U32 partitions;
+    size_t arena_size;
+    U32 arena_flags;
+    U8 udp_threads;         //0 runs udp on the event loop
+    udp_backend_t udp_backend;
+    U32 udp_workers;        //0 starts one per online cpu
+    U32 udp_batch;          //0 keeps the default of the chosen server
+    U8 pin_cpus;
+} options_t;
+
+static const struct option long_options[] = {
+    { "partitions",  required_argument, NULL, 'P' },
+    { "arena-mb",    required_argument, NULL, 'a' },
+    { "arena-prefault", no_argument,    NULL, 'f' },
+    { "udp",         required_argument, NULL, 'u' },
+    { "udp-workers", required_argument, NULL, 'w' },
+    { "udp-batch",   required_argument, NULL, 'b' },
+    { "pin-cpus",    no_argument,       NULL, 'p' },
+    { "help",        no_argument,       NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+static void usage(const char* name) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --partitions N     independently locked parts of the torrent store, rounded up\n"
+        "                     to a power of two (default %u)\n"
+        "  --arena-mb N       MB of address space for the torrent pools, huge pages where\n"
+        "                     possible, 0 allocates them with malloc (default %zu)\n"
+        "  --arena-prefault   touches the whole arena at startup\n"
+        "  --udp MODE         loop (default): udp shares the event loop with http\n"
+        "                     recvmmsg: dedicated worker threads with batched receive and send\n"
+        "                     io_uring: worker threads on multishot io_uring receives, falls back\n"
+        "                     to recvmmsg when the kernel does not support or allow io_uring\n"
+        "                     io_uring-sqpoll: as io_uring, plus a kernel thread polling the submissions\n"
+        "  --udp-workers N    worker threads, 0 (default) starts one per cpu\n"
+        "  --udp-batch N      datagrams per receive batch\n"
+        "  --pin-cpus         pins every worker thread to its own cpu\n",
+        name, TRACKER_DEFAULT_PARTITIONS, TRACKER_DEFAULT_ARENA_SIZE >> 20);
+}
+
+static int parse_u32(const char* arg, U32* value) {
+    char* end;
+    errno = 0;
+    unsigned long v = strtoul(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || v > UINT32_MAX)
+        return -1;
+    *value = v;
+    return 0;
+}
+
+static int parse_options(int argc, char** argv, options_t* opts) {
+    memset(opts, 0, sizeof *opts);
+    opts->partitions = TRACKER_DEFAULT_PARTITIONS;
+    opts->arena_size = TRACKER_DEFAULT_ARENA_SIZE;
+
+    int c;
+    while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'P':
+                if (parse_u32(optarg, &opts->partitions) != 0 || opts->partitions == 0 || opts->partitions > TRACKER_MAX_PARTITIONS)
+                    return -1;
+                break;
+            case 'a': {
+                U32 mb;
+                if (parse_u32(optarg, &mb) != 0)
+                    return -1;
+                opts->arena_size = (size_t)mb << 20;
+                break;
+            }
+            case 'f':
+                opts->arena_flags |= MEM_ARENA_PREFAULT;
+                break;
+            case 'u':
+                if (strcmp(optarg, "loop") == 0)
+                    opts->udp_threads = 0;
+                else if (strcmp(optarg, "recvmmsg") == 0)
+                    opts->udp_threads = 1, opts->udp_backend = UDP_BACKEND_RECVMMSG;
+                else if (strcmp(optarg, "io_uring") == 0)
+                    opts->udp_threads = 1, opts->udp_backend = UDP_BACKEND_IO_URING;
+                else if (strcmp(optarg, "io_uring-sqpoll") == 0)
+                    opts->udp_threads = 1, opts->udp_backend = UDP_BACKEND_IO_URING_SQPOLL;
+                else
+                    return -1;
+                break;
+            case 'w':
+                if (parse_u32(optarg, &opts->udp_workers) != 0 || opts->udp_workers > UINT16_MAX)
+                    return -1;
+                break;
+            case 'b':
+                if (parse_u32(optarg, &opts->udp_batch) != 0 || opts->udp_batch > UINT16_MAX)
+                    return -1;
+                break;
+            case 'p':
+                opts->pin_cpus = 1;
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    return optind == argc ? 0 : -1;
+}
+
+int main(int argc, char** argv) {
+
+    options_t opts;
+    if (parse_options(argc, argv, &opts) != 0) {
+        usage(argv[0]);
+        return 1;
+    }
 
     
     logger_initConsoleLogger(NULL);
@@ -23,19 +174,50 @@ int main() {
     
     uv_loop_t *loop = uv_default_loop();
 
-    tracker_logic_init();
-    http_server_init(loop);
+    tracker_logic_init(opts.partitions, opts.arena_size, opts.arena_flags);
+
+    U64 next_lsn = 1;
+    snapshot_load(SNAPSHOT_DEFAULT_PATH, 0, &next_lsn);
+    journal_replay(JOURNAL_DEFAULT_PATH, tracker_apply_journal, &next_lsn);
+    journal_init(JOURNAL_DEFAULT_PATH, next_lsn);
+
+    http_server_init(loop, HTTP_DEFAULT_IDLE_TIMEOUT, HTTP_DEFAULT_MAX_REQUESTS, HTTP_DEFAULT_MAX_CONNECTIONS);
+    if (opts.udp_threads)
+        udp_init(UDP_DEFAULT_PORT, opts.udp_workers, opts.udp_batch ? opts.udp_batch : UDP_DEFAULT_BATCH, opts.pin_cpus, opts.udp_backend);
+    else
+        udp_server_init(loop, UDP_DEFAULT_PORT, opts.udp_batch ? opts.udp_batch : UDP_LOOP_DEFAULT_BATCH);
+
+    uv_timer_t expire_timer;
+    uv_timer_init(loop, &expire_timer);
+    uv_timer_start(&expire_timer, on_expire_timer, TRACKER_EXPIRE_INTERVAL_MS, TRACKER_EXPIRE_INTERVAL_MS);
+
+    uv_timer_t snapshot_timer;
+    uv_timer_init(loop, &snapshot_timer);
+    uv_timer_start(&snapshot_timer, on_snapshot_timer, SNAPSHOT_DEFAULT_INTERVAL_MS, SNAPSHOT_DEFAULT_INTERVAL_MS);
+
+
+    uv_signal_t sigint, sigterm;
+    uv_signal_init(loop, &sigint);
+    uv_signal_start_oneshot(&sigint, on_signal, SIGINT);
+    uv_signal_init(loop, &sigterm);
+    uv_signal_start_oneshot(&sigterm, on_signal, SIGTERM);
 
 
     LOG_INFO("Starting event loop.");
     uv_run(loop, UV_RUN_DEFAULT);
 
-    uv_loop_close(loop);
-    free(loop);
+    //the loop was stopped with handles still open, so it is not closed. A snapshot
+    //still being written has to finish before the journal goes away
+    udp_server_close();
+    uv_run(loop, UV_RUN_NOWAIT);
+    while (snapshot_running)
+        uv_run(loop, UV_RUN_ONCE);
 
-    //udp_init(6969);
+    if (opts.udp_threads)
+        udp_deinit();
 
-    //udp_deinit();
+    journal_deinit();
+    logger_flush();
 
     return 0;
 }
\ No newline at end of file
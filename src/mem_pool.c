@@ -1,318 +1,207 @@
 #include "mem_pool.h"
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "logger.h"
 
-static inline I32 height(mem_node_t* node);
-static inline I32 height2(mem_pool_t* pool, U32 index);
-static inline I32 balance_factor(mem_pool_t* pool, mem_node_t* node);
+static I32 pool_grow(mem_pool_t* pool);
+static void arena_reserve(mem_pool_t* pool, size_t size, U32 flags);
+static void arena_prefault(char* arena, size_t size);
+static char* segment_alloc(mem_pool_t* pool, size_t size);
+static int in_arena(mem_pool_t* pool, char* segment);
 
-static I32 node_rotate_left(mem_pool_t* pool, I32 i);
-static I32 node_rotate_right(mem_pool_t* pool, I32 i);
 
-static inline I32 max(I32 a, I32 b);
+#define MIN_SEGMENT_SHIFT 4
+#define SEGMENT_ALIGN 64
+//x86-64 huge page, transparent huge pages only back ranges aligned to it
+#define ARENA_ALIGN ((size_t)2 << 20)
 
-static inline mem_node_t* find_min_node(mem_pool_t* pool, mem_node_t* node);
-static inline mem_node_t* get(mem_pool_t* pool, I32 i) {
-    return (i >= pool->pool_capacity || i < 0) ? NULL : &pool->pool[i];
+void mem_pool_init(mem_pool_t* pool, size_t poolSize, StorageType type) {
+    mem_pool_init_arena(pool, poolSize, type, 0, 0);
 }
 
-static void pool_reallocate(mem_pool_t* pool, size_t newSize);
+//poolSize is rounded up to a power of two and used as the segment size
+void mem_pool_init_arena(mem_pool_t* pool, size_t poolSize, StorageType type, size_t arenaSize, U32 flags) {
+    memset(pool, 0, sizeof *pool);
 
+    pool->segment_shift = MIN_SEGMENT_SHIFT;
+    while (((size_t)1 << pool->segment_shift) < poolSize)
+        pool->segment_shift++;
 
-void mem_pool_init(mem_pool_t* pool, size_t poolSize) {
-    pool->pool = malloc(poolSize * sizeof(mem_node_t));
-    pool->free_stack = malloc(poolSize * sizeof(U32));
+    pool->type = type;
+    pool->payload_size = type == TORRENTFILE ? sizeof(torrentfile_t) : sizeof(account_info_t);
+    pool->free_head = -1;
 
-    for (size_t i = 0; i < poolSize; i++) {
-        pool->free_stack[i] = i;
-    }
-    pool->top = poolSize;
-
-    pool->node_size = sizeof(mem_node_t);
-    pool->pool_capacity = poolSize;
-    pool->pool_size = 0;
+    if (arenaSize > 0)
+        arena_reserve(pool, arenaSize, flags);
 
-
-    pool->root_index = -1;
+    pool_grow(pool);
 }
 
-static void pool_reallocate(mem_pool_t* pool, size_t newSize) {
-    
-    mem_node_t* newP = malloc(newSize * sizeof(mem_node_t));
-    
-    if (newP == NULL) {
-        LOG_ERROR("mem_pool_reallocate(): failed to reallocate pool.");
-        return;
+const char* mem_pool_arena_mode_name(mem_arena_mode_t mode) {
+    switch (mode) {
+        case MEM_ARENA_PAGES:   return "pages";
+        case MEM_ARENA_THP:     return "transparent huge pages";
+        case MEM_ARENA_HUGETLB: return "hugetlb";
+        default:                return "malloc";
     }
-
-    U32* newStack = malloc(newSize * sizeof(U32));
-
-    if (newStack == NULL) {
-        free(newP);
-        LOG_ERROR("mem_pool_reallocate(): failed to reallocate free stack.");
-        return;
-    }
-
-    memcpy(newP, pool->pool, pool->pool_capacity * pool->node_size);
-    memcpy(newStack, pool->free_stack, pool->pool_capacity * sizeof(U32));
-
-    free(pool->pool);
-    free(pool->free_stack);
-
-    pool->pool = newP;
-    pool->free_stack = newStack;
-
-    for (size_t i = 0; i < newSize - pool->pool_capacity; i++) {
-        pool->free_stack[i] = i + newSize - pool->pool_capacity;
-    }
-
-    pool->top = newSize - pool->pool_capacity;
-    pool->pool_capacity = newSize;
 }
 
-void mem_pool_add_node(mem_pool_t* pool, mem_node_t* node) {
+//MAP_HUGETLB takes pages the administrator set aside (vm.nr_hugepages) and fails up
+//front when there are not enough, it never fails later on a page fault.
+//Otherwise the range is over-mapped and trimmed to ARENA_ALIGN so the kernel can
+//back it with transparent huge pages
+static void arena_reserve(mem_pool_t* pool, size_t size, U32 flags) {
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
 
-    //if (pool->root_index == NULL) {
-    //    pool->root_index = node;
-    //    return;
-    //}
+    char* arena = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    int populate = (flags & MEM_ARENA_PREFAULT) ? MAP_POPULATE : 0;
+    arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+    if (arena != MAP_FAILED)
+        pool->arena_mode = MEM_ARENA_HUGETLB;
+#endif
 
-    node_avl_add(pool, pool->root_index, node);
-}
+    if (arena == MAP_FAILED) {
+        char* raw = mmap(NULL, size + ARENA_ALIGN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (raw == MAP_FAILED) {
+            LOG_WARN("mem_pool_init_arena(): mmap of %zu bytes failed: %s", size, strerror(errno));
+            return;
+        }
 
-I32 mem_pool_just_alloc_node(mem_pool_t* pool, U32 key, StorageType type) {
+        arena = (char*)(((uintptr_t)raw + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1));
+        if (arena > raw)
+            munmap(raw, arena - raw);
+        munmap(arena + size, raw + ARENA_ALIGN - arena);
 
-    if (pool->top == 0) {
-        LOG_DEBUG("mem_pool is full");
-        pool_reallocate(pool, pool->pool_capacity * 2);
+        pool->arena_mode = MEM_ARENA_PAGES;
+#ifdef MADV_HUGEPAGE
+        if (madvise(arena, size, MADV_HUGEPAGE) == 0)
+            pool->arena_mode = MEM_ARENA_THP;
+#endif
+        if (flags & MEM_ARENA_PREFAULT)
+            arena_prefault(arena, size);
     }
-    
-    U32 index = pool->free_stack[--pool->top];
-    if (pool->root_index < 0)
-        pool->root_index = index;
-
-    mem_node_t* node = (mem_node_t*)((char*)pool->pool + index * pool->node_size);
-    node->key = key;
-    node->height = 1;
-    node->leftindex = -1;
-    node->rightindex = -1;
-    node->type = type;
-
-    return index;
-}
-
-I32 mem_pool_alloc_node(mem_pool_t* pool, U32 key, StorageType type) {
-
-    U32 node = mem_pool_just_alloc_node(pool, key, type);
-    if (node < 0)
-        return -1;
-
-    pool->root_index = node_avl_add(pool, pool->root_index, get(pool, node));
 
-    return node;
+    pool->arena = arena;
+    pool->arena_size = size;
+    pool->arena_used = 0;
 }
 
-mem_node_t* mem_pool_find_node(mem_pool_t* pool, U32 key) {
-    return node_avl_find(pool, key);
+//one write per base page, a huge page is filled by its first fault
+static void arena_prefault(char* arena, size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < size; offset += page)
+        ((volatile char*)arena)[offset] = 0;
 }
 
+static char* segment_alloc(mem_pool_t* pool, size_t size) {
+    size = (size + SEGMENT_ALIGN - 1) & ~(size_t)(SEGMENT_ALIGN - 1);
 
-void mem_pool_free_node(mem_pool_t* pool, mem_node_t* node) {
-
-    //refresh tree
-    node_avl_remove(pool, pool->root_index, node);
-
-    U32 id = ((char*)node - (char*)pool->pool) / pool->node_size;
-    
-    if (pool->top == pool->pool_capacity) {
-        LOG_DEBUG("mem_pool_free_node(): nothing to remove");
-        return;
+    if (pool->arena != NULL) {
+        if (pool->arena_size - pool->arena_used >= size) {
+            char* segment = pool->arena + pool->arena_used;
+            pool->arena_used += size;
+            return segment;
+        }
+        if (pool->arena_used < pool->arena_size) {
+            LOG_WARN("mem_pool_grow(): arena of %zu bytes is full, new segments use malloc", pool->arena_size);
+            //segments all have the same size, no later one fits either
+            pool->arena_used = pool->arena_size;
+        }
     }
 
-    pool->free_stack[pool->top++] = id;
-
+    return malloc(size);
 }
 
-mem_node_t* node_avl_find(mem_pool_t* pool, U32 key) {
-
-    mem_node_t* temp = get(pool, pool->root_index);
-
-    while (temp != NULL) {
-        if (temp->key == key)
-            return temp;
-        else if (temp->key < key)
-            temp = get(pool, temp->rightindex);
-        else
-            temp = get(pool, temp->leftindex);
-
-    }
-    return NULL;
+static int in_arena(mem_pool_t* pool, char* segment) {
+    return pool->arena != NULL && segment >= pool->arena && segment < pool->arena + pool->arena_size;
 }
 
-I32 node_avl_add(mem_pool_t* pool, I32 root_index, mem_node_t* node) {
-
-    mem_node_t* root = get(pool, root_index);
-
-    if (root == NULL) 
-        return pool->free_stack[pool->top];
-
-    if (root->key > node->key) {
-        root->leftindex = node_avl_add(pool, root->leftindex, node);
-    }
-    else if (root->key < node->key) {
-        root->rightindex = node_avl_add(pool, root->rightindex, node);
-    }
-    else {
-        return root_index;
-    }
-
-    mem_node_t* leftNode = get(pool, root->leftindex);
-    mem_node_t* rightNode = get(pool, root->rightindex);
-
-    
-    root->height = 1 + max(height(leftNode), height(rightNode));
-
-    I32 balanceFactor = balance_factor(pool, root);
+void mem_pool_deinit(mem_pool_t* pool) {
+    for (U32 i = 0; i < pool->segment_count; i++)
+        if (!in_arena(pool, pool->segments[i]))
+            free(pool->segments[i]);
 
-    if (balanceFactor > 1 && node->key < leftNode->key) {
-        return node_rotate_right(pool, root_index);
-    }
-    
-    if (balanceFactor < -1 && node->key > rightNode->key) {
-        return node_rotate_left(pool, root_index);
-    }
-
-    if (balanceFactor > 1 && node->key > leftNode->key) {
-        root->leftindex = node_rotate_left(pool, root->leftindex);
-        return node_rotate_right(pool, root_index);
-    }
-
-    if (balanceFactor < -1 && node->key < rightNode->key) {
-        root->rightindex = node_rotate_right(pool, root->rightindex);
-        return node_rotate_left(pool, root_index);
-    }
+    if (pool->arena != NULL)
+        munmap(pool->arena, pool->arena_size);
 
-    return root_index;
+    free(pool->segments);
 
+    pool->segments = NULL;
+    pool->segment_count = 0;
+    pool->segment_slots = 0;
+    pool->pool_size = 0;
+    pool->pool_capacity = 0;
+    pool->free_head = -1;
+    pool->arena = NULL;
+    pool->arena_size = 0;
+    pool->arena_used = 0;
+    pool->arena_mode = MEM_ARENA_NONE;
 }
 
+//adds one segment, only the small segment table is ever copied
+static I32 pool_grow(mem_pool_t* pool) {
 
-static inline mem_node_t* find_min_node(mem_pool_t* pool, mem_node_t* node) {
-    mem_node_t* current = node;
-    while (current->leftindex > 0)
-        current = get(pool, current->leftindex);
-    return current;
-}
-
-I32 node_avl_remove(mem_pool_t* pool, I32 root_index, mem_node_t* node) {
-
-    mem_node_t* root = get(pool, root_index);
-
-    if (root == NULL)
+    if (pool->pool_capacity + ((size_t)1 << pool->segment_shift) > (size_t)INT32_MAX) {
+        LOG_ERROR("mem_pool_grow(): index space exhausted.");
         return -1;
-
-    mem_node_t* leftNode = get(pool, root->leftindex);
-    mem_node_t* rightNode = get(pool, root->rightindex);
-
-    if (node->key < root->key) {
-        root->leftindex = node_avl_remove(pool, root->leftindex, node);
-    }
-    else if (node->key > root->key) {
-        root->rightindex = node_avl_remove(pool, root->rightindex, node);
-    }
-    else {
-        if (root->leftindex < 0) {
-            return root->rightindex;
-        }
-        else if (root->rightindex < 0) {
-            return root->leftindex;
-        }
-        
-        mem_node_t* temp = find_min_node(pool, rightNode);
-        root->key = temp->key;
-
-        root->rightindex = node_avl_remove(pool, root->rightindex, temp);
-    }
-
-       root->height = 1 + max(height(leftNode), height(rightNode));
-
-    I32 balanceFactor = balance_factor(pool, root);
-
-    if (balanceFactor > 1 && balance_factor(pool, leftNode) >= 0) {
-        return node_rotate_right(pool, root_index);
-    }
-    
-    if (balanceFactor < -1 && balance_factor(pool, rightNode) <= 0) {
-        return node_rotate_left(pool, root_index);
     }
 
-    if (balanceFactor > 1 && balance_factor(pool, leftNode) < 0) {
-        root->leftindex = node_rotate_left(pool, root->leftindex);
-        return node_rotate_right(pool, root_index);
+    if (pool->segment_count == pool->segment_slots) {
+        U32 slots = pool->segment_slots ? pool->segment_slots * 2 : 4;
+        char** segments = realloc(pool->segments, slots * sizeof(char*));
+        if (segments == NULL) {
+            LOG_ERROR("mem_pool_grow(): failed to grow the segment table.");
+            return -1;
+        }
+        pool->segments = segments;
+        pool->segment_slots = slots;
     }
 
-    if (balanceFactor < -1 && balance_factor(pool, rightNode) > 0) {
-        root->rightindex = node_rotate_right(pool, root->rightindex);
-        return node_rotate_left(pool, root_index);
+    char* segment = segment_alloc(pool, pool->payload_size << pool->segment_shift);
+    if (segment == NULL) {
+        LOG_ERROR("mem_pool_grow(): failed to allocate a segment.");
+        return -1;
     }
 
-    return root_index;
-}
-
-static inline I32 height(mem_node_t* node) {
-    if (!node)
-        return 0;
-    return node->height;
+    pool->segments[pool->segment_count++] = segment;
+    pool->pool_capacity += (size_t)1 << pool->segment_shift;
+    return 0;
 }
 
-static inline I32 height2(mem_pool_t* pool, U32 index) {
-    mem_node_t* node = get(pool, index);
-    if (!node)
-        return 0;
-    return node->height;
-}
-
-static inline I32 max(I32 a, I32 b) {
-    return a > b ? a : b;
-}
-
-static inline I32 balance_factor(mem_pool_t* pool, mem_node_t* node) {
-    return height2(pool, node->leftindex) - height2(pool, node->rightindex);
-}
+I32 mem_pool_alloc_node(mem_pool_t* pool) {
 
-static I32 node_rotate_left(mem_pool_t* pool, I32 i) 
-{
-    mem_node_t* x = get(pool, i);
-    I32 ret = x->rightindex;
+    I32 index = pool->free_head;
 
-    mem_node_t* y = get(pool, x->rightindex);
-
-
-    x->rightindex = y->leftindex;
-    y->leftindex = i;
-
-    x->height = 1 + max(height2(pool, x->leftindex), height2(pool, x->rightindex));
-    y->height = 1 + max(height2(pool, y->leftindex), height2(pool, y->rightindex));
+    if (index >= 0) {
+        pool->free_head = *(I32*)mem_pool_get_payload(pool, index);
+        return index;
+    }
 
-    return ret;
+    if (pool->pool_size == pool->pool_capacity) {
+        LOG_DEBUG("mem_pool is full");
+        if (pool_grow(pool) != 0)
+            return -1;
+    }
+    //fresh nodes are taken in index order, a new segment is not touched before it is needed
+    return pool->pool_size++;
 }
 
-static I32 node_rotate_right(mem_pool_t* pool, I32 i) {
-    
-    mem_node_t* head = get(pool, i);
-
-    mem_node_t* newHead = get(pool, head->leftindex);
-    I32 ret = head->leftindex;
-    I32 t3 = newHead->rightindex;
-
-    newHead->rightindex = i;
-    head->leftindex = t3;
+void mem_pool_free_node(mem_pool_t* pool, I32 index) {
 
-    head->height = 1 + max(height2(pool, head->leftindex), height2(pool, head->rightindex));
-    newHead->height = 1 + max(height2(pool, newHead->leftindex), height2(pool, newHead->rightindex));
+    I32* link = mem_pool_get_payload(pool, index);
+    if (link == NULL) {
+        LOG_DEBUG("mem_pool_free_node(): node is not from this pool");
+        return;
+    }
 
-    return ret;
+    *link = pool->free_head;
+    pool->free_head = index;
 }
@@ -3,51 +3,77 @@
 
 #include "common.h"
 
-typedef struct user_node_t user_node_t;
-typedef struct torrent_node_t torrent_node_t;
-typedef struct mem_node_t mem_node_t;
-
-
-typedef struct mem_node_t {
-    U32 key;
-    I32 height;
-    //mem_node_t* left;
-    //mem_node_t* right;
-    I32 leftindex;
-    I32 rightindex;
-    StorageType type;
-    union {
-        userinfo_t userinfo;
-        torrentfile_t torrentfile;
-        account_info_t accountinfo;
-    };
-    
-} mem_node_t;
+#include <stddef.h>
+
+//mem_pool_init_arena flags
+#define MEM_ARENA_PREFAULT 1    //touch the whole reservation up front
+
+//what backs the segments of a pool
+typedef enum mem_arena_mode_t {
+    MEM_ARENA_NONE = 0,     //one malloc per segment
+    MEM_ARENA_PAGES,        //mmap reservation, normal pages
+    MEM_ARENA_THP,          //mmap reservation, madvise(MADV_HUGEPAGE)
+    MEM_ARENA_HUGETLB       //mmap reservation, MAP_HUGETLB
+} mem_arena_mode_t;
 
+/*
+ * Fixed size nodes of one StorageType, addressed by index. Lookups go through the
+ * hashmaps of the tracker store, the pool only hands out and takes back indices;
+ * a free node links the next one through the first bytes of its payload.
+ * Segments are never moved or freed before mem_pool_deinit, so growing adds one
+ * segment and every payload pointer stays valid.
+ * An index is (segment << segment_shift) | offset.
+ *
+ * With an arena, segments are carved one after another out of a single mmap
+ * reservation backed by huge pages where possible, so walking a large pool does not
+ * miss the TLB on every node. Segments past the reservation fall back to malloc.
+ *
+ * Not thread safe. Every pool belongs to one store partition and is only used
+ * under that partition's mutex, so threads on different partitions never share
+ * a free list.
+ */
 typedef struct mem_pool_t {
-    mem_node_t* pool;
-    size_t pool_size;
+    char** segments;
+    U32 segment_count;
+    U32 segment_slots;      //capacity of segments
+    U32 segment_shift;
+    StorageType type;
+    size_t payload_size;
+    size_t pool_size;       //nodes below this index have been handed out at least once
     size_t pool_capacity;
-    size_t node_size;
-    U32* free_stack;
-    U32 top;
-    I32 root_index;
+    I32 free_head;          //freed nodes, linked through their payloads
+    char* arena;
+    size_t arena_size;
+    size_t arena_used;
+    mem_arena_mode_t arena_mode;
 
 } mem_pool_t;
 
 
-void mem_pool_init(mem_pool_t* pool, size_t poolSize);
+void mem_pool_init(mem_pool_t* pool, size_t poolSize, StorageType type);
+//reserves arenaSize bytes of address space for the segments, the result is in pool->arena_mode
+void mem_pool_init_arena(mem_pool_t* pool, size_t poolSize, StorageType type, size_t arenaSize, U32 flags);
+const char* mem_pool_arena_mode_name(mem_arena_mode_t mode);
+void mem_pool_deinit(mem_pool_t* pool);
+
+static inline void* mem_pool_get_payload(mem_pool_t* pool, I32 index) {
+    if (index < 0 || (size_t)index >= pool->pool_size)
+        return NULL;
 
-void mem_pool_add_node(mem_pool_t* pool, mem_node_t* node);
-mem_node_t* mem_pool_find_node(mem_pool_t* pool, U32 key);
+    U32 offset = index & ((1u << pool->segment_shift) - 1);
+    return pool->segments[index >> pool->segment_shift] + offset * pool->payload_size;
+}
 
-I32 mem_pool_just_alloc_node(mem_pool_t* pool, U32 key, StorageType type);
-I32 mem_pool_alloc_node(mem_pool_t* pool, U32 key, StorageType type);
-void mem_pool_free_node(mem_pool_t* pool, mem_node_t* node);
+static inline torrentfile_t* mem_pool_get_torrent(mem_pool_t* pool, I32 index) {
+    return mem_pool_get_payload(pool, index);
+}
 
+static inline account_info_t* mem_pool_get_account(mem_pool_t* pool, I32 index) {
+    return mem_pool_get_payload(pool, index);
+}
 
-I32 node_avl_add(mem_pool_t* pool, I32 root_index, mem_node_t* node);
-I32 node_avl_remove(mem_pool_t* pool, I32 root_index, mem_node_t* node);
-mem_node_t* node_avl_find(mem_pool_t* pool, U32 key);
+//-1 when the pool cannot grow, the payload of a reused node holds stale data
+I32 mem_pool_alloc_node(mem_pool_t* pool);
+void mem_pool_free_node(mem_pool_t* pool, I32 index);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,68 @@
+#include "siphash.h"
+
+#include <string.h>
+
+#define ROTL(x, b) (U64)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND            \
+    do {                    \
+        v0 += v1;           \
+        v1 = ROTL(v1, 13);  \
+        v1 ^= v0;           \
+        v0 = ROTL(v0, 32);  \
+        v2 += v3;           \
+        v3 = ROTL(v3, 16);  \
+        v3 ^= v2;           \
+        v0 += v3;           \
+        v3 = ROTL(v3, 21);  \
+        v3 ^= v0;           \
+        v2 += v1;           \
+        v1 = ROTL(v1, 17);  \
+        v1 ^= v2;           \
+        v2 = ROTL(v2, 32);  \
+    } while (0)
+
+U64 siphash24(const void* data, size_t len, U64 k0, U64 k1) {
+
+    const U8* in = data;
+    const U8* end = in + (len & ~(size_t)7);
+
+    U64 v0 = 0x736f6d6570736575ULL ^ k0;
+    U64 v1 = 0x646f72616e646f6dULL ^ k1;
+    U64 v2 = 0x6c7967656e657261ULL ^ k0;
+    U64 v3 = 0x7465646279746573ULL ^ k1;
+    U64 m;
+
+    for (; in != end; in += 8) {
+        memcpy(&m, in, sizeof m);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    U64 b = (U64)len << 56;
+    switch (len & 7) {
+    case 7: b |= (U64)in[6] << 48; /* fall through */
+    case 6: b |= (U64)in[5] << 40; /* fall through */
+    case 5: b |= (U64)in[4] << 32; /* fall through */
+    case 4: b |= (U64)in[3] << 24; /* fall through */
+    case 3: b |= (U64)in[2] << 16; /* fall through */
+    case 2: b |= (U64)in[1] << 8;  /* fall through */
+    case 1: b |= (U64)in[0];       /* fall through */
+    case 0: break;
+    }
+
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
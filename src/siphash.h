@@ -0,0 +1,11 @@
+#ifndef SIPHASH_H
+#define SIPHASH_H
+
+#include "types.h"
+
+#include <stddef.h>
+
+//SipHash-2-4 with a 128-bit key (k0, k1), 64-bit output
+U64 siphash24(const void* data, size_t len, U64 k0, U64 k1);
+
+#endif
@@ -0,0 +1,88 @@
+#include "slab_pool.h"
+
+#include "logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_ALIGN 64
+
+void slab_pool_init(slab_pool_t* pool, size_t obj_size, U32 objs_per_slab, U32 max_objs) {
+
+    memset(pool, 0, sizeof *pool);
+
+    //objects are at least pointer sized for the free list and start on their own cache line
+    if (obj_size < sizeof(void*))
+        obj_size = sizeof(void*);
+    pool->obj_size = (obj_size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+
+    pool->objs_per_slab = objs_per_slab ? objs_per_slab : 1;
+    pool->max_objs = max_objs;
+}
+
+void slab_pool_deinit(slab_pool_t* pool) {
+
+    for (U32 i = 0; i < pool->slab_count; i++)
+        free(pool->slabs[i]);
+
+    free(pool->slabs);
+    pool->slabs = NULL;
+    pool->slab_count = 0;
+    pool->free_list = NULL;
+    pool->total = 0;
+    pool->in_use = 0;
+}
+
+static I32 slab_pool_grow(slab_pool_t* pool) {
+
+    U32 count = pool->objs_per_slab;
+    if (pool->max_objs && pool->total + count > pool->max_objs)
+        count = pool->max_objs - pool->total;
+
+    if (count == 0)
+        return -1;
+
+    void** slabs = realloc(pool->slabs, (pool->slab_count + 1) * sizeof(void*));
+    if (slabs == NULL)
+        return -1;
+    pool->slabs = slabs;
+
+    char* slab;
+    if (posix_memalign((void**)&slab, SLAB_ALIGN, count * pool->obj_size) != 0) {
+        LOG_ERROR("slab_pool_grow(): failed to allocate %u objects", count);
+        return -1;
+    }
+    pool->slabs[pool->slab_count++] = slab;
+
+    //thread the new objects onto the free list, the first object ends up on top
+    for (U32 i = count; i-- > 0;) {
+        void* obj = slab + i * pool->obj_size;
+        *(void**)obj = pool->free_list;
+        pool->free_list = obj;
+    }
+
+    pool->total += count;
+    return 0;
+}
+
+void* slab_pool_alloc(slab_pool_t* pool) {
+
+    if (pool->free_list == NULL && slab_pool_grow(pool) != 0)
+        return NULL;
+
+    void* obj = pool->free_list;
+    pool->free_list = *(void**)obj;
+    pool->in_use++;
+
+    return obj;
+}
+
+void slab_pool_free(slab_pool_t* pool, void* obj) {
+
+    if (obj == NULL)
+        return;
+
+    *(void**)obj = pool->free_list;
+    pool->free_list = obj;
+    pool->in_use--;
+}
@@ -0,0 +1,32 @@
+#ifndef SLAB_POOL_H
+#define SLAB_POOL_H
+
+#include "types.h"
+
+#include <stddef.h>
+
+/*
+ * Fixed-size object pool. Memory is carved out of slabs of objs_per_slab objects,
+ * freed objects go on an intrusive free list and are handed out again first.
+ * Slabs are only returned in slab_pool_deinit, max_objs bounds the total memory.
+ * Not thread safe, meant for objects owned by one event loop.
+ */
+typedef struct slab_pool_t {
+    size_t obj_size;
+    U32 objs_per_slab;
+    U32 max_objs;
+    U32 total;
+    U32 in_use;
+    void* free_list;
+    void** slabs;
+    U32 slab_count;
+} slab_pool_t;
+
+
+void slab_pool_init(slab_pool_t* pool, size_t obj_size, U32 objs_per_slab, U32 max_objs);
+void slab_pool_deinit(slab_pool_t* pool);
+
+void* slab_pool_alloc(slab_pool_t* pool);
+void slab_pool_free(slab_pool_t* pool, void* obj);
+
+#endif
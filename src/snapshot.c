@@ -0,0 +1,385 @@
+#include "snapshot.h"
+
+#include "logger.h"
+#include "tracker_logic.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SNAPSHOT_PATH_LEN 256
+#define BUFFER_INITIAL_CAPACITY (64 * 1024)
+
+typedef struct section_buffer_t {
+    U8* data;
+    size_t size;
+    size_t capacity;
+    U32 torrents;
+    U32 peers;
+    U32 accounts;
+    U64 max_lsn;
+    I32 failed;
+} section_buffer_t;
+
+typedef struct snapshot_loader_t {
+    pthread_t thread;
+    const U8* base;
+    size_t file_size;
+    const snapshot_section_t* sections;
+    U32 section_count;
+    U32 first;
+    U32 stride;
+    U32 extra_age;
+    U64 restored;
+    I32 failed;
+} snapshot_loader_t;
+
+static I32 buffer_reserve(section_buffer_t* buf, size_t extra);
+static void copy_torrent(void* ctx, const torrentfile_t* torrent, U32 now);
+static void copy_account(void* ctx, const account_info_t* account);
+static I32 write_all(int fd, const void* data, size_t size, off_t offset);
+static I32 restore_section(snapshot_loader_t* loader, const snapshot_section_t* section);
+static void* loader_main(void* arg);
+
+
+static I32 buffer_reserve(section_buffer_t* buf, size_t extra) {
+
+    if (buf->size + extra <= buf->capacity)
+        return 0;
+
+    size_t capacity = buf->capacity ? buf->capacity : BUFFER_INITIAL_CAPACITY;
+    while (capacity < buf->size + extra)
+        capacity *= 2;
+
+    U8* data = realloc(buf->data, capacity);
+    if (data == NULL)
+        return -1;
+
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
+
+//runs under the partition lock, so it only copies
+static void copy_torrent(void* ctx, const torrentfile_t* torrent, U32 now) {
+    section_buffer_t* buf = ctx;
+
+    size_t size = sizeof(snapshot_torrent_t) + (size_t)torrent->peer_count * sizeof(tracker_peer_record_t);
+    if (buf->failed || buffer_reserve(buf, size) != 0) {
+        buf->failed = 1;
+        return;
+    }
+
+    snapshot_torrent_t* record = (snapshot_torrent_t*)(buf->data + buf->size);
+    memcpy(record->info_hash, torrent->info_hash, sizeof record->info_hash);
+    record->seeders = torrent->seeders;
+    record->leechers = torrent->lecheers;
+    record->completed = torrent->completed;
+    record->peer_count = torrent->peer_count;
+    record->reserved = 0;
+    record->journal_lsn = torrent->journal_lsn;
+
+    tracker_peer_record_t* peers = (tracker_peer_record_t*)(record + 1);
+    for (U32 i = 0; i < torrent->peer_count; i++) {
+        memcpy(peers[i].peer_id, torrent->peer_info[i].peer_id, sizeof peers[i].peer_id);
+        memcpy(peers[i].compact, torrent->compact_peers + i * COMPACT_PEER_LEN, COMPACT_PEER_LEN);
+        peers[i].seeder = torrent->peer_info[i].seeder;
+        peers[i].reserved = 0;
+        peers[i].age = now - torrent->peer_info[i].last_seen;
+    }
+
+    buf->size += size;
+    buf->torrents++;
+    buf->peers += torrent->peer_count;
+    if (torrent->journal_lsn > buf->max_lsn)
+        buf->max_lsn = torrent->journal_lsn;
+}
+
+static void copy_account(void* ctx, const account_info_t* account) {
+    section_buffer_t* buf = ctx;
+
+    if (buf->failed || buffer_reserve(buf, sizeof(snapshot_account_t)) != 0) {
+        buf->failed = 1;
+        return;
+    }
+
+    snapshot_account_t* record = (snapshot_account_t*)(buf->data + buf->size);
+    memcpy(record->auth_key, account->auth_key, sizeof record->auth_key);
+    record->reserved = 0;
+    record->downloaded = account->totalDownload;
+    record->uploaded = account->totalUploads;
+    record->journal_lsn = account->journal_lsn;
+
+    buf->size += sizeof *record;
+    buf->accounts++;
+    if (account->journal_lsn > buf->max_lsn)
+        buf->max_lsn = account->journal_lsn;
+}
+
+static I32 write_all(int fd, const void* data, size_t size, off_t offset) {
+
+    const U8* p = data;
+    while (size > 0) {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+I32 snapshot_save(const char* path) {
+
+    char tmp[SNAPSHOT_PATH_LEN];
+    if (snprintf(tmp, sizeof tmp, "%s.tmp", path) >= (int)sizeof tmp) {
+        LOG_ERROR("snapshot_save(): path too long: %s", path);
+        return -1;
+    }
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERROR("snapshot_save(): open(%s): %s", tmp, strerror(errno));
+        return -1;
+    }
+
+    U32 count = tracker_partition_count();
+    snapshot_section_t* sections = calloc(count, sizeof(snapshot_section_t));
+    section_buffer_t buf = {0};
+    I32 ret = -1;
+
+    if (sections == NULL)
+        goto cleanup;
+
+    snapshot_header_t header = {0};
+    off_t offset = sizeof header + (off_t)count * sizeof(snapshot_section_t);
+
+    for (U32 i = 0; i < count; i++) {
+        buf.size = 0;
+        buf.torrents = 0;
+        buf.peers = 0;
+        buf.accounts = 0;
+
+        tracker_visit_partition(i, copy_torrent, &buf);
+        tracker_visit_accounts(i, copy_account, &buf);
+        if (buf.failed) {
+            LOG_ERROR("snapshot_save(): out of memory copying partition %u", i);
+            goto cleanup;
+        }
+
+        if (write_all(fd, buf.data, buf.size, offset) != 0) {
+            LOG_ERROR("snapshot_save(): write: %s", strerror(errno));
+            goto cleanup;
+        }
+
+        sections[i].offset = offset;
+        sections[i].size = buf.size;
+        sections[i].torrent_count = buf.torrents;
+        sections[i].peer_count = buf.peers;
+        sections[i].account_count = buf.accounts;
+
+        offset += buf.size;
+        header.torrent_count += buf.torrents;
+        header.peer_count += buf.peers;
+    }
+
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof header.magic);
+    header.version = SNAPSHOT_VERSION;
+    header.section_count = count;
+    header.created = time(NULL);
+    header.next_lsn = buf.max_lsn + 1;
+
+    if (write_all(fd, &header, sizeof header, 0) != 0 ||
+        write_all(fd, sections, (size_t)count * sizeof(snapshot_section_t), sizeof header) != 0) {
+        LOG_ERROR("snapshot_save(): write: %s", strerror(errno));
+        goto cleanup;
+    }
+
+    if (fsync(fd) != 0) {
+        LOG_ERROR("snapshot_save(): fsync: %s", strerror(errno));
+        goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    close(fd);
+    free(sections);
+    free(buf.data);
+
+    if (ret == 0 && rename(tmp, path) != 0) {
+        LOG_ERROR("snapshot_save(): rename(%s): %s", path, strerror(errno));
+        ret = -1;
+    }
+    if (ret != 0) {
+        unlink(tmp);
+        return ret;
+    }
+
+    LOG_INFO("snapshot: %lu torrents, %lu peers written to %s", header.torrent_count, header.peer_count, path);
+    return 0;
+}
+
+static I32 restore_section(snapshot_loader_t* loader, const snapshot_section_t* section) {
+
+    if (section->offset > loader->file_size || section->size > loader->file_size - section->offset)
+        return -1;
+
+    const U8* pos = loader->base + section->offset;
+    const U8* end = pos + section->size;
+
+    for (U32 i = 0; i < section->torrent_count; i++) {
+        if ((size_t)(end - pos) < sizeof(snapshot_torrent_t))
+            return -1;
+
+        const snapshot_torrent_t* record = (const snapshot_torrent_t*)pos;
+        pos += sizeof *record;
+
+        U64 peers_size = (U64)record->peer_count * sizeof(tracker_peer_record_t);
+        if ((U64)(end - pos) < peers_size)
+            return -1;
+
+        if (tracker_restore_torrent(record->info_hash, record->completed, record->journal_lsn,
+                                    (const tracker_peer_record_t*)pos, record->peer_count, loader->extra_age) != 0)
+            return -1;
+
+        pos += peers_size;
+        loader->restored++;
+    }
+
+    if ((U64)(end - pos) < (U64)section->account_count * sizeof(snapshot_account_t))
+        return -1;
+
+    const snapshot_account_t* accounts = (const snapshot_account_t*)pos;
+    for (U32 i = 0; i < section->account_count; i++) {
+        if (tracker_restore_account(accounts[i].auth_key, accounts[i].downloaded, accounts[i].uploaded, accounts[i].journal_lsn) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void* loader_main(void* arg) {
+    snapshot_loader_t* loader = arg;
+
+    for (U32 i = loader->first; i < loader->section_count; i += loader->stride) {
+        if (restore_section(loader, &loader->sections[i]) != 0) {
+            loader->failed = 1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+I64 snapshot_load(const char* path, U32 threads, U64* next_lsn) {
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            LOG_INFO("snapshot: %s not found, starting empty", path);
+        else
+            LOG_ERROR("snapshot_load(): open(%s): %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(snapshot_header_t)) {
+        LOG_ERROR("snapshot_load(): %s is truncated", path);
+        close(fd);
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    const U8* base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        LOG_ERROR("snapshot_load(): mmap: %s", strerror(errno));
+        return -1;
+    }
+    madvise((void*)base, size, MADV_WILLNEED);
+
+    struct timespec start, finish;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    const snapshot_header_t* header = (const snapshot_header_t*)base;
+    I64 ret = -1;
+
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof header->magic) != 0 || header->version != SNAPSHOT_VERSION) {
+        LOG_ERROR("snapshot_load(): %s is not a version %u snapshot", path, SNAPSHOT_VERSION);
+        goto unmap;
+    }
+    if ((size - sizeof *header) / sizeof(snapshot_section_t) < header->section_count) {
+        LOG_ERROR("snapshot_load(): %s is truncated", path);
+        goto unmap;
+    }
+
+    if (header->next_lsn > *next_lsn)
+        *next_lsn = header->next_lsn;
+
+    U64 now = time(NULL);
+    U64 elapsed = now > header->created ? now - header->created : 0;
+    if (elapsed >= TRACKER_PEER_TIMEOUT)
+        LOG_WARN("snapshot: %s is %lu s old, restoring torrents without peers", path, elapsed);
+
+    if (threads == 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > header->section_count)
+        threads = header->section_count;
+    if (threads == 0)
+        threads = 1;
+
+    snapshot_loader_t* loaders = calloc(threads, sizeof(snapshot_loader_t));
+    if (loaders == NULL)
+        goto unmap;
+
+    for (U32 i = 0; i < threads; i++) {
+        snapshot_loader_t* loader = &loaders[i];
+        loader->base = base;
+        loader->file_size = size;
+        loader->sections = (const snapshot_section_t*)(header + 1);
+        loader->section_count = header->section_count;
+        loader->first = i;
+        loader->stride = threads;
+        loader->extra_age = elapsed < TRACKER_PEER_TIMEOUT ? elapsed : TRACKER_PEER_TIMEOUT;
+
+        //the first loader runs on the calling thread
+        if (i > 0 && pthread_create(&loader->thread, NULL, loader_main, loader) != 0)
+            loader_main(loader);
+    }
+    loader_main(&loaders[0]);
+
+    ret = 0;
+    I32 failed = 0;
+    for (U32 i = 0; i < threads; i++) {
+        if (i > 0 && loaders[i].thread)
+            pthread_join(loaders[i].thread, NULL);
+        ret += loaders[i].restored;
+        failed |= loaders[i].failed;
+    }
+    free(loaders);
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    U64 ms = (finish.tv_sec - start.tv_sec) * 1000 + (finish.tv_nsec - start.tv_nsec) / 1000000;
+
+    if (failed) {
+        LOG_ERROR("snapshot_load(): %s is corrupt, restored %ld torrents before the error", path, ret);
+        ret = -1;
+    }
+    else
+        LOG_INFO("snapshot: restored %ld torrents from %s in %lu ms with %u threads", ret, path, ms, threads);
+
+unmap:
+    munmap((void*)base, size);
+    return ret;
+}
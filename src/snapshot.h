@@ -0,0 +1,67 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "types.h"
+
+#define SNAPSHOT_DEFAULT_PATH "tracker.snapshot"
+#define SNAPSHOT_DEFAULT_INTERVAL_MS 60000
+
+#define SNAPSHOT_MAGIC "TRKSNAP"
+#define SNAPSHOT_VERSION 3
+
+/*
+ * File layout, every record is a multiple of 8 bytes so the file can be used in place
+ * through mmap:
+ *   snapshot_header_t
+ *   snapshot_section_t[section_count]         one per store partition
+ *   sections: snapshot_torrent_t followed by its tracker_peer_record_t[peer_count], repeated,
+ *             then snapshot_account_t[account_count]
+ */
+typedef struct snapshot_header_t {
+    char magic[8];
+    U32 version;
+    U32 section_count;
+    U64 created;        //unix seconds
+    U64 torrent_count;
+    U64 peer_count;
+    U64 next_lsn;       //journal records from this lsn on are newer than every stamp in the file
+} snapshot_header_t;
+
+typedef struct snapshot_section_t {
+    U64 offset;
+    U64 size;
+    U32 torrent_count;
+    U32 peer_count;
+    U32 account_count;
+    U32 reserved;
+} snapshot_section_t;
+
+typedef struct snapshot_torrent_t {
+    char info_hash[20];
+    U32 seeders;        //informational, restoring recounts them from the peers kept
+    U32 leechers;
+    U32 completed;
+    U32 peer_count;
+    U32 reserved;
+    U64 journal_lsn;
+} snapshot_torrent_t;
+
+typedef struct snapshot_account_t {
+    char auth_key[20];
+    U32 reserved;
+    U64 downloaded;
+    U64 uploaded;
+    U64 journal_lsn;
+} snapshot_account_t;
+
+
+//copies one partition at a time under its lock and writes it after unlocking,
+//the file is written to path.tmp and renamed over path when complete
+I32 snapshot_save(const char* path);
+
+//maps path and restores its torrents and accounts with threads loader threads (0 = one per cpu),
+//*next_lsn is raised to the file's next_lsn. Returns the number of torrents restored,
+//-1 if the file is missing or invalid.
+I64 snapshot_load(const char* path, U32 threads, U64* next_lsn);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+//failed checks are counted and reported, the test keeps going so one run shows all of them
+static int test_failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures++; \
+        } \
+    } while (0)
+
+#define TEST_RESULT() (test_failures == 0 ? 0 : 1)
+
+#endif
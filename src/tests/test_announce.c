@@ -0,0 +1,141 @@
+#include "test.h"
+
+#include "tracker_logic.h"
+#include "logger.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define INFO_HASH_LEN 20
+#define PEER_ID_LEN 20
+
+static char info_hash[INFO_HASH_LEN];
+
+static void make_peer_id(char* peer_id, U32 n) {
+    memset(peer_id, 'p', PEER_ID_LEN);
+    memcpy(peer_id, &n, sizeof n);
+}
+
+//peer n announces from 10.0.x.y:(1000 + n), so every compact entry is unique
+static I32 announce_event(U32 n, EVENT event, U32 numwant, U8* peers, tracker_announce_result_t* result) {
+    char peer_id[PEER_ID_LEN];
+    make_peer_id(peer_id, n);
+
+    U32 ip = htonl(0x0a000000 | n);
+    tracker_announce_t a = {
+        .info_hash = info_hash,
+        .peer_id = peer_id,
+        .ip = ip,
+        .port = htons(1000 + n),
+        .left = 100,
+        .event = event,
+        .numwant = numwant,
+    };
+    return tracker_announce(&a, peers, TRACKER_MAX_NUMWANT, result);
+}
+
+static I32 announce(U32 n, U32 numwant, U8* peers, tracker_announce_result_t* result) {
+    return announce_event(n, EVENT_NONE, numwant, peers, result);
+}
+
+static U32 compact_owner(const U8* compact) {
+    U32 ip;
+    memcpy(&ip, compact, 4);
+    return ntohl(ip) & 0xffffff;
+}
+
+//every returned peer is one of peers first..end-1, appears once and is not the requester
+static int check_range(U32 requester, U32 first, U32 end, const U8* peers, U32 count) {
+    static U8 seen[2048];
+    memset(seen, 0, sizeof seen);
+
+    for (U32 i = 0; i < count; i++) {
+        U32 n = compact_owner(peers + i * COMPACT_PEER_LEN);
+        U16 port;
+        memcpy(&port, peers + i * COMPACT_PEER_LEN + 4, 2);
+
+        if (n < first || n >= end || n == requester || seen[n] || ntohs(port) != 1000 + n)
+            return 0;
+        seen[n] = 1;
+    }
+    return 1;
+}
+
+static int check_sample(U32 requester, U32 swarm_size, const U8* peers, U32 count) {
+    return check_range(requester, 0, swarm_size, peers, count);
+}
+
+int main() {
+    logger_initConsoleLogger(stderr);
+    logger_setLevel(LogLevel_WARN);
+
+    tracker_logic_init(4, 0, 0);
+    memset(info_hash, 'h', sizeof info_hash);
+
+    U8 peers[TRACKER_MAX_NUMWANT * COMPACT_PEER_LEN];
+    tracker_announce_result_t result;
+
+    //a small swarm hands out everyone else, whatever numwant asks for
+    for (U32 n = 0; n < 10; n++)
+        CHECK(announce(n, 0, peers, &result) == 0);
+
+    CHECK(announce(3, 50, peers, &result) == 0);
+    CHECK(result.peer_count == 9);
+    CHECK(check_sample(3, 10, peers, result.peer_count));
+
+    CHECK(announce(4, 5, peers, &result) == 0);
+    CHECK(result.peer_count == 5);
+    CHECK(check_sample(4, 10, peers, result.peer_count));
+
+    //a large one is sampled, numwant distinct peers every time
+    for (U32 n = 10; n < 1000; n++)
+        CHECK(announce(n, 0, peers, &result) == 0);
+
+    for (U32 round = 0; round < 200; round++) {
+        U32 requester = (round * 37) % 1000;
+        U32 numwant = 1 + round % TRACKER_MAX_NUMWANT;
+
+        CHECK(announce(requester, numwant, peers, &result) == 0);
+        CHECK(result.peer_count == numwant);
+        CHECK(check_sample(requester, 1000, peers, result.peer_count));
+    }
+
+    //numwant is capped
+    CHECK(announce(0, 10000, peers, &result) == 0);
+    CHECK(result.peer_count == TRACKER_MAX_NUMWANT);
+    CHECK(check_sample(0, 1000, peers, result.peer_count));
+
+    //half the swarm leaves. Once a second went by every cached list is rebuilt on
+    //its next use, so nobody gets the peers that left
+    for (U32 n = 0; n < 500; n++)
+        CHECK(announce_event(n, EVENT_STOPPED, 0, peers, &result) == 0);
+
+    sleep(1);
+    tracker_expire_peers(1000);
+
+    for (U32 round = 0; round < 50; round++) {
+        CHECK(announce(500 + round, TRACKER_MAX_NUMWANT, peers, &result) == 0);
+        CHECK(result.peer_count == TRACKER_MAX_NUMWANT);
+        CHECK(check_range(500 + round, 500, 1000, peers, result.peer_count));
+    }
+
+    //new peers join and show up in the lists after the next rebuild
+    for (U32 n = 1000; n < 1200; n++)
+        CHECK(announce(n, 0, peers, &result) == 0);
+
+    sleep(1);
+    tracker_expire_peers(1000);
+
+    U32 joined = 0;
+    for (U32 round = 0; round < 50; round++) {
+        CHECK(announce(500 + round, TRACKER_MAX_NUMWANT, peers, &result) == 0);
+        CHECK(check_range(500 + round, 500, 1200, peers, result.peer_count));
+        for (U32 i = 0; i < result.peer_count; i++)
+            joined += compact_owner(peers + i * COMPACT_PEER_LEN) >= 1000;
+    }
+    CHECK(joined > 0);
+
+    tracker_logic_deinit();
+    return TEST_RESULT();
+}
@@ -0,0 +1,88 @@
+#include "test.h"
+
+#include "conn_id.h"
+#include "logger.h"
+#include "siphash.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+
+static struct sockaddr_in make_addr(const char* ip, U16 port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    return addr;
+}
+
+//the id the secret slots would give before they are seeded
+static int64_t zero_key_id(const struct sockaddr_in* addr, U64 bucket) {
+    U8 msg[16];
+    memcpy(msg, &addr->sin_addr.s_addr, 4);
+    memcpy(msg + 4, &addr->sin_port, 2);
+    memset(msg + 6, 0, 2);
+    memcpy(msg + 8, &bucket, 8);
+    return (int64_t)siphash24(msg, sizeof msg, 0, 0);
+}
+
+int main() {
+    logger_initConsoleLogger(stderr);
+    logger_setLevel(LogLevel_WARN);
+
+    conn_id_init();
+
+    struct sockaddr_in client = make_addr("192.0.2.1", 6881);
+    struct sockaddr_in other_port = make_addr("192.0.2.1", 6882);
+    struct sockaddr_in other_ip = make_addr("192.0.2.2", 6881);
+
+    //right after boot the first bucket is 0, which the unrotated slot 0 already claims
+    int64_t boot = make_connection_id(&client, 5);
+    CHECK(boot != zero_key_id(&client, 0));
+    CHECK(!verify_connection_id(&client, zero_key_id(&client, 0), 5));
+    CHECK(verify_connection_id(&client, boot, 5));
+    CHECK(verify_connection_id(&client, boot, CONN_ID_BUCKET_SECS));
+    CHECK(!verify_connection_id(&client, boot, 2 * CONN_ID_BUCKET_SECS));
+
+    const U64 bucket_start = (U64)CONN_ID_BUCKET_SECS * 1000;
+
+    //issued in the last second of a bucket
+    U64 now = bucket_start - 1;
+    int64_t late = make_connection_id(&client, now);
+    CHECK(verify_connection_id(&client, late, now));
+    CHECK(!verify_connection_id(&other_port, late, now));
+    CHECK(!verify_connection_id(&other_ip, late, now));
+    CHECK(!verify_connection_id(&client, late ^ 1, now));
+
+    //the same client gets the same id for the whole bucket
+    CHECK(make_connection_id(&client, bucket_start - CONN_ID_BUCKET_SECS) == late);
+
+    //still good for the whole next bucket, also after that bucket's secret was made
+    now = bucket_start;
+    CHECK(verify_connection_id(&client, late, now));
+    int64_t early = make_connection_id(&client, now);
+    CHECK(early != late);
+    CHECK(verify_connection_id(&client, late, now));
+    CHECK(verify_connection_id(&client, early, now));
+
+    CHECK(verify_connection_id(&client, late, bucket_start + CONN_ID_BUCKET_SECS - 1));
+
+    //two buckets later it is gone, even after the secret slot it used is taken again
+    now = bucket_start + CONN_ID_BUCKET_SECS;
+    CHECK(!verify_connection_id(&client, late, now));
+    CHECK(verify_connection_id(&client, early, now));
+    make_connection_id(&client, now);
+    CHECK(!verify_connection_id(&client, late, now));
+
+    //an id issued at the start of a bucket lives two full buckets
+    CHECK(verify_connection_id(&client, early, bucket_start + 2 * CONN_ID_BUCKET_SECS - 1));
+    CHECK(!verify_connection_id(&client, early, bucket_start + 2 * CONN_ID_BUCKET_SECS));
+
+    //after a long idle period both secret slots are stale, nothing old is accepted
+    now = bucket_start + 10 * CONN_ID_BUCKET_SECS;
+    CHECK(!verify_connection_id(&client, early, now));
+    int64_t fresh = make_connection_id(&client, now);
+    CHECK(verify_connection_id(&client, fresh, now));
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,110 @@
+#include "test.h"
+
+#include "tracker_logic.h"
+#include "logger.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define INFO_HASH_LEN 20
+#define PEER_ID_LEN 20
+
+static void make_id(char* id, char tag, U32 n) {
+    memset(id, tag, PEER_ID_LEN);
+    memcpy(id, &n, sizeof n);
+}
+
+static void announce(const char* info_hash, U32 n, U64 left, EVENT event) {
+    char peer_id[PEER_ID_LEN];
+    make_id(peer_id, 'p', n);
+
+    U8 peers[TRACKER_MAX_NUMWANT * COMPACT_PEER_LEN];
+    tracker_announce_result_t result;
+    tracker_announce_t a = {
+        .info_hash = info_hash,
+        .peer_id = peer_id,
+        .ip = htonl(0x0a000000 | n),
+        .port = htons(1000 + n),
+        .left = left,
+        .event = event,
+    };
+    CHECK(tracker_announce(&a, peers, TRACKER_MAX_NUMWANT, &result) == 0);
+}
+
+static int counters_are(const char* info_hash, U32 seeders, U32 leechers, U32 completed) {
+    tracker_scrape_result_t result;
+    tracker_scrape(info_hash, 1, &result);
+
+    if (result.seeders == seeders && result.leechers == leechers && result.completed == completed)
+        return 1;
+    fprintf(stderr, "counters %u/%u/%u instead of %u/%u/%u\n", result.seeders, result.leechers, result.completed,
+            seeders, leechers, completed);
+    return 0;
+}
+
+int main() {
+    logger_initConsoleLogger(stderr);
+    logger_setLevel(LogLevel_WARN);
+
+    tracker_logic_init(4, 0, 0);
+
+    char info_hash[INFO_HASH_LEN];
+    make_id(info_hash, 'h', 1);
+
+    //started peers count by what they have left
+    announce(info_hash, 0, 100, EVENT_STARTED);
+    announce(info_hash, 1, 0, EVENT_STARTED);
+    announce(info_hash, 2, 50, EVENT_STARTED);
+    CHECK(counters_are(info_hash, 1, 2, 0));
+
+    //a leecher finishing counts one download, a repeated completed event does not
+    announce(info_hash, 0, 0, EVENT_COMPLETED);
+    CHECK(counters_are(info_hash, 2, 1, 1));
+    announce(info_hash, 0, 0, EVENT_COMPLETED);
+    CHECK(counters_are(info_hash, 2, 1, 1));
+
+    //reaching left=0 without the event counts too
+    announce(info_hash, 2, 0, EVENT_NONE);
+    CHECK(counters_are(info_hash, 3, 0, 2));
+
+    //a new peer only counts when it says it completed
+    announce(info_hash, 3, 0, EVENT_COMPLETED);
+    announce(info_hash, 4, 0, EVENT_NONE);
+    CHECK(counters_are(info_hash, 5, 0, 3));
+
+    //a seeder that starts leeching again moves back
+    announce(info_hash, 4, 10, EVENT_NONE);
+    CHECK(counters_are(info_hash, 4, 1, 3));
+
+    //stopped uncounts the peer once
+    announce(info_hash, 1, 0, EVENT_STOPPED);
+    CHECK(counters_are(info_hash, 3, 1, 3));
+    announce(info_hash, 1, 0, EVENT_STOPPED);
+    CHECK(counters_are(info_hash, 3, 1, 3));
+    announce(info_hash, 4, 10, EVENT_STOPPED);
+    CHECK(counters_are(info_hash, 3, 0, 3));
+
+    //expiry uncounts too: two seeders and a leecher restored one second before their
+    //timeout, next to a fresh leecher
+    char expiring[INFO_HASH_LEN];
+    make_id(expiring, 'h', 2);
+
+    tracker_peer_record_t records[4];
+    memset(records, 0, sizeof records);
+    for (U32 i = 0; i < 4; i++) {
+        make_id(records[i].peer_id, 'p', 100 + i);
+        records[i].seeder = i < 2;
+        records[i].age = i < 3 ? TRACKER_PEER_TIMEOUT - 1 : 0;
+    }
+    CHECK(tracker_restore_torrent(expiring, 7, 0, records, 4, 0) == 0);
+    CHECK(counters_are(expiring, 2, 2, 7));
+
+    sleep(2);
+    CHECK(tracker_expire_peers(100) == 3);
+    CHECK(counters_are(expiring, 0, 1, 7));
+    CHECK(counters_are(info_hash, 3, 0, 3));
+
+    tracker_logic_deinit();
+    return TEST_RESULT();
+}
@@ -0,0 +1,90 @@
+#include "test.h"
+
+#include "hashmap.h"
+#include "logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define KEY_COUNT 20000
+
+static char (*keys)[HASHMAP_KEY_LEN];
+
+static const char* key_of(void* ctx, U32 value) {
+    (void) ctx;
+    return keys[value];
+}
+
+//similar keys with a shared prefix, like peer ids of one client
+static void make_key(U32 i, char* key) {
+    memcpy(key, "-TT0001-", 8);
+    memset(key + 8, 0, HASHMAP_KEY_LEN - 8);
+    memcpy(key + 12, &i, sizeof i);
+}
+
+int main() {
+    logger_initConsoleLogger(stderr);
+    logger_setLevel(LogLevel_WARN);
+
+    keys = malloc(KEY_COUNT * sizeof *keys);
+    for (U32 i = 0; i < KEY_COUNT; i++)
+        make_key(i, keys[i]);
+
+    hashmap_t map;
+    hashmap_init(&map, 0, key_of, NULL);
+
+    //every key stays reachable while the old table is drained
+    U32 resizing = 0;
+    for (U32 i = 0; i < KEY_COUNT; i++) {
+        CHECK(hashmap_insert(&map, keys[i], i) == 0);
+
+        if (map.old.entries != NULL) {
+            resizing++;
+            for (U32 j = 0; j <= i; j += 97)
+                CHECK(hashmap_get(&map, keys[j]) == (I32)j);
+        }
+    }
+    CHECK(resizing > 0);
+    CHECK(hashmap_size(&map) == KEY_COUNT);
+
+    for (U32 i = 0; i < KEY_COUNT; i++)
+        CHECK(hashmap_get(&map, keys[i]) == (I32)i);
+
+    char missing[HASHMAP_KEY_LEN];
+    make_key(KEY_COUNT, missing);
+    CHECK(hashmap_get(&map, missing) == -1);
+    CHECK(hashmap_remove(&map, missing) == -1);
+
+    //erase every other key, the probe chains of the rest have to stay intact. Remove
+    //returns the value it dropped
+    for (U32 i = 0; i < KEY_COUNT; i += 2)
+        CHECK(hashmap_remove(&map, keys[i]) == (I32)i);
+    CHECK(hashmap_size(&map) == KEY_COUNT / 2);
+
+    for (U32 i = 0; i < KEY_COUNT; i++)
+        CHECK(hashmap_get(&map, keys[i]) == ((i & 1) ? (I32)i : -1));
+
+    //iteration sees every value exactly once
+    U8* seen = calloc(KEY_COUNT, 1);
+    U32 it = 0;
+    I32 value;
+    U32 visited = 0;
+    while ((value = hashmap_next(&map, &it)) >= 0) {
+        CHECK(value < KEY_COUNT && (value & 1) && !seen[value]);
+        seen[value] = 1;
+        visited++;
+    }
+    CHECK(visited == KEY_COUNT / 2);
+
+    //erased keys can come back under new values
+    for (U32 i = 0; i < KEY_COUNT; i += 2)
+        CHECK(hashmap_insert(&map, keys[i], i) == 0);
+    for (U32 i = 0; i < KEY_COUNT; i++)
+        CHECK(hashmap_get(&map, keys[i]) == (I32)i);
+    CHECK(hashmap_size(&map) == KEY_COUNT);
+
+    hashmap_deinit(&map);
+    free(seen);
+    free(keys);
+    return TEST_RESULT();
+}
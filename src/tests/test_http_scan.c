@@ -0,0 +1,96 @@
+#include "test.h"
+
+#include "http/http_scan.h"
+#include "logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LEN 300
+
+typedef struct scan_variant_t {
+    const char* name;
+    http_scan_fn fn;
+} scan_variant_t;
+
+static scan_variant_t variants[3];
+static U32 variant_count;
+
+static U32 reference_scan(const char* buf, U32 len, U16* positions) {
+    U32 count = 0;
+    for (U32 i = 0; i < len; i++) {
+        if (buf[i] != '\0' && strchr(" ?&=:\r\n", buf[i]) != NULL)
+            positions[count++] = i;
+    }
+    return count;
+}
+
+//every variant has to find exactly the delimiters the reference finds
+static void check_all(const char* buf, U32 len) {
+    U16 expected[MAX_LEN];
+    U16 positions[MAX_LEN];
+    U32 expected_count = reference_scan(buf, len, expected);
+
+    for (U32 v = 0; v < variant_count; v++) {
+        memset(positions, 0xff, sizeof positions);
+        U32 count = variants[v].fn(buf, len, positions);
+
+        int ok = count == expected_count && memcmp(positions, expected, count * sizeof(U16)) == 0;
+        if (!ok)
+            fprintf(stderr, "%s: len %u, %u delimiters instead of %u\n", variants[v].name, len, count, expected_count);
+        CHECK(ok);
+    }
+}
+
+int main() {
+    logger_initConsoleLogger(stderr);
+    logger_setLevel(LogLevel_WARN);
+
+    http_scan_init();
+
+    variants[variant_count++] = (scan_variant_t){ "scalar", http_scan_scalar };
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        variants[variant_count++] = (scan_variant_t){ "sse2", http_scan_sse2 };
+    if (__builtin_cpu_supports("avx2"))
+        variants[variant_count++] = (scan_variant_t){ "avx2", http_scan_avx2 };
+#endif
+
+    char buf[MAX_LEN];
+
+    //the header terminator at every offset around the 16 and 32 byte block edges, for every
+    //length, so the vector loops and the scalar tail split it in every possible way
+    for (U32 len = 0; len <= 80; len++) {
+        for (U32 at = 0; at + 4 <= len; at++) {
+            memset(buf, 'a', sizeof buf);
+            memcpy(buf + at, "\r\n\r\n", 4);
+            check_all(buf, len);
+        }
+    }
+
+    //a delimiter in the last byte of a block and the first of the next one
+    const U32 edges[] = { 15, 16, 31, 32, 47, 48, 63, 64 };
+    for (U32 e = 0; e < sizeof edges / sizeof edges[0]; e++) {
+        memset(buf, 'a', sizeof buf);
+        buf[edges[e]] = '&';
+        buf[edges[e] + 1] = '=';
+        for (U32 len = edges[e]; len < edges[e] + 40; len++)
+            check_all(buf, len);
+    }
+
+    //a real request, then random bytes heavy in delimiters and high bytes
+    const char* request = "GET /announce?info_hash=%12%34&peer_id=abc&port=6881 HTTP/1.1\r\nHost: tracker:8080\r\n\r\n";
+    check_all(request, strlen(request));
+
+    srand(1);
+    const char alphabet[] = " ?&=:\r\nab%\x80\xff";
+    for (U32 round = 0; round < 2000; round++) {
+        U32 len = rand() % MAX_LEN;
+        for (U32 i = 0; i < len; i++)
+            buf[i] = alphabet[rand() % (sizeof alphabet - 1)];
+        check_all(buf, len);
+    }
+
+    return TEST_RESULT();
+}
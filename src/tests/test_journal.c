@@ -0,0 +1,107 @@
+#include "test.h"
+
+#include "journal.h"
+#include "logger.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define JOURNAL_PATH "test_journal.journal"
+#define MAX_RECORDS 64
+
+static journal_record_t replayed[MAX_RECORDS];
+static U32 replayed_count;
+
+static void collect(const journal_record_t* record) {
+    if (replayed_count < MAX_RECORDS)
+        replayed[replayed_count] = *record;
+    replayed_count++;
+}
+
+static I64 replay(U64* next_lsn) {
+    replayed_count = 0;
+    *next_lsn = 1;
+    return journal_replay(JOURNAL_PATH, collect, next_lsn);
+}
+
+//appends count records and waits until the writer synced them
+static void write_records(U64 first_lsn, U32 count) {
+    char key[20];
+    memset(key, 'k', sizeof key);
+
+    CHECK(journal_init(JOURNAL_PATH, first_lsn) == 0);
+    for (U32 i = 0; i < count; i++)
+        CHECK(journal_append(i % 2 ? JOURNAL_TRANSFER : JOURNAL_COMPLETED, key, i, 2 * i) == first_lsn + i);
+    journal_deinit();
+}
+
+static void append_bytes(U32 segment, const void* data, size_t size) {
+    char name[64];
+    snprintf(name, sizeof name, "%s.%08u", JOURNAL_PATH, segment);
+
+    int fd = open(name, O_WRONLY | O_APPEND);
+    CHECK(fd >= 0);
+    if (fd >= 0) {
+        CHECK(write(fd, data, size) == (ssize_t)size);
+        close(fd);
+    }
+}
+
+static void remove_segments(U32 last) {
+    char name[64];
+    for (U32 segment = 1; segment <= last; segment++) {
+        snprintf(name, sizeof name, "%s.%08u", JOURNAL_PATH, segment);
+        unlink(name);
+    }
+}
+
+int main() {
+    logger_initConsoleLogger(stderr);
+    logger_setLevel(LogLevel_ERROR);
+    remove_segments(8);
+
+    write_records(1, 10);
+
+    U64 next_lsn;
+    CHECK(replay(&next_lsn) == 10);
+    CHECK(next_lsn == 11);
+    for (U32 i = 0; i < 10 && i < replayed_count; i++) {
+        CHECK(replayed[i].lsn == i + 1);
+        CHECK(replayed[i].value0 == i && replayed[i].value1 == 2 * i);
+        CHECK(replayed[i].type == (i % 2 ? JOURNAL_TRANSFER : JOURNAL_COMPLETED));
+    }
+
+    //a crash in the middle of a write leaves part of a record behind
+    journal_record_t torn = replayed[9];
+    torn.lsn = 11;
+    append_bytes(1, &torn, sizeof torn / 2);
+    CHECK(replay(&next_lsn) == 10);
+    CHECK(next_lsn == 11);
+
+    //a whole record whose bytes did not all reach the disk
+    remove_segments(1);
+    write_records(1, 10);
+    torn.value0 ^= 0x5a;
+    append_bytes(1, &torn, sizeof torn);
+    CHECK(replay(&next_lsn) == 10);
+    CHECK(next_lsn == 11);
+
+    //the next run starts a new segment, replay continues past the torn one in lsn order
+    write_records(next_lsn, 5);
+    CHECK(replay(&next_lsn) == 15);
+    CHECK(next_lsn == 16);
+    for (U32 i = 0; i < 15 && i < replayed_count; i++)
+        CHECK(replayed[i].lsn == i + 1);
+
+    //segments a snapshot covers are deleted
+    CHECK(journal_init(JOURNAL_PATH, next_lsn) == 0);
+    journal_compact(2);
+    journal_deinit();
+    CHECK(replay(&next_lsn) == 5);
+    CHECK(replayed_count == 5 && replayed[0].lsn == 11);
+
+    remove_segments(8);
+    return TEST_RESULT();
+}
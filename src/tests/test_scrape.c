@@ -0,0 +1,83 @@
+#include "test.h"
+
+#include "tracker_logic.h"
+#include "logger.h"
+
+#include <string.h>
+
+#define INFO_HASH_LEN 20
+#define TORRENT_COUNT 60
+
+static void make_hash(char* info_hash, char tag, U32 i) {
+    memset(info_hash, tag, INFO_HASH_LEN);
+    memcpy(info_hash, &i, sizeof i);
+}
+
+//torrent i has i % 4 seeders, i % 3 + 1 leechers and i % 5 completed downloads
+static void fill_store() {
+    for (U32 i = 0; i < TORRENT_COUNT; i++) {
+        char info_hash[INFO_HASH_LEN];
+        make_hash(info_hash, 'h', i);
+
+        tracker_peer_record_t peers[6];
+        U32 peer_count = i % 4 + i % 3 + 1;
+        memset(peers, 0, sizeof peers);
+        for (U32 p = 0; p < peer_count; p++) {
+            make_hash(peers[p].peer_id, 'p', i * 8 + p);
+            peers[p].seeder = p < i % 4;
+        }
+        CHECK(tracker_restore_torrent(info_hash, i % 5, 0, peers, peer_count, 0) == 0);
+    }
+}
+
+int main() {
+    logger_initConsoleLogger(stderr);
+    logger_setLevel(LogLevel_WARN);
+
+    tracker_logic_init(4, 0, 0);
+    fill_store();
+
+    //a full datagram worth of hashes: known torrents spread over every partition,
+    //unknown ones and a duplicate, answered in request order
+    char hashes[TRACKER_MAX_SCRAPE * INFO_HASH_LEN];
+    U32 torrent_of[TRACKER_MAX_SCRAPE];
+    for (U32 i = 0; i < TRACKER_MAX_SCRAPE; i++) {
+        U32 t = (i * 7) % 80;
+        if (i == TRACKER_MAX_SCRAPE - 1)
+            t = torrent_of[0];
+        torrent_of[i] = t;
+        make_hash(hashes + i * INFO_HASH_LEN, 'h', t);
+    }
+
+    tracker_scrape_result_t results[TRACKER_MAX_SCRAPE];
+    memset(results, 0xff, sizeof results);
+    tracker_scrape(hashes, TRACKER_MAX_SCRAPE, results);
+
+    for (U32 i = 0; i < TRACKER_MAX_SCRAPE; i++) {
+        U32 t = torrent_of[i];
+        if (t < TORRENT_COUNT) {
+            CHECK(results[i].found == 1);
+            CHECK(results[i].seeders == t % 4);
+            CHECK(results[i].leechers == t % 3 + 1);
+            CHECK(results[i].completed == t % 5);
+        }
+        else {
+            CHECK(results[i].found == 0);
+            CHECK(results[i].seeders == 0 && results[i].leechers == 0 && results[i].completed == 0);
+        }
+    }
+
+    //more than fit in a datagram are cut at TRACKER_MAX_SCRAPE
+    char many[(TRACKER_MAX_SCRAPE + 1) * INFO_HASH_LEN];
+    for (U32 i = 0; i <= TRACKER_MAX_SCRAPE; i++)
+        make_hash(many + i * INFO_HASH_LEN, 'h', 1);
+
+    tracker_scrape_result_t capped[TRACKER_MAX_SCRAPE + 1];
+    memset(capped, 0xff, sizeof capped);
+    tracker_scrape(many, TRACKER_MAX_SCRAPE + 1, capped);
+    CHECK(capped[TRACKER_MAX_SCRAPE - 1].found == 1);
+    CHECK(capped[TRACKER_MAX_SCRAPE].found == 0xffffffff);
+
+    tracker_logic_deinit();
+    return TEST_RESULT();
+}
@@ -0,0 +1,166 @@
+#include "test.h"
+
+#include "logger.h"
+#include "snapshot.h"
+#include "tracker_logic.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SNAPSHOT_PATH "test_snapshot.snapshot"
+#define TORRENT_COUNT 50
+#define PARTITIONS 4
+
+typedef struct torrent_state_t {
+    U32 found;
+    U32 seeders;
+    U32 leechers;
+    U32 completed;
+    U32 peer_count;
+} torrent_state_t;
+
+static void make_id(char* id, char tag, U32 i) {
+    memset(id, tag, 20);
+    memcpy(id + 4, &i, sizeof i);
+}
+
+//torrent i gets i % 7 + 1 peers, every third of them a seeder. The leechers among the
+//first i % 5 complete their download
+static void fill_store() {
+    U8 peers[TRACKER_MAX_NUMWANT * COMPACT_PEER_LEN];
+    tracker_announce_result_t result;
+
+    for (U32 i = 0; i < TORRENT_COUNT; i++) {
+        char info_hash[20];
+        make_id(info_hash, 'h', i);
+
+        for (U32 p = 0; p < i % 7 + 1; p++) {
+            char peer_id[20];
+            make_id(peer_id, 'p', i * 16 + p);
+
+            tracker_announce_t announce;
+            memset(&announce, 0, sizeof announce);
+            announce.info_hash = info_hash;
+            announce.peer_id = peer_id;
+            announce.ip = htonl(0x0a000000 + i * 16 + p);
+            announce.port = htons(6881 + p);
+            announce.left = p % 3 == 0 ? 0 : 1000;
+            announce.event = EVENT_STARTED;
+            announce.numwant = 50;
+            CHECK(tracker_announce(&announce, peers, TRACKER_MAX_NUMWANT, &result) == 0);
+
+            if (p % 3 != 0 && p < i % 5) {
+                announce.left = 0;
+                announce.event = EVENT_COMPLETED;
+                CHECK(tracker_announce(&announce, peers, TRACKER_MAX_NUMWANT, &result) == 0);
+            }
+        }
+    }
+
+    for (U32 i = 0; i < 10; i++) {
+        char auth_key[20];
+        make_id(auth_key, 'a', i);
+        CHECK(tracker_restore_account(auth_key, 1000 * i, 2000 * i, 100 + i) == 0);
+    }
+}
+
+static void collect_torrent(void* ctx, const torrentfile_t* torrent, U32 now) {
+    torrent_state_t* states = ctx;
+    U32 i;
+    memcpy(&i, torrent->info_hash + 4, sizeof i);
+    if (i >= TORRENT_COUNT)
+        return;
+
+    states[i].found++;
+    states[i].seeders = torrent->seeders;
+    states[i].leechers = torrent->lecheers;
+    states[i].completed = torrent->completed;
+    states[i].peer_count = torrent->peer_count;
+}
+
+static void collect_all(torrent_state_t* states) {
+    memset(states, 0, TORRENT_COUNT * sizeof(torrent_state_t));
+    for (U32 p = 0; p < tracker_partition_count(); p++)
+        tracker_visit_partition(p, collect_torrent, states);
+}
+
+int main() {
+    logger_initConsoleLogger(stderr);
+    logger_setLevel(LogLevel_WARN);
+
+    //the first store takes its torrents from an arena, the others from malloc
+    tracker_logic_init(PARTITIONS, (size_t)8 << 20, 0);
+    fill_store();
+
+    torrent_state_t before[TORRENT_COUNT];
+    collect_all(before);
+    CHECK(before[6].found == 1 && before[6].peer_count == 7);
+
+    CHECK(snapshot_save(SNAPSHOT_PATH) == 0);
+    tracker_logic_deinit();
+
+    //a different partition count, every record has to land in its new partition
+    tracker_logic_init(PARTITIONS * 2, 0, 0);
+
+    U64 next_lsn = 1;
+    CHECK(snapshot_load(SNAPSHOT_PATH, 2, &next_lsn) == TORRENT_COUNT);
+    CHECK(next_lsn == 110);
+
+    torrent_state_t after[TORRENT_COUNT];
+    collect_all(after);
+
+    for (U32 i = 0; i < TORRENT_COUNT; i++) {
+        CHECK(after[i].found == 1);
+        CHECK(after[i].seeders == before[i].seeders);
+        CHECK(after[i].leechers == before[i].leechers);
+        CHECK(after[i].completed == before[i].completed);
+        CHECK(after[i].peer_count == before[i].peer_count);
+    }
+
+    for (U32 i = 0; i < 10; i++) {
+        char auth_key[20];
+        make_id(auth_key, 'a', i);
+        account_info_t account = tracker_get_account(auth_key);
+        CHECK(account.totalDownload == 1000 * i);
+        CHECK(account.totalUploads == 2000 * i);
+        CHECK(account.journal_lsn == 100 + i);
+    }
+
+    //the peers came back too: a new peer gets the restored ones
+    char info_hash[20];
+    char peer_id[20];
+    make_id(info_hash, 'h', 6);
+    make_id(peer_id, 'n', 0);
+
+    tracker_announce_t announce;
+    memset(&announce, 0, sizeof announce);
+    announce.info_hash = info_hash;
+    announce.peer_id = peer_id;
+    announce.ip = htonl(0x0b000001);
+    announce.port = htons(6881);
+    announce.left = 1;
+    announce.event = EVENT_STARTED;
+    announce.numwant = 50;
+
+    U8 peers[TRACKER_MAX_NUMWANT * COMPACT_PEER_LEN];
+    tracker_announce_result_t result;
+    CHECK(tracker_announce(&announce, peers, TRACKER_MAX_NUMWANT, &result) == 0);
+    CHECK(result.peer_count == 7);
+
+    tracker_logic_deinit();
+
+    //a truncated file is refused
+    FILE* f = fopen(SNAPSHOT_PATH, "r+");
+    CHECK(f != NULL);
+    if (f != NULL) {
+        CHECK(ftruncate(fileno(f), sizeof(snapshot_header_t) + 8) == 0);
+        fclose(f);
+    }
+    tracker_logic_init(PARTITIONS, 0, 0);
+    CHECK(snapshot_load(SNAPSHOT_PATH, 1, &next_lsn) == -1);
+    tracker_logic_deinit();
+
+    unlink(SNAPSHOT_PATH);
+    return TEST_RESULT();
+}
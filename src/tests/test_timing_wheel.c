@@ -0,0 +1,95 @@
+#include "test.h"
+
+#include "timing_wheel.h"
+
+#include <string.h>
+
+#define START 1000
+#define NODE_COUNT 6
+
+typedef struct expiry_t {
+    timing_wheel_t* wheel;
+    I32 node[NODE_COUNT];
+    U32 deadline[NODE_COUNT];
+    U32 expired_at[NODE_COUNT];
+    U32 visits[NODE_COUNT];
+} expiry_t;
+
+//expires a node at its deadline and reschedules it when it came due early
+static U32 on_due(void* ctx, const wheel_node_t* node, U32 now) {
+    expiry_t* e = ctx;
+    U32 i = node->owner;
+
+    e->visits[i]++;
+    if ((I32)(now - e->deadline[i]) < 0)
+        return e->deadline[i];
+
+    e->expired_at[i] = now;
+    timing_wheel_remove(e->wheel, e->node[i]);
+    return 0;
+}
+
+int main() {
+    timing_wheel_t wheel;
+    timing_wheel_init(&wheel, START);
+
+    expiry_t e;
+    memset(&e, 0, sizeof e);
+    e.wheel = &wheel;
+
+    //level 0, the last level 0 second, level 1 (cascaded), two rounds out, past the horizon,
+    //and an overdue one that is due on the next tick
+    U32 deadlines[NODE_COUNT] = {
+        START + 5,
+        START + WHEEL_L0_SIZE - 1,
+        START + WHEEL_L0_SIZE + 17,
+        START + 2 * WHEEL_L0_SIZE + 3,
+        START + WHEEL_HORIZON + 300,
+        START - 10
+    };
+
+    for (U32 i = 0; i < NODE_COUNT; i++) {
+        e.deadline[i] = deadlines[i];
+        e.node[i] = timing_wheel_add(&wheel, i, i, e.deadline[i]);
+        CHECK(e.node[i] >= 0);
+    }
+    CHECK(wheel.size == NODE_COUNT);
+
+    //a budget of 0 visits nothing and keeps the time
+    CHECK(timing_wheel_advance(&wheel, START + 10, 0, on_due, &e) == 0);
+    CHECK(wheel.time == START);
+
+    U32 end = START + WHEEL_HORIZON + 400;
+    for (U32 now = START; now <= end; now++)
+        timing_wheel_advance(&wheel, now, 1000, on_due, &e);
+
+    for (U32 i = 0; i < NODE_COUNT - 1; i++)
+        CHECK(e.expired_at[i] == e.deadline[i]);
+    CHECK(e.expired_at[NODE_COUNT - 1] == START);
+    CHECK(wheel.size == 0);
+
+    //level 0 nodes are visited once, a cascaded node once more on its way down
+    CHECK(e.visits[0] == 1);
+    CHECK(e.visits[2] == 2);
+
+    //a node that is removed before it is due is never visited
+    U32 before = e.visits[0];
+    e.deadline[0] = end + 3;
+    e.node[0] = timing_wheel_add(&wheel, 0, 0, e.deadline[0]);
+    timing_wheel_remove(&wheel, e.node[0]);
+    timing_wheel_advance(&wheel, end + 10, 1000, on_due, &e);
+    CHECK(e.visits[0] == before);
+
+    //a budget that runs out leaves the rest of the bucket for the next call
+    for (U32 i = 0; i < 4; i++) {
+        e.deadline[i] = end + 20;
+        e.node[i] = timing_wheel_add(&wheel, i, i, e.deadline[i]);
+    }
+    CHECK(timing_wheel_advance(&wheel, end + 20, 3, on_due, &e) == 3);
+    CHECK(wheel.size == 1);
+    CHECK(timing_wheel_advance(&wheel, end + 20, 3, on_due, &e) == 1);
+    CHECK(wheel.size == 0);
+
+    timing_wheel_deinit(&wheel);
+    return TEST_RESULT();
+}
@@ -0,0 +1,135 @@
+#include "test.h"
+
+#include "http/url_decode.h"
+#include "logger.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LEN 300
+
+static const char* impl_names[] = { "scalar", "sse2", "avx2" };
+static url_decode_impl_t impls[3];
+static U32 impl_count;
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static I32 reference_decode(const char* buf, U32 len, U8* dest, U32 max_len) {
+    U32 written = 0;
+    for (U32 i = 0; i < len; i++) {
+        U8 c = buf[i];
+        if (c == '%') {
+            if (i + 2 >= len || hex_value(buf[i + 1]) < 0 || hex_value(buf[i + 2]) < 0)
+                return -1;
+            c = hex_value(buf[i + 1]) << 4 | hex_value(buf[i + 2]);
+            i += 2;
+        }
+        if (written == max_len)
+            return -1;
+        dest[written++] = c;
+    }
+    return written;
+}
+
+//every classifier has to agree with the reference on the result and the decoded bytes
+static void check_all(const char* buf, U32 len, U32 max_len) {
+    U8 expected[MAX_LEN];
+    U8 decoded[MAX_LEN];
+    I32 expected_len = reference_decode(buf, len, expected, max_len);
+
+    for (U32 i = 0; i < impl_count; i++) {
+        url_decode_select(impls[i]);
+        memset(decoded, 0, sizeof decoded);
+        I32 n = url_decode(buf, len, decoded, max_len);
+
+        int ok = n == expected_len && (n < 0 || memcmp(decoded, expected, n) == 0);
+        if (!ok)
+            fprintf(stderr, "%s: '%.*s' decoded to %d bytes instead of %d\n", impl_names[impls[i]], len, buf, n, expected_len);
+        CHECK(ok);
+    }
+}
+
+int main() {
+    logger_initConsoleLogger(stderr);
+    logger_setLevel(LogLevel_WARN);
+
+    url_decode_init();
+
+    for (I32 impl = URL_DECODE_SCALAR; impl <= URL_DECODE_AVX2; impl++) {
+        if (url_decode_select(impl) == 0)
+            impls[impl_count++] = impl;
+    }
+    CHECK(impl_count >= 1);
+
+    char buf[MAX_LEN];
+
+    check_all("", 0, 20);
+    check_all("abc", 3, 20);
+    check_all("%41%42%43", 9, 20);
+    check_all("%e4%B8%ad", 9, 20);
+
+    //bad and truncated escapes
+    const char* bad[] = { "%", "%4", "a%", "ab%4", "%g1", "%1g", "%%41", "%4%41", "x%zz", "%41%" };
+    for (U32 i = 0; i < sizeof bad / sizeof bad[0]; i++)
+        check_all(bad[i], strlen(bad[i]), 20);
+
+    //an escape, a bad escape and a truncated one at every offset around the 16, 32 and
+    //64 byte edges, for every length, so the windows and their padding cut them every way
+    const char* escapes[] = { "%7E", "%7g", "%7" };
+    for (U32 e = 0; e < sizeof escapes / sizeof escapes[0]; e++) {
+        U32 esc_len = strlen(escapes[e]);
+        for (U32 len = 0; len <= 140; len++) {
+            for (U32 at = 0; at + esc_len <= len; at++) {
+                memset(buf, 'a', sizeof buf);
+                memcpy(buf + at, escapes[e], esc_len);
+                check_all(buf, len, MAX_LEN);
+            }
+        }
+    }
+
+    //a 20 byte info_hash fully escaped, with max_len right at and just below the result
+    const char* hash = "%01%02%03%04%05%06%07%08%09%10%11%12%13%14%15%16%17%18%19%20";
+    check_all(hash, strlen(hash), 20);
+    check_all(hash, strlen(hash), 19);
+    memset(buf, 'a', sizeof buf);
+    for (U32 at = 0; at + 3 <= 70; at += 7)
+        memcpy(buf + at, "%41", 3);
+    for (U32 max_len = 0; max_len <= 70; max_len++)
+        check_all(buf, 70, max_len);
+
+    srand(1);
+    const char alphabet[] = "%%%0123456789abcdefABCDEFgz &=\x80\xff";
+    for (U32 round = 0; round < 5000; round++) {
+        U32 len = rand() % MAX_LEN;
+        for (U32 i = 0; i < len; i++)
+            buf[i] = alphabet[rand() % (sizeof alphabet - 1)];
+        check_all(buf, len, rand() % 2 ? MAX_LEN : rand() % MAX_LEN);
+    }
+
+    //mostly valid escapes, so long runs decode instead of failing early
+    for (U32 round = 0; round < 2000; round++) {
+        U32 len = 0;
+        U32 target = rand() % (MAX_LEN - 3);
+        while (len < target) {
+            if (rand() % 3 == 0) {
+                buf[len++] = '%';
+                buf[len++] = "0123456789abcdefABCDEF"[rand() % 22];
+                buf[len++] = "0123456789abcdefABCDEF"[rand() % 22];
+            }
+            else {
+                buf[len++] = alphabet[3 + rand() % (sizeof alphabet - 4)];
+            }
+        }
+        check_all(buf, len, MAX_LEN);
+    }
+
+    return TEST_RESULT();
+}
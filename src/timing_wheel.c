@@ -0,0 +1,155 @@
+#include "timing_wheel.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define NODES_INITIAL_CAPACITY 64
+
+static inline I32* bucket_head(timing_wheel_t* wheel, U32 bucket) {
+    return bucket < WHEEL_L0_SIZE ? &wheel->level0[bucket] : &wheel->level1[bucket - WHEEL_L0_SIZE];
+}
+
+static void wheel_link(timing_wheel_t* wheel, I32 n, U32 bucket) {
+    wheel_node_t* node = &wheel->nodes[n];
+    I32* head = bucket_head(wheel, bucket);
+
+    node->bucket = bucket;
+    node->prev = -1;
+    node->next = *head;
+    if (*head >= 0)
+        wheel->nodes[*head].prev = n;
+    *head = n;
+}
+
+static void wheel_unlink(timing_wheel_t* wheel, I32 n) {
+    wheel_node_t* node = &wheel->nodes[n];
+
+    if (node->bucket == WHEEL_DETACHED)
+        return;
+
+    if (node->prev >= 0)
+        wheel->nodes[node->prev].next = node->next;
+    else
+        *bucket_head(wheel, node->bucket) = node->next;
+
+    if (node->next >= 0)
+        wheel->nodes[node->next].prev = node->prev;
+
+    node->bucket = WHEEL_DETACHED;
+}
+
+//deadline is relative to wheel->time, which is always ahead of every linked node's bucket
+static void place(timing_wheel_t* wheel, I32 n, U32 deadline) {
+
+    U32 delta = deadline - wheel->time;
+    if ((I32)delta < WHEEL_L0_SIZE) {
+        //overdue nodes go to the bucket processed next
+        U32 tick = (I32)delta < 0 ? wheel->time : deadline;
+        wheel_link(wheel, n, tick & (WHEEL_L0_SIZE - 1));
+        return;
+    }
+
+    U32 blocks = (deadline >> WHEEL_L0_BITS) - (wheel->time >> WHEEL_L0_BITS);
+    if (blocks > WHEEL_L1_SIZE - 1)
+        blocks = WHEEL_L1_SIZE - 1;
+
+    U32 bucket = ((wheel->time >> WHEEL_L0_BITS) + blocks) & (WHEEL_L1_SIZE - 1);
+    wheel_link(wheel, n, WHEEL_L0_SIZE + bucket);
+}
+
+
+void timing_wheel_init(timing_wheel_t* wheel, U32 now) {
+    memset(wheel, 0, sizeof *wheel);
+    wheel->free_node = -1;
+    wheel->time = now;
+
+    for (U32 i = 0; i < WHEEL_L0_SIZE; i++)
+        wheel->level0[i] = -1;
+    for (U32 i = 0; i < WHEEL_L1_SIZE; i++)
+        wheel->level1[i] = -1;
+}
+
+void timing_wheel_deinit(timing_wheel_t* wheel) {
+    free(wheel->nodes);
+    wheel->nodes = NULL;
+    wheel->node_count = 0;
+    wheel->node_capacity = 0;
+    wheel->free_node = -1;
+    wheel->size = 0;
+}
+
+I32 timing_wheel_add(timing_wheel_t* wheel, U32 owner, U32 slot, U32 deadline) {
+
+    I32 n = wheel->free_node;
+    if (n >= 0) {
+        wheel->free_node = wheel->nodes[n].next;
+    }
+    else {
+        if (wheel->node_count == wheel->node_capacity) {
+            U32 capacity = wheel->node_capacity ? wheel->node_capacity * 2 : NODES_INITIAL_CAPACITY;
+            wheel_node_t* nodes = realloc(wheel->nodes, (size_t)capacity * sizeof(wheel_node_t));
+            if (nodes == NULL)
+                return -1;
+
+            wheel->nodes = nodes;
+            wheel->node_capacity = capacity;
+        }
+        n = wheel->node_count++;
+    }
+
+    wheel->nodes[n].owner = owner;
+    wheel->nodes[n].slot = slot;
+    place(wheel, n, deadline);
+
+    wheel->size++;
+    return n;
+}
+
+void timing_wheel_remove(timing_wheel_t* wheel, I32 n) {
+    wheel_unlink(wheel, n);
+
+    wheel->nodes[n].next = wheel->free_node;
+    wheel->free_node = n;
+    wheel->size--;
+}
+
+//hands every node of a bucket to due, returns -1 when the budget ran out first
+static I32 drain(timing_wheel_t* wheel, I32* head, U32 t, U32* visited, U32 budget, wheel_due_fn due, void* ctx) {
+
+    I32 n;
+    while ((n = *head) >= 0) {
+        if (*visited == budget)
+            return -1;
+
+        wheel_unlink(wheel, n);
+        (*visited)++;
+
+        U32 deadline = due(ctx, &wheel->nodes[n], t);
+        if (deadline != 0)
+            place(wheel, n, deadline);
+    }
+    return 0;
+}
+
+U32 timing_wheel_advance(timing_wheel_t* wheel, U32 now, U32 budget, wheel_due_fn due, void* ctx) {
+
+    U32 visited = 0;
+
+    while ((I32)(now - wheel->time) >= 0) {
+        U32 t = wheel->time;
+
+        //entering a new level 0 round, spread the matching level 1 bucket over it
+        if ((t & (WHEEL_L0_SIZE - 1)) == 0) {
+            I32* head = &wheel->level1[(t >> WHEEL_L0_BITS) & (WHEEL_L1_SIZE - 1)];
+            if (drain(wheel, head, t, &visited, budget, due, ctx) != 0)
+                break;
+        }
+
+        if (drain(wheel, &wheel->level0[t & (WHEEL_L0_SIZE - 1)], t, &visited, budget, due, ctx) != 0)
+            break;
+
+        wheel->time++;
+    }
+
+    return visited;
+}
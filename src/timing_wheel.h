@@ -0,0 +1,65 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include "types.h"
+
+#define WHEEL_L0_BITS 8
+#define WHEEL_L1_BITS 6
+#define WHEEL_L0_SIZE (1 << WHEEL_L0_BITS)
+#define WHEEL_L1_SIZE (1 << WHEEL_L1_BITS)
+
+//deadlines further away than this are parked in the last level 1 bucket and re-checked
+#define WHEEL_HORIZON (WHEEL_L0_SIZE * (WHEEL_L1_SIZE - 1))
+
+#define WHEEL_DETACHED 0xffff
+
+typedef struct wheel_node_t {
+    U32 owner;      //torrent pool index
+    U32 slot;       //peer slot inside the torrent
+    I32 next;
+    I32 prev;
+    U32 bucket;
+} wheel_node_t;
+
+/*
+ * Callback for a node whose bucket came due at tick now. Returns the node's real
+ * deadline when it has to be rescheduled (lazy, owners never touch the wheel on
+ * refresh), or 0 after it freed the node with timing_wheel_remove.
+ */
+typedef U32 (*wheel_due_fn)(void* ctx, const wheel_node_t* node, U32 now);
+
+/*
+ * Two level hierarchical timing wheel with 1 second ticks: level 0 has one bucket per
+ * second of the next WHEEL_L0_SIZE seconds, level 1 one bucket per WHEEL_L0_SIZE
+ * seconds that is cascaded into level 0 when time reaches it. Nodes live in one array
+ * with a free list and are linked into buckets by index, so owners keep a stable id.
+ */
+typedef struct timing_wheel_t {
+    wheel_node_t* nodes;
+    U32 node_count;
+    U32 node_capacity;
+    I32 free_node;
+
+    U32 time;       //next tick to process
+    U32 size;
+
+    I32 level0[WHEEL_L0_SIZE];
+    I32 level1[WHEEL_L1_SIZE];
+} timing_wheel_t;
+
+
+void timing_wheel_init(timing_wheel_t* wheel, U32 now);
+void timing_wheel_deinit(timing_wheel_t* wheel);
+
+//returns the node id, or -1 if the node array could not grow
+I32 timing_wheel_add(timing_wheel_t* wheel, U32 owner, U32 slot, U32 deadline);
+void timing_wheel_remove(timing_wheel_t* wheel, I32 node);
+
+static inline void timing_wheel_move(timing_wheel_t* wheel, I32 node, U32 slot) {
+    wheel->nodes[node].slot = slot;
+}
+
+//processes due buckets up to now, visiting at most budget nodes. Returns the nodes visited.
+U32 timing_wheel_advance(timing_wheel_t* wheel, U32 now, U32 budget, wheel_due_fn due, void* ctx);
+
+#endif
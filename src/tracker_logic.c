@@ -1,94 +1,827 @@
 #include "tracker_logic.h"
 
 #include "logger.h"
+#include "mem_pool.h"
 #include "hashmap.h"
+#include "timing_wheel.h"
 
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
+#include <time.h>
 
-#define TABLE_SIZE 100
+#define POOL_INITIAL_SIZE 128
 
+#define INFO_HASH_LEN 20
+#define PEER_ID_LEN 20
 
 
-static pthread_mutex_t mutex;
+#define PEERS_INITIAL_CAPACITY 4
 
-static mem_pool_t mem_pool;
+#define PEER_CACHE_LISTS 4
 
+//restored peers have no baseline, their first announce only sets it
+#define PEER_TOTALS_UNKNOWN ((U64)-1)
 
-static hashmap_t* user_map;
-static hashmap_t* torrent_map;
 
-static mem_pool_t user_pool;
+//every partition has its own lock and pool, so announces for different swarms never wait on each other
+typedef struct tracker_partition_t {
+    pthread_mutex_t mutex;
+    mem_pool_t torrent_pool;
+    mem_pool_t account_pool;
+    hashmap_t torrent_map;
+    hashmap_t account_map;      //accounts are partitioned by auth key
+    timing_wheel_t wheel;
+    U32 expired;
+} __attribute__((aligned(64))) tracker_partition_t;
 
-void tracker_logic_init() {
+//one extra peer, so a list still has enough once the announcing peer is skipped
+typedef struct peer_list_t {
+    U32 epoch;
+    U32 built;
+    U32 count;
+    U8 peers[(TRACKER_MAX_NUMWANT + 1) * COMPACT_PEER_LEN];
+} peer_list_t;
 
-    mem_pool_init(&mem_pool, 128);
+struct peer_cache_t {
+    peer_list_t lists[PEER_CACHE_LISTS];
+};
 
-    mem_pool_init(&user_pool, 128);
-    
-    int r;
-    if ((r = pthread_mutex_init(&mutex, NULL)) != 0) {
-        LOG_FATAL("pthread_mutex_init(): %d", r);
+static tracker_partition_t* partitions;
+static U32 partition_count;
+static U32 partition_mask;
+
+//coarse monotonic seconds, advanced by tracker_expire_peers and read by every announce
+static U32 tracker_clock;
+
+
+static inline U32 id_key(const char* id) {
+    U32 key;
+    memcpy(&key, id, sizeof key);
+    return key;
+}
+
+//per thread xorshift64*, only used to pick peers so it does not need to be strong
+static __thread U64 rng_state;
+
+static inline U32 fast_rand() {
+    if (rng_state == 0) {
+        if (getrandom(&rng_state, sizeof rng_state, 0) != sizeof rng_state)
+            rng_state = (U64)time(NULL) ^ (U64)pthread_self();
+        rng_state |= 1;
+    }
+
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static inline U32 rand_below(U32 n) {
+    return ((U64)fast_rand() * n) >> 32;
+}
+
+static inline U32 clock_read() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (U32)ts.tv_sec;
+}
+
+static inline U32 clock_now() {
+    return __atomic_load_n(&tracker_clock, __ATOMIC_RELAXED);
+}
+
+static inline U32 gcd(U32 a, U32 b) {
+    while (b != 0) {
+        U32 t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+//info_hash is uniformly random, so the last 4 bytes pick the partition
+static inline U32 partition_index(const char* info_hash) {
+    return id_key(info_hash + 16) & partition_mask;
+}
+
+static inline tracker_partition_t* get_partition(const char* info_hash) {
+    return &partitions[partition_index(info_hash)];
+}
+
+static const char* torrent_map_key(void* ctx, U32 index) {
+    return mem_pool_get_torrent((mem_pool_t*)ctx, index)->info_hash;
+}
+
+static const char* account_map_key(void* ctx, U32 index) {
+    return mem_pool_get_account((mem_pool_t*)ctx, index)->auth_key;
+}
+
+//ctx is the torrent's peer_info array, it is updated whenever the array moves
+static const char* peer_map_key(void* ctx, U32 slot) {
+    return ((peer_info_t*)ctx)[slot].peer_id;
+}
+
+static I32 find_torrent(tracker_partition_t* part, const char* info_hash);
+static I32 get_or_add_torrent(tracker_partition_t* part, const char* info_hash);
+static void free_torrent_peers(tracker_partition_t* part, torrentfile_t* torrent);
+static account_info_t* get_or_add_account(tracker_partition_t* part, const char* auth_key);
+static void credit_account(const char* auth_key, U64 downloaded, U64 uploaded);
+
+static I32 peer_add(tracker_partition_t* part, torrentfile_t* torrent, U32 torrent_index, const char* peer_id, U32 last_seen, U8 seeder);
+static void peer_set_seeder(torrentfile_t* torrent, peer_info_t* info, U8 seeder);
+static void peer_remove(tracker_partition_t* part, torrentfile_t* torrent, U32 slot);
+static U32 peer_due(void* ctx, const wheel_node_t* node, U32 now);
+static U32 peer_copy(torrentfile_t* torrent, I32 self, U8* dest, U32 count);
+static U32 peer_sample(torrentfile_t* torrent, I32 self, U8* dest, U32 count);
+static U32 peer_cached(torrentfile_t* torrent, I32 self, U8* dest, U32 count);
+
+
+void tracker_logic_init(U32 count, size_t arena_size, U32 arena_flags) {
+
+    partition_count = 1;
+    while (partition_count < count)
+        partition_count <<= 1;
+    partition_mask = partition_count - 1;
+
+    tracker_clock = clock_read();
+
+    if (posix_memalign((void**)&partitions, 64, partition_count * sizeof(tracker_partition_t)) != 0) {
+        LOG_FATAL("tracker_logic_init(): failed to allocate %u partitions", partition_count);
         return;
     }
 
+    U32 modes[MEM_ARENA_HUGETLB + 1] = {0};
+
+    for (U32 i = 0; i < partition_count; i++) {
+        tracker_partition_t* part = &partitions[i];
+
+        mem_pool_init_arena(&part->torrent_pool, POOL_INITIAL_SIZE, TORRENTFILE, arena_size / partition_count, arena_flags);
+        modes[part->torrent_pool.arena_mode]++;
+        mem_pool_init(&part->account_pool, POOL_INITIAL_SIZE, USERINFO);
+        hashmap_init(&part->torrent_map, POOL_INITIAL_SIZE, torrent_map_key, &part->torrent_pool);
+        hashmap_init(&part->account_map, 0, account_map_key, &part->account_pool);
+        timing_wheel_init(&part->wheel, tracker_clock);
+        part->expired = 0;
+
+        int r;
+        if ((r = pthread_mutex_init(&part->mutex, NULL)) != 0) {
+            LOG_FATAL("pthread_mutex_init(): %d", r);
+            return;
+        }
+    }
+
+    LOG_INFO("tracker store split into %u partitions", partition_count);
+
+    if (arena_size > 0) {
+        for (U32 mode = MEM_ARENA_NONE; mode <= MEM_ARENA_HUGETLB; mode++)
+            if (modes[mode] > 0)
+                LOG_INFO("torrent pool arena: %u partitions on %s", modes[mode], mem_pool_arena_mode_name(mode));
+    }
 }
 
-void tracker_add_user(const char* unique_id, U32 ip, U16 port, U32 numwant) {
-    pthread_mutex_lock(&mutex);
+void tracker_logic_deinit() {
 
-    //userinfo_t* new_user = (userinfo_t*)malloc(sizeof(userinfo_t));
-    //new_user->downloads = 69;
-    //new_user->uploads = 69;
+    for (U32 i = 0; i < partition_count; i++) {
+        tracker_partition_t* part = &partitions[i];
 
-    //hashmap_insert(user_map, unique_id, new_user);
+        U32 it = 0;
+        I32 index;
+        while ((index = hashmap_next(&part->torrent_map, &it)) >= 0)
+            free_torrent_peers(part, mem_pool_get_torrent(&part->torrent_pool, index));
 
-    pthread_mutex_unlock(&mutex);
+        pthread_mutex_destroy(&part->mutex);
+        hashmap_deinit(&part->torrent_map);
+        hashmap_deinit(&part->account_map);
+        timing_wheel_deinit(&part->wheel);
+        mem_pool_deinit(&part->torrent_pool);
+        mem_pool_deinit(&part->account_pool);
+    }
 
+    free(partitions);
+    partitions = NULL;
+    partition_count = 0;
 }
 
+static I32 find_torrent(tracker_partition_t* part, const char* info_hash) {
+    return hashmap_get(&part->torrent_map, info_hash);
+}
 
+static I32 get_or_add_torrent(tracker_partition_t* part, const char* info_hash) {
 
-void tracker_remove_user(const char* unique_id) {
-    pthread_mutex_lock(&mutex);
+    I32 index = find_torrent(part, info_hash);
+    if (index >= 0)
+        return index;
 
-    hashmap_remove(user_map, unique_id);
+    index = mem_pool_alloc_node(&part->torrent_pool);
+    if (index < 0)
+        return -1;
 
-    pthread_mutex_unlock(&mutex);
+    torrentfile_t* torrent = mem_pool_get_torrent(&part->torrent_pool, index);
+    memset(torrent, 0, sizeof *torrent);
+    memcpy(torrent->info_hash, info_hash, INFO_HASH_LEN);
+    hashmap_init(&torrent->peers, 0, peer_map_key, NULL);
 
+    if (hashmap_insert(&part->torrent_map, info_hash, index) != 0) {
+        mem_pool_free_node(&part->torrent_pool, index);
+        return -1;
+    }
+
+    return index;
 }
 
+static account_info_t* get_or_add_account(tracker_partition_t* part, const char* auth_key) {
 
-void tracker_add_torrent(const char* info_hash) {
-    pthread_mutex_lock(&mutex);
+    I32 index = hashmap_get(&part->account_map, auth_key);
+    if (index >= 0)
+        return mem_pool_get_account(&part->account_pool, index);
 
+    index = mem_pool_alloc_node(&part->account_pool);
+    if (index < 0)
+        return NULL;
 
+    account_info_t* account = mem_pool_get_account(&part->account_pool, index);
+    memset(account, 0, sizeof *account);
+    memcpy(account->auth_key, auth_key, sizeof account->auth_key);
 
-    pthread_mutex_unlock(&mutex);
+    if (hashmap_insert(&part->account_map, auth_key, index) != 0) {
+        mem_pool_free_node(&part->account_pool, index);
+        return NULL;
+    }
 
+    return account;
 }
 
-void tracker_remove_torrent(const char* info_hash) {
-    pthread_mutex_lock(&mutex);
-    pthread_mutex_unlock(&mutex);
+//journaled under the account's partition lock, so its records reach the journal in lsn order
+static void credit_account(const char* auth_key, U64 downloaded, U64 uploaded) {
+    tracker_partition_t* part = get_partition(auth_key);
+    pthread_mutex_lock(&part->mutex);
+
+    account_info_t* account = get_or_add_account(part, auth_key);
+    if (account != NULL) {
+        account->totalDownload += downloaded;
+        account->totalUploads += uploaded;
+
+        U64 lsn = journal_append(JOURNAL_TRANSFER, auth_key, downloaded, uploaded);
+        if (lsn != 0)
+            account->journal_lsn = lsn;
+    }
+
+    pthread_mutex_unlock(&part->mutex);
+}
+
+static inline U64 transfer_delta(U64* last, U64 reported) {
+    U64 prev = *last;
+    *last = reported;
+
+    if (prev == PEER_TOTALS_UNKNOWN)
+        return 0;
+    //a smaller total means the client started a new session
+    return reported >= prev ? reported - prev : reported;
+}
 
+static void free_torrent_peers(tracker_partition_t* part, torrentfile_t* torrent) {
+    for (U32 i = 0; i < torrent->peer_count; i++)
+        timing_wheel_remove(&part->wheel, torrent->peer_info[i].timer);
+
+    hashmap_deinit(&torrent->peers);
+    free(torrent->compact_peers);
+    free(torrent->peer_cache);
+    torrent->peer_cache = NULL;
+    torrent->seeders = 0;
+    torrent->lecheers = 0;
+    free(torrent->peer_info);
+
+    torrent->compact_peers = NULL;
+    torrent->peer_info = NULL;
+    torrent->peer_count = 0;
+    torrent->peer_capacity = 0;
 }
 
+//seeders and lecheers only change when a peer is added, removed or changes state
+static I32 peer_add(tracker_partition_t* part, torrentfile_t* torrent, U32 torrent_index, const char* peer_id, U32 last_seen, U8 seeder) {
+
+    if (torrent->peer_count == torrent->peer_capacity) {
+        U32 capacity = torrent->peer_capacity ? torrent->peer_capacity * 2 : PEERS_INITIAL_CAPACITY;
+
+        U8* compact = realloc(torrent->compact_peers, (size_t)capacity * COMPACT_PEER_LEN);
+        if (compact == NULL)
+            return -1;
+        torrent->compact_peers = compact;
 
+        peer_info_t* info = realloc(torrent->peer_info, (size_t)capacity * sizeof(peer_info_t));
+        if (info == NULL)
+            return -1;
+        torrent->peer_info = info;
+        torrent->peers.ctx = info;
 
-userinfo_t* tracker_get_user(const char* unique_id) {
-    pthread_mutex_lock(&mutex);
+        torrent->peer_capacity = capacity;
+    }
+
+    U32 slot = torrent->peer_count;
+    peer_info_t* info = &torrent->peer_info[slot];
+    memcpy(info->peer_id, peer_id, PEER_ID_LEN);
+    info->last_seen = last_seen;
+    info->uploaded = PEER_TOTALS_UNKNOWN;
+    info->downloaded = PEER_TOTALS_UNKNOWN;
+    info->seeder = seeder;
+
+    info->timer = timing_wheel_add(&part->wheel, torrent_index, slot, info->last_seen + TRACKER_PEER_TIMEOUT);
+    if (info->timer < 0)
+        return -1;
+
+    if (hashmap_insert(&torrent->peers, peer_id, slot) != 0) {
+        timing_wheel_remove(&part->wheel, info->timer);
+        return -1;
+    }
 
-    userinfo_t* user = hashmap_get(user_map, unique_id);
+    torrent->peer_count++;
+    torrent->epoch++;
+    if (seeder)
+        torrent->seeders++;
+    else
+        torrent->lecheers++;
+    return slot;
+}
+
+static void peer_set_seeder(torrentfile_t* torrent, peer_info_t* info, U8 seeder) {
+    if (info->seeder == seeder)
+        return;
 
-    pthread_mutex_unlock(&mutex);
-    return user;
+    info->seeder = seeder;
+    if (seeder) {
+        torrent->seeders++;
+        torrent->lecheers--;
+    }
+    else {
+        torrent->seeders--;
+        torrent->lecheers++;
+    }
 }
 
+//swap-remove, the last peer takes over the freed slot
+static void peer_remove(tracker_partition_t* part, torrentfile_t* torrent, U32 slot) {
+
+    U32 last = --torrent->peer_count;
+    torrent->epoch++;
+    if (torrent->peer_info[slot].seeder)
+        torrent->seeders--;
+    else
+        torrent->lecheers--;
+
+    hashmap_remove(&torrent->peers, torrent->peer_info[slot].peer_id);
+    timing_wheel_remove(&part->wheel, torrent->peer_info[slot].timer);
+
+    if (slot != last) {
+        memcpy(torrent->compact_peers + slot * COMPACT_PEER_LEN, torrent->compact_peers + last * COMPACT_PEER_LEN, COMPACT_PEER_LEN);
+        torrent->peer_info[slot] = torrent->peer_info[last];
+        hashmap_insert(&torrent->peers, torrent->peer_info[slot].peer_id, slot);
+        timing_wheel_move(&part->wheel, torrent->peer_info[slot].timer, slot);
+    }
+}
+
+//wheel callback, the partition lock is held by tracker_expire_peers
+static U32 peer_due(void* ctx, const wheel_node_t* node, U32 now) {
+    tracker_partition_t* part = ctx;
+    torrentfile_t* torrent = mem_pool_get_torrent(&part->torrent_pool, node->owner);
+
+    U32 deadline = torrent->peer_info[node->slot].last_seen + TRACKER_PEER_TIMEOUT;
+    if ((I32)(deadline - now) > 0)
+        return deadline;
+
+    peer_remove(part, torrent, node->slot);
+    part->expired++;
+    return 0;
+}
+
+//copies count peers, skipping the announcing peer's own slot
+static U32 peer_copy(torrentfile_t* torrent, I32 self, U8* dest, U32 count) {
+
+    if (self < 0 || (U32)self >= count) {
+        memcpy(dest, torrent->compact_peers, (size_t)count * COMPACT_PEER_LEN);
+        return count;
+    }
+
+    memcpy(dest, torrent->compact_peers, (size_t)self * COMPACT_PEER_LEN);
+    memcpy(dest + self * COMPACT_PEER_LEN, torrent->compact_peers + (self + 1) * COMPACT_PEER_LEN, (size_t)(count - self) * COMPACT_PEER_LEN);
+    return count;
+}
+
+//random start and a stride coprime to peer_count, visits count distinct peers in O(count)
+static U32 peer_sample(torrentfile_t* torrent, I32 self, U8* dest, U32 count) {
+
+    U32 n = torrent->peer_count;
+    U32 others = n - (self >= 0);
+
+    if (count >= others)
+        return peer_copy(torrent, self, dest, others);
+
+    U32 stride = 1;
+    if (n > 2) {
+        do {
+            stride = 1 + rand_below(n - 1);
+        } while (gcd(stride, n) != 1);
+    }
+
+    U32 i = rand_below(n);
+    U32 copied = 0;
+
+    while (copied < count) {
+        if ((I32)i != self) {
+            memcpy(dest + copied * COMPACT_PEER_LEN, torrent->compact_peers + i * COMPACT_PEER_LEN, COMPACT_PEER_LEN);
+            copied++;
+        }
+
+        i += stride;
+        if (i >= n)
+            i -= n;
+    }
+
+    return copied;
+}
+
+//a list is shared by every announce until enough of the swarm changed or it gets old,
+//the announcing peer is skipped while copying so it never gets itself back
+static U32 peer_cached(torrentfile_t* torrent, I32 self, U8* dest, U32 count) {
+
+    if (torrent->peer_cache == NULL) {
+        torrent->peer_cache = calloc(1, sizeof(peer_cache_t));
+        if (torrent->peer_cache == NULL)
+            return peer_sample(torrent, self, dest, count);
+    }
+
+    U32 now = clock_now();
+    peer_list_t* list = &torrent->peer_cache->lists[rand_below(PEER_CACHE_LISTS)];
+
+    U32 age = now - list->built;
+    U32 changes = torrent->epoch - list->epoch;
+
+    if (list->count == 0 || age >= TRACKER_PEER_CACHE_MAX_AGE ||
+            (age >= TRACKER_PEER_CACHE_MIN_AGE && changes > torrent->peer_count >> TRACKER_PEER_CACHE_CHANGES_SHIFT)) {
+        list->count = peer_sample(torrent, -1, list->peers, TRACKER_MAX_NUMWANT + 1);
+        list->epoch = torrent->epoch;
+        list->built = now;
+    }
+
+    const U8* own = self >= 0 ? torrent->compact_peers + self * COMPACT_PEER_LEN : NULL;
+    const U8* src = list->peers;
+    const U8* end = list->peers + list->count * COMPACT_PEER_LEN;
+
+    if (own != NULL) {
+        const U8* match = src;
+        U32 limit = count < list->count ? count : list->count;
+        for (; match < src + limit * COMPACT_PEER_LEN; match += COMPACT_PEER_LEN) {
+            if (memcmp(match, own, COMPACT_PEER_LEN) == 0)
+                break;
+        }
+
+        //the own entry lies in the part being copied, copy around it
+        if (match < src + limit * COMPACT_PEER_LEN) {
+            U32 before = (match - src) / COMPACT_PEER_LEN;
+            memcpy(dest, src, (size_t)before * COMPACT_PEER_LEN);
+
+            U32 after = (end - match) / COMPACT_PEER_LEN - 1;
+            if (after > count - before)
+                after = count - before;
+            memcpy(dest + before * COMPACT_PEER_LEN, match + COMPACT_PEER_LEN, (size_t)after * COMPACT_PEER_LEN);
+            return before + after;
+        }
+    }
+
+    if (count > list->count)
+        count = list->count;
+    memcpy(dest, src, (size_t)count * COMPACT_PEER_LEN);
+    return count;
+}
+
+I32 tracker_announce(const tracker_announce_t* announce, U8* peers, U32 max_peers, tracker_announce_result_t* result) {
+    tracker_partition_t* part = get_partition(announce->info_hash);
+    I32 ret = 0;
+    U64 downloaded = 0;
+    U64 uploaded = 0;
+
+    memset(result, 0, sizeof *result);
+
+    pthread_mutex_lock(&part->mutex);
+
+    I32 index = announce->event == EVENT_STOPPED
+        ? find_torrent(part, announce->info_hash)
+        : get_or_add_torrent(part, announce->info_hash);
+
+    if (index < 0) {
+        ret = announce->event == EVENT_STOPPED ? 0 : -1;
+        goto unlock;
+    }
+
+    torrentfile_t* torrent = mem_pool_get_torrent(&part->torrent_pool, index);
+    I32 slot = hashmap_get(&torrent->peers, announce->peer_id);
+
+    if (slot >= 0) {
+        downloaded = transfer_delta(&torrent->peer_info[slot].downloaded, announce->downloaded);
+        uploaded = transfer_delta(&torrent->peer_info[slot].uploaded, announce->uploaded);
+    }
+
+    if (announce->event == EVENT_STOPPED) {
+        if (slot >= 0)
+            peer_remove(part, torrent, slot);
+        slot = -1;
+    }
+    else {
+        U8 seeder = announce->left == 0;
+        //a download counts once, when its peer turns into a seeder. A new peer only
+        //counts if it says it just completed, otherwise it is a seeder coming back
+        U8 completed;
+
+        if (slot < 0) {
+            if ((slot = peer_add(part, torrent, index, announce->peer_id, clock_now(), seeder)) < 0) {
+                ret = -1;
+                goto unlock;
+            }
+            torrent->peer_info[slot].downloaded = announce->downloaded;
+            torrent->peer_info[slot].uploaded = announce->uploaded;
+            completed = seeder && announce->event == EVENT_COMPLETED;
+        }
+        else {
+            completed = seeder && !torrent->peer_info[slot].seeder;
+            peer_set_seeder(torrent, &torrent->peer_info[slot], seeder);
+        }
+
+        if (completed) {
+            torrent->completed++;
+
+            U64 lsn = journal_append(JOURNAL_COMPLETED, announce->info_hash, 1, 0);
+            if (lsn != 0)
+                torrent->journal_lsn = lsn;
+        }
+
+        //the wheel re-checks last_seen when the peer's node comes due
+        torrent->peer_info[slot].last_seen = clock_now();
+
+        U8 address[COMPACT_PEER_LEN];
+        memcpy(address, &announce->ip, 4);
+        memcpy(address + 4, &announce->port, 2);
+
+        U8* compact = torrent->compact_peers + slot * COMPACT_PEER_LEN;
+        if (memcmp(compact, address, COMPACT_PEER_LEN) != 0) {
+            memcpy(compact, address, COMPACT_PEER_LEN);
+            torrent->epoch++;
+        }
+
+        U32 want = announce->numwant < TRACKER_MAX_NUMWANT ? announce->numwant : TRACKER_MAX_NUMWANT;
+        if (want > max_peers)
+            want = max_peers;
+
+        if (torrent->peer_count > TRACKER_PEER_CACHE_MIN_PEERS)
+            result->peer_count = peer_cached(torrent, slot, peers, want);
+        else
+            result->peer_count = peer_sample(torrent, slot, peers, want);
+    }
+
+    result->seeders = torrent->seeders;
+    result->leechers = torrent->lecheers;
+    result->completed = torrent->completed;
+
+unlock:
+    pthread_mutex_unlock(&part->mutex);
+
+    //the account usually lives in another partition, never hold two locks
+    if (announce->auth_key != NULL && (downloaded != 0 || uploaded != 0))
+        credit_account(announce->auth_key, downloaded, uploaded);
+
+    return ret;
+}
+
+void tracker_scrape(const char* info_hashes, U32 count, tracker_scrape_result_t* results) {
+
+    U64 hashes[TRACKER_MAX_SCRAPE];
+    U32 part_of[TRACKER_MAX_SCRAPE];
+    U8 order[TRACKER_MAX_SCRAPE];
+
+    if (count > TRACKER_MAX_SCRAPE)
+        count = TRACKER_MAX_SCRAPE;
+
+    memset(results, 0, count * sizeof *results);
+
+    //group the hashes by partition (insertion sort, count is small)
+    for (U32 i = 0; i < count; i++) {
+        const char* info_hash = info_hashes + i * INFO_HASH_LEN;
+        hashes[i] = hashmap_hash(info_hash);
+        part_of[i] = partition_index(info_hash);
+
+        U32 j = i;
+        for (; j > 0 && part_of[order[j - 1]] > part_of[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    for (U32 start = 0, end; start < count; start = end) {
+        U32 p = part_of[order[start]];
+        for (end = start + 1; end < count && part_of[order[end]] == p; end++);
+
+        tracker_partition_t* part = &partitions[p];
+        pthread_mutex_lock(&part->mutex);
+
+        //every bucket and then every node load is in flight before the first one is waited on
+        for (U32 k = start; k < end; k++)
+            hashmap_prefetch(&part->torrent_map, hashes[order[k]]);
+
+        for (U32 k = start; k < end; k++) {
+            I32 index = hashmap_peek(&part->torrent_map, hashes[order[k]]);
+            if (index >= 0)
+                __builtin_prefetch(mem_pool_get_torrent(&part->torrent_pool, index));
+        }
+
+        for (U32 k = start; k < end; k++) {
+            U32 i = order[k];
+            I32 index = hashmap_get_hashed(&part->torrent_map, info_hashes + i * INFO_HASH_LEN, hashes[i]);
+            if (index < 0)
+                continue;
+
+            const torrentfile_t* torrent = mem_pool_get_torrent(&part->torrent_pool, index);
+            results[i].seeders = torrent->seeders;
+            results[i].leechers = torrent->lecheers;
+            results[i].completed = torrent->completed;
+            results[i].found = 1;
+        }
+
+        pthread_mutex_unlock(&part->mutex);
+    }
+}
+
+void tracker_add_torrent(const char* info_hash) {
+    tracker_partition_t* part = get_partition(info_hash);
+    pthread_mutex_lock(&part->mutex);
+
+    get_or_add_torrent(part, info_hash);
+
+    pthread_mutex_unlock(&part->mutex);
+}
+
+void tracker_remove_torrent(const char* info_hash) {
+    tracker_partition_t* part = get_partition(info_hash);
+    pthread_mutex_lock(&part->mutex);
+
+    I32 index = hashmap_remove(&part->torrent_map, info_hash);
+    if (index >= 0) {
+        free_torrent_peers(part, mem_pool_get_torrent(&part->torrent_pool, index));
+        mem_pool_free_node(&part->torrent_pool, index);
+    }
+
+    pthread_mutex_unlock(&part->mutex);
+}
+
+
+
 torrentfile_t* tracket_get_torrent(const char* info_hash) {
-    
+    tracker_partition_t* part = get_partition(info_hash);
+    pthread_mutex_lock(&part->mutex);
+
+    I32 index = find_torrent(part, info_hash);
+    torrentfile_t* torrent = index >= 0 ? mem_pool_get_torrent(&part->torrent_pool, index) : NULL;
+
+    pthread_mutex_unlock(&part->mutex);
+    return torrent;
+}
+
+U32 tracker_partition_count() {
+    return partition_count;
+}
+
+void tracker_visit_partition(U32 partition, tracker_visit_fn visit, void* ctx) {
+    tracker_partition_t* part = &partitions[partition];
+    pthread_mutex_lock(&part->mutex);
+
+    U32 now = clock_now();
+    U32 it = 0;
+    I32 index;
+    while ((index = hashmap_next(&part->torrent_map, &it)) >= 0)
+        visit(ctx, mem_pool_get_torrent(&part->torrent_pool, index), now);
+
+    pthread_mutex_unlock(&part->mutex);
+}
+
+void tracker_visit_accounts(U32 partition, tracker_account_visit_fn visit, void* ctx) {
+    tracker_partition_t* part = &partitions[partition];
+    pthread_mutex_lock(&part->mutex);
+
+    U32 it = 0;
+    I32 index;
+    while ((index = hashmap_next(&part->account_map, &it)) >= 0)
+        visit(ctx, mem_pool_get_account(&part->account_pool, index));
+
+    pthread_mutex_unlock(&part->mutex);
+}
+
+I32 tracker_restore_torrent(const char* info_hash, U32 completed, U64 journal_lsn,
+                            const tracker_peer_record_t* peers, U32 peer_count, U32 extra_age) {
+
+    tracker_partition_t* part = get_partition(info_hash);
+    I32 ret = 0;
+
+    pthread_mutex_lock(&part->mutex);
+
+    I32 index = get_or_add_torrent(part, info_hash);
+    if (index < 0) {
+        ret = -1;
+        goto unlock;
+    }
+
+    torrentfile_t* torrent = mem_pool_get_torrent(&part->torrent_pool, index);
+    torrent->completed = completed;
+    torrent->journal_lsn = journal_lsn;
+
+    U32 now = clock_now();
+    for (U32 i = 0; i < peer_count; i++) {
+        const tracker_peer_record_t* peer = &peers[i];
+
+        U64 age = (U64)peer->age + extra_age;
+        if (age >= TRACKER_PEER_TIMEOUT || hashmap_get(&torrent->peers, peer->peer_id) >= 0)
+            continue;
+
+        I32 slot = peer_add(part, torrent, index, peer->peer_id, now - (U32)age, peer->seeder != 0);
+        if (slot < 0) {
+            ret = -1;
+            goto unlock;
+        }
+        memcpy(torrent->compact_peers + slot * COMPACT_PEER_LEN, peer->compact, COMPACT_PEER_LEN);
+    }
+
+unlock:
+    pthread_mutex_unlock(&part->mutex);
+    return ret;
+}
+
+I32 tracker_restore_account(const char* auth_key, U64 downloaded, U64 uploaded, U64 journal_lsn) {
+    tracker_partition_t* part = get_partition(auth_key);
+    pthread_mutex_lock(&part->mutex);
+
+    account_info_t* account = get_or_add_account(part, auth_key);
+    if (account != NULL) {
+        account->totalDownload = downloaded;
+        account->totalUploads = uploaded;
+        account->journal_lsn = journal_lsn;
+    }
+
+    pthread_mutex_unlock(&part->mutex);
+    return account != NULL ? 0 : -1;
 }
 
+void tracker_apply_journal(const journal_record_t* record) {
+    tracker_partition_t* part = get_partition(record->key);
+    pthread_mutex_lock(&part->mutex);
+
+    if (record->type == JOURNAL_COMPLETED) {
+        I32 index = get_or_add_torrent(part, record->key);
+        if (index >= 0) {
+            torrentfile_t* torrent = mem_pool_get_torrent(&part->torrent_pool, index);
+            if (record->lsn > torrent->journal_lsn) {
+                torrent->completed += record->value0;
+                torrent->journal_lsn = record->lsn;
+            }
+        }
+    }
+    else if (record->type == JOURNAL_TRANSFER) {
+        account_info_t* account = get_or_add_account(part, record->key);
+        if (account != NULL && record->lsn > account->journal_lsn) {
+            account->totalDownload += record->value0;
+            account->totalUploads += record->value1;
+            account->journal_lsn = record->lsn;
+        }
+    }
 
+    pthread_mutex_unlock(&part->mutex);
+}
 
+account_info_t tracker_get_account(const char* auth_key) {
+    tracker_partition_t* part = get_partition(auth_key);
+    account_info_t account = {0};
+    pthread_mutex_lock(&part->mutex);
+
+    I32 index = hashmap_get(&part->account_map, auth_key);
+    if (index >= 0)
+        account = *mem_pool_get_account(&part->account_pool, index);
+
+    pthread_mutex_unlock(&part->mutex);
+    return account;
+}
+
+U32 tracker_expire_peers(U32 budget) {
+
+    U32 now = clock_read();
+    __atomic_store_n(&tracker_clock, now, __ATOMIC_RELAXED);
+
+    U32 removed = 0;
+    for (U32 i = 0; i < partition_count; i++) {
+        tracker_partition_t* part = &partitions[i];
+        pthread_mutex_lock(&part->mutex);
+
+        part->expired = 0;
+        timing_wheel_advance(&part->wheel, now, budget, peer_due, part);
+        removed += part->expired;
+
+        pthread_mutex_unlock(&part->mutex);
+    }
+
+    return removed;
+}
@@ -1,24 +1,115 @@
 #ifndef TRACKER_LOGIC_H
-#define TRACKER_LOGIC
+#define TRACKER_LOGIC_H
 
 #include "common.h"
+#include "journal.h"
 
+#define TRACKER_DEFAULT_PARTITIONS 64
+#define TRACKER_MAX_PARTITIONS 65536
+//address space reserved for all torrent pools together, split evenly between the
+//partitions and backed by huge pages where possible. 0 allocates segments with malloc.
+//It is only reserved, memory is committed as segments are carved out of it.
+//The per-torrent peer arrays stay on malloc, they are small, one per torrent and
+//move on every realloc. Hashmap tables large enough for a huge page get their own.
+#define TRACKER_DEFAULT_ARENA_SIZE ((size_t)128 << 20)
 
+#define TRACKER_ANNOUNCE_INTERVAL 1800
+#define TRACKER_DEFAULT_NUMWANT 50
+#define TRACKER_MAX_NUMWANT 200
 
+//peers that miss two announce intervals are dropped
+#define TRACKER_PEER_TIMEOUT (TRACKER_ANNOUNCE_INTERVAL * 2)
+#define TRACKER_EXPIRE_INTERVAL_MS 100
+#define TRACKER_EXPIRE_BUDGET 256
 
+//BEP 15 bound, a 1500 byte datagram holds 74 info_hashes
+#define TRACKER_MAX_SCRAPE 74
 
+//swarms larger than this answer announces from a few pre-sampled peer lists.
+//A list is rebuilt when it gets older than the max age, or earlier once peers joined,
+//left or moved 1/2^CHANGES_SHIFT of the swarm times, but at most once per min age.
+//Peers that left in between may still be handed out, clients skip dead peers anyway
+#define TRACKER_PEER_CACHE_MIN_PEERS 256
+#define TRACKER_PEER_CACHE_MIN_AGE 1
+#define TRACKER_PEER_CACHE_MAX_AGE 5
+#define TRACKER_PEER_CACHE_CHANGES_SHIFT 4
 
-void tracker_logic_init();
 
-void tracker_add_user(const char* unique_id, U32 ip, U16 port, U32 numwant);
-void tracker_add_torrent(const char* info_hash);
+typedef struct tracker_announce_t {
+    const char* info_hash;
+    const char* peer_id;
+    U32 ip;         //network order
+    U16 port;       //network order
+    U64 left;
+    U64 uploaded;
+    U64 downloaded;
+    EVENT event;
+    U32 numwant;
+    const char* auth_key;   //NULL when the announce is not tied to an account
+} tracker_announce_t;
 
+//peer as stored in snapshots, age is seconds since its last announce
+typedef struct tracker_peer_record_t {
+    char peer_id[20];
+    U8 compact[COMPACT_PEER_LEN];
+    U8 seeder;
+    U8 reserved;
+    U32 age;
+} tracker_peer_record_t;
 
-void tracker_remove_user(const char* unique_id);
-void tracker_remove_torrent(const char* info_hash);
+//called for every torrent of a partition while its lock is held, now is the tracker clock
+typedef void (*tracker_visit_fn)(void* ctx, const torrentfile_t* torrent, U32 now);
+typedef void (*tracker_account_visit_fn)(void* ctx, const account_info_t* account);
+
+typedef struct tracker_announce_result_t {
+    U32 seeders;
+    U32 leechers;
+    U32 completed;
+    U32 peer_count;
+} tracker_announce_result_t;
+
+typedef struct tracker_scrape_result_t {
+    U32 seeders;
+    U32 leechers;
+    U32 completed;
+    U32 found;
+} tracker_scrape_result_t;
 
 
-userinfo_t* tracker_get_user(const char* unique_id);
+//arena_flags are the MEM_ARENA_* flags of mem_pool_init_arena
+void tracker_logic_init(U32 partition_count, size_t arena_size, U32 arena_flags);
+void tracker_logic_deinit();
+
+//adds/updates/removes the announcing peer and copies up to min(numwant, max_peers)
+//other peers of the swarm into peers as compact entries
+I32 tracker_announce(const tracker_announce_t* announce, U8* peers, U32 max_peers, tracker_announce_result_t* result);
+
+//results[i] gets the counters of info_hashes[i * 20], unknown torrents are zeroed with found = 0.
+//count is capped at TRACKER_MAX_SCRAPE, every partition involved is locked once.
+void tracker_scrape(const char* info_hashes, U32 count, tracker_scrape_result_t* results);
+
+void tracker_add_torrent(const char* info_hash);
+void tracker_remove_torrent(const char* info_hash);
+
 torrentfile_t* tracket_get_torrent(const char* info_hash);
 
+U32 tracker_partition_count();
+void tracker_visit_partition(U32 partition, tracker_visit_fn visit, void* ctx);
+void tracker_visit_accounts(U32 partition, tracker_account_visit_fn visit, void* ctx);
+
+//adds a torrent with the peers younger than TRACKER_PEER_TIMEOUT, seeders and leechers are
+//counted from the peers kept. extra_age is added to every peer's age (time the state spent on disk)
+I32 tracker_restore_torrent(const char* info_hash, U32 completed, U64 journal_lsn,
+                            const tracker_peer_record_t* peers, U32 peer_count, U32 extra_age);
+I32 tracker_restore_account(const char* auth_key, U64 downloaded, U64 uploaded, U64 journal_lsn);
+
+//journal_apply_fn for journal_replay, skips records older than the state they target
+void tracker_apply_journal(const journal_record_t* record);
+
+account_info_t tracker_get_account(const char* auth_key);
+
+//advances every partition's expiry wheel to the current time, visiting at most
+//budget peers per partition so the locks are only held briefly. Returns the peers removed.
+U32 tracker_expire_peers(U32 budget);
+
 #endif
@@ -0,0 +1,16 @@
+#ifndef TYPES_H
+#define TYPES_H
+
+typedef unsigned char U8;
+typedef unsigned short U16;
+typedef unsigned int U32;
+typedef unsigned long U64;
+
+typedef char I8;
+typedef short I16;
+typedef int I32;
+typedef long I64;
+
+typedef float F32;
+
+#endif
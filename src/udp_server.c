@@ -1,22 +1,49 @@
+#define _GNU_SOURCE
+
 #include "udp_server.h"
 
 #include "logger.h"
+#include "common.h"
+#include "conn_id.h"
+#include "tracker_logic.h"
+#include "uring.h"
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 
 #include <pthread.h>
+#include <sched.h>
 
 #define MSG_CONNECT 0
 #define MSG_ANNOUNCE 1
 #define MSG_SCRAPE 2
 #define MSG_ERROR 3
 
+#define UDP_PACKET_SIZE 1500
+
+//announce request without the optional BEP 41 url data
+#define ANNOUNCE_REQUEST_SIZE 98
+#define UDP_MAX_BATCH 1024
+
+//provided receive buffers and send slots per batch_size, io_uring only
+#define URING_BUFFERS_PER_BATCH 4
+#define URING_BUF_GROUP 0
+#define URING_SQ_THREAD_IDLE_MS 100
+#define URING_RECV_TAG 0
+#define URING_WAKE_TAG UINT64_MAX
+
+//libuv gives recvmmsg one 64 KB chunk per datagram and reads at most 20 at once
+#define UDP_LOOP_CHUNK_SIZE (64 * 1024)
+#define UDP_LOOP_MAX_BATCH 20
+
 
 #pragma pack(push, 1)
 
@@ -74,133 +101,820 @@ struct announce_response {
 } announce_response;
 
 struct scrape_request {
-    int64_t protocol;
+    int64_t connection_id;
     uint32_t action;
     int32_t transaction_id;
-    char info_hash[20];
+    char info_hash[][20];
 } scrape_request;
 
+struct scrape_entry {
+    uint32_t seeders;
+    uint32_t completed;
+    uint32_t leechers;
+} scrape_entry;
+
 struct scrape_response {
     uint32_t action;
     int32_t transaction_id;
+    struct scrape_entry files[];
 } scrape_response;
 
 #pragma pack(pop)
 
-static int sockfd;
-static pthread_t thread_worker;
+//a reply stays in its send slot until the sendmsg completes
+typedef struct udp_uring_t {
+    uring_t ring;
+    uring_buf_ring_t bufs;
+    struct msghdr rx_hdr;       //only tells the multishot recvmsg how much name to keep
+    int wake_fd;                //eventfd udp_deinit writes to, a pending read on it ends the wait
+    U64 wake_value;
+
+    U32 tx_count;
+    U32 tx_free_count;
+    U32* tx_free;
+    struct msghdr* tx_hdr;
+    struct iovec* tx_iov;
+    struct sockaddr_in* tx_addr;
+    char* tx_buf;
+} udp_uring_t;
+
+typedef struct udp_worker_t {
+    int sockfd;
+    pthread_t thread;
+    U32 batch_size;
+    udp_uring_t* uring;         //NULL on the recvmmsg backend
+
+    struct mmsghdr* rx_msgs;
+    struct iovec* rx_iov;
+    struct sockaddr_in* rx_addr;
+    char* rx_buf;
+
+    struct mmsghdr* tx_msgs;
+    struct iovec* tx_iov;
+    char* tx_buf;
+
+    udp_server_stats_t stats;
+} udp_worker_t;
+
+static udp_worker_t* workers;
+static U32 worker_count;
+static int workers_stop;
+
+//one uv_udp_t on the event loop instead of the worker threads, loop thread only
+typedef struct udp_loop_server_t {
+    uv_udp_t handle;
+    int running;
+    char* rx_buf;
+    size_t rx_size;
+    char tx_buf[UDP_PACKET_SIZE];
+    U32 batch;                  //datagrams of the recvmmsg batch being handled
+    U64 batch_start;
+    udp_server_stats_t stats;
+} udp_loop_server_t;
 
+//a reply that did not fit into the socket buffer right away
+typedef struct udp_loop_send_t {
+    uv_udp_send_t req;
+    char data[];
+} udp_loop_send_t;
 
-//Za delanje connection id-ja. eni random byti
-static char key[] = {0x32, 0xad, 0x43, 0xf2, 0x56, 0xab, 0x86, 0x12};
+static udp_loop_server_t loop_server;
 
 
 //definicije
-static void* udp_server_worker();
-static void make_connection_id(struct sockaddr_in* addr, char* dest);
+static void* udp_server_worker(void* arg);
+static I32 udp_worker_alloc(udp_worker_t* w, U32 batch_size);
+static I32 udp_worker_bind(udp_worker_t* w, struct sockaddr_in* addr);
+static int udp_socket(struct sockaddr_in* addr);
+static void udp_worker_free(udp_worker_t* w);
+static I32 udp_uring_alloc(udp_worker_t* w, udp_backend_t backend);
+static void udp_uring_free(udp_uring_t* u);
+static void* udp_uring_worker(void* arg);
+static int udp_uring_arm_recv(udp_uring_t* u, int sockfd);
+static void udp_loop_on_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+static void udp_loop_on_recv(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf, const struct sockaddr* addr, unsigned flags);
+static void udp_loop_batch_done();
+static void udp_loop_send(const struct sockaddr* addr, int len);
+static void udp_loop_on_send(uv_udp_send_t* req, int status);
+static void udp_loop_on_close(uv_handle_t* handle);
 
 //handlerji
-static void handle_connect(struct sockaddr_in* addr, struct connection_request* req);
-static void handle_announce(struct sockaddr_in* addr, struct announce_request* req);
-static void handle_scrape(struct sockaddr_in* addr, struct scrape_request* req);
+static int handle_connect(struct sockaddr_in* addr, struct connection_request* req, char* res);
+static int handle_announce(struct sockaddr_in* addr, struct announce_request* req, char* res);
+static int handle_scrape(struct sockaddr_in* addr, struct scrape_request* req, uint16_t size, char* res);
 
-void handle_request(struct sockaddr_in* addr, const char* data, uint16_t size);
+int handle_request(struct sockaddr_in* addr, const char* data, uint16_t size, char* res);
 
 
-void udp_init(uint16_t port) {
+void udp_init(uint16_t port, uint16_t num_workers, uint16_t batch_size, int pin_cpus, udp_backend_t backend) {
     struct sockaddr_in serv_addr = {
         .sin_family = AF_INET,
         .sin_port = htons(port),
     };
-    memset(serv_addr.sin_zero, '\0', sizeof serv_addr);
+    memset(serv_addr.sin_zero, '\0', sizeof serv_addr.sin_zero);
 
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus < 1)
+        num_cpus = 1;
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (num_workers == 0)
+        num_workers = num_cpus;
+
+    conn_id_init();
+
+    workers = calloc(num_workers, sizeof(udp_worker_t));
+    if (workers == NULL) {
+        LOG_FATAL("udp_init(): failed to allocate %u workers", num_workers);
+        return;
+    }
+
+    //every worker gets its own SO_REUSEPORT socket, the kernel spreads datagrams between them by flow hash
+    for (U32 i = 0; i < num_workers; i++) {
+        udp_worker_t* w = &workers[i];
+
+        if (udp_worker_bind(w, &serv_addr) != 0)
+            break;
+
+        if (udp_worker_alloc(w, batch_size) != 0) {
+            LOG_FATAL("udp_init(): failed to allocate batch buffers");
+            close(w->sockfd);
+            break;
+        }
+
+        if (backend != UDP_BACKEND_RECVMMSG && udp_uring_alloc(w, backend) != 0)
+            backend = UDP_BACKEND_RECVMMSG;
+
+        int r;
+        if ((r = pthread_create(&w->thread, NULL, w->uring ? udp_uring_worker : udp_server_worker, w)) != 0) {
+            LOG_FATAL("pthread_create(): %d", r);
+            close(w->sockfd);
+            udp_worker_free(w);
+            break;
+        }
+
+        if (pin_cpus) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % num_cpus, &cpus);
+            if ((r = pthread_setaffinity_np(w->thread, sizeof cpus, &cpus)) != 0)
+                LOG_WARN("pthread_setaffinity_np(): %d", r);
+        }
+
+        worker_count++;
+    }
+
+    char ipstr[INET_ADDRSTRLEN];
+
+    const char* backend_name = backend == UDP_BACKEND_IO_URING_SQPOLL ? "io_uring sqpoll" : backend == UDP_BACKEND_IO_URING ? "io_uring" : "recvmmsg";
+
+    LOG_INFO("Started udp server. Listening on: %s:%u, workers: %u, batch size: %u, backend: %s", inet_ntop(serv_addr.sin_family, &serv_addr.sin_addr, ipstr, sizeof ipstr), port, worker_count, batch_size, backend_name);
+    
+}
+
+static I32 udp_worker_bind(udp_worker_t* w, struct sockaddr_in* addr) {
+    w->sockfd = udp_socket(addr);
+    return w->sockfd < 0 ? -1 : 0;
+}
+
+//SO_REUSEPORT lets every worker or loop bind its own socket to the same port
+static int udp_socket(struct sockaddr_in* addr) {
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
         LOG_FATAL("socket(): %d", sockfd);
-        return;
+        return -1;
+    }
+
+    int one = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) < 0) {
+        LOG_FATAL("setsockopt(SO_REUSEPORT): %s", strerror(errno));
+        close(sockfd);
+        return -1;
     }
 
-    int r = bind(sockfd, (struct sockaddr*)&serv_addr, sizeof serv_addr);
+    int r = bind(sockfd, (struct sockaddr*)addr, sizeof *addr);
     if (r < 0) {
-        LOG_FATAL("bind(): %d", r);
-        return;
+        LOG_FATAL("bind(): %s", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+static I32 udp_worker_alloc(udp_worker_t* w, U32 batch_size) {
+
+    if (batch_size == 0)
+        batch_size = 1;
+    if (batch_size > UDP_MAX_BATCH)
+        batch_size = UDP_MAX_BATCH;
+
+    w->batch_size = batch_size;
+    memset(&w->stats, 0, sizeof w->stats);
+
+    w->rx_msgs = calloc(batch_size, sizeof(struct mmsghdr));
+    w->rx_iov = calloc(batch_size, sizeof(struct iovec));
+    w->rx_addr = calloc(batch_size, sizeof(struct sockaddr_in));
+    w->rx_buf = malloc(batch_size * UDP_PACKET_SIZE);
+
+    w->tx_msgs = calloc(batch_size, sizeof(struct mmsghdr));
+    w->tx_iov = calloc(batch_size, sizeof(struct iovec));
+    w->tx_buf = malloc(batch_size * UDP_PACKET_SIZE);
+
+    if (!w->rx_msgs || !w->rx_iov || !w->rx_addr || !w->rx_buf || !w->tx_msgs || !w->tx_iov || !w->tx_buf) {
+        udp_worker_free(w);
+        return -1;
+    }
+
+    for (U32 i = 0; i < batch_size; i++) {
+        w->rx_iov[i].iov_base = w->rx_buf + i * UDP_PACKET_SIZE;
+        w->rx_iov[i].iov_len = UDP_PACKET_SIZE;
+        w->rx_msgs[i].msg_hdr.msg_iov = &w->rx_iov[i];
+        w->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+        w->rx_msgs[i].msg_hdr.msg_name = &w->rx_addr[i];
+
+        w->tx_iov[i].iov_base = w->tx_buf + i * UDP_PACKET_SIZE;
+        w->tx_msgs[i].msg_hdr.msg_iov = &w->tx_iov[i];
+        w->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+        w->tx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    return 0;
+}
+
+static void udp_worker_free(udp_worker_t* w) {
+    if (w->uring != NULL) {
+        udp_uring_free(w->uring);
+        w->uring = NULL;
     }
 
+    free(w->rx_msgs);
+    free(w->rx_iov);
+    free(w->rx_addr);
+    free(w->rx_buf);
+    free(w->tx_msgs);
+    free(w->tx_iov);
+    free(w->tx_buf);
+
+    w->rx_msgs = w->tx_msgs = NULL;
+    w->rx_iov = w->tx_iov = NULL;
+    w->rx_addr = NULL;
+    w->rx_buf = w->tx_buf = NULL;
+}
+
+static inline U64 now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (U64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void stats_max(uint64_t* dst, uint64_t value) {
+    uint64_t cur = __atomic_load_n(dst, __ATOMIC_RELAXED);
+    while (cur < value && !__atomic_compare_exchange_n(dst, &cur, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void* udp_server_worker(void* arg) {
+
+    udp_worker_t* w = arg;
     char ipstr[INET_ADDRSTRLEN];
 
-    pthread_create(&thread_worker, NULL, udp_server_worker, NULL);
-    LOG_INFO("Started udp server. Listening on: %s:%u", inet_ntop(serv_addr.sin_family, &serv_addr.sin_addr, ipstr, sizeof ipstr),port);
-    
+    while (!__atomic_load_n(&workers_stop, __ATOMIC_ACQUIRE)) {
+
+        for (U32 i = 0; i < w->batch_size; i++)
+            w->rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+        //blocks for the first datagram, then drains whatever else is queued
+        int num_msgs = recvmmsg(w->sockfd, w->rx_msgs, w->batch_size, MSG_WAITFORONE, NULL);
+        if (num_msgs == -1) {
+            if (errno != EINTR)
+                LOG_ERROR("recvmmsg(): %s", strerror(errno));
+            continue;
+        }
+
+        //udp_deinit shut the socket down
+        if (num_msgs == 0)
+            continue;
+
+        U64 start = now_ns();
+        U32 num_replies = 0;
+
+        for (int i = 0; i < num_msgs; i++) {
+            struct sockaddr_in* addr = &w->rx_addr[i];
+
+            LOG_DEBUG("Receiving from IP address: %s:%u", inet_ntop(addr->sin_family, &addr->sin_addr, ipstr, sizeof ipstr), ntohs(addr->sin_port));
+
+            char* res = w->tx_iov[num_replies].iov_base;
+            int res_len = handle_request(addr, w->rx_iov[i].iov_base, w->rx_msgs[i].msg_len, res);
+            if (res_len <= 0)
+                continue;
+
+            w->tx_iov[num_replies].iov_len = res_len;
+            w->tx_msgs[num_replies].msg_hdr.msg_name = addr;
+            num_replies++;
+        }
+
+        U32 sent = 0;
+        while (sent < num_replies) {
+            int r = sendmmsg(w->sockfd, w->tx_msgs + sent, num_replies - sent, 0);
+            if (r == -1) {
+                if (errno == EINTR)
+                    continue;
+                LOG_ERROR("sendmmsg(): %s", strerror(errno));
+                break;
+            }
+            sent += r;
+        }
+
+        U64 elapsed = now_ns() - start;
+
+        __atomic_fetch_add(&w->stats.batches, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&w->stats.packets, num_msgs, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&w->stats.responses, sent, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&w->stats.latency_ns_total, elapsed, __ATOMIC_RELAXED);
+        stats_max(&w->stats.batch_max, num_msgs);
+        stats_max(&w->stats.latency_ns_max, elapsed);
+    }
+
+    pthread_exit(NULL);
 }
 
-static void* udp_server_worker() {
-    
-    char buf[1024];
-    struct sockaddr_storage peer_addr;
-    int num_bytes;
-    socklen_t addr_size = sizeof peer_addr;
+//falls back to recvmmsg when the kernel has no io_uring (ENOSYS), it is disabled by
+//kernel.io_uring_disabled or seccomp (EPERM), or lacks multishot recvmsg with provided
+//buffer rings (6.0). SQPOLL needs CAP_SYS_NICE before 5.11, without it the plain ring is used
+static I32 udp_uring_alloc(udp_worker_t* w, udp_backend_t backend) {
+
+    udp_uring_t* u = calloc(1, sizeof(udp_uring_t));
+    if (u == NULL)
+        return -1;
+    u->ring.fd = -1;
+    u->wake_fd = -1;
+
+    //every datagram lands in its own buffer as io_uring_recvmsg_out, the source address, then the payload.
+    //The submission queue holds a reply for each of them
+    U32 count = 1;
+    while (count < w->batch_size * URING_BUFFERS_PER_BATCH)
+        count <<= 1;
+
+    U32 flags = backend == UDP_BACKEND_IO_URING_SQPOLL ? IORING_SETUP_SQPOLL : IORING_SETUP_COOP_TASKRUN;
+    I32 r = uring_init(&u->ring, count, flags, URING_SQ_THREAD_IDLE_MS);
+    if (r == -EPERM && flags == IORING_SETUP_SQPOLL) {
+        LOG_WARN("io_uring_setup(SQPOLL): %s, using io_uring without SQPOLL", strerror(-r));
+        flags = IORING_SETUP_COOP_TASKRUN;
+        r = uring_init(&u->ring, count, flags, 0);
+    }
+    if (r == -EINVAL && flags == IORING_SETUP_COOP_TASKRUN)
+        r = uring_init(&u->ring, count, 0, 0);
+    if (r == -ENOSYS) {
+        LOG_WARN("io_uring_setup(): not supported by this kernel, falling back to recvmmsg");
+        udp_uring_free(u);
+        return -1;
+    }
+    if (r != 0) {
+        LOG_WARN("io_uring_setup(): %s, falling back to recvmmsg", strerror(-r));
+        udp_uring_free(u);
+        return -1;
+    }
+
+    U32 buf_size = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + UDP_PACKET_SIZE;
+    if ((r = uring_buf_ring_init(&u->ring, &u->bufs, URING_BUF_GROUP, count, buf_size)) != 0) {
+        LOG_WARN("io_uring_register(PBUF_RING): %s, falling back to recvmmsg", strerror(-r));
+        udp_uring_free(u);
+        return -1;
+    }
+
+    u->rx_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+    //a shut down socket does not complete a pending multishot recvmsg
+    u->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (u->wake_fd < 0) {
+        LOG_WARN("eventfd(): %s, falling back to recvmmsg", strerror(errno));
+        udp_uring_free(u);
+        return -1;
+    }
+
+    u->tx_count = count;
+    u->tx_free = malloc(count * sizeof(U32));
+    u->tx_hdr = calloc(count, sizeof(struct msghdr));
+    u->tx_iov = calloc(count, sizeof(struct iovec));
+    u->tx_addr = calloc(count, sizeof(struct sockaddr_in));
+    u->tx_buf = malloc((size_t)count * UDP_PACKET_SIZE);
+
+    if (!u->tx_free || !u->tx_hdr || !u->tx_iov || !u->tx_addr || !u->tx_buf) {
+        LOG_WARN("udp_uring_alloc(): failed to allocate send slots, falling back to recvmmsg");
+        udp_uring_free(u);
+        return -1;
+    }
+
+    for (U32 i = 0; i < count; i++) {
+        u->tx_iov[i].iov_base = u->tx_buf + (size_t)i * UDP_PACKET_SIZE;
+        u->tx_hdr[i].msg_iov = &u->tx_iov[i];
+        u->tx_hdr[i].msg_iovlen = 1;
+        u->tx_hdr[i].msg_name = &u->tx_addr[i];
+        u->tx_hdr[i].msg_namelen = sizeof(struct sockaddr_in);
+        u->tx_free[i] = count - 1 - i;
+    }
+    u->tx_free_count = count;
+
+    struct io_uring_sqe* sqe = uring_get_sqe(&u->ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = u->wake_fd;
+    sqe->addr = (U64)(uintptr_t)&u->wake_value;
+    sqe->len = sizeof u->wake_value;
+    sqe->user_data = URING_WAKE_TAG;
+
+    if (udp_uring_arm_recv(u, w->sockfd) != 0) {
+        udp_uring_free(u);
+        return -1;
+    }
 
+    w->uring = u;
+    return 0;
+}
+
+static void udp_uring_free(udp_uring_t* u) {
+    if (u->bufs.ring != NULL)
+        uring_buf_ring_deinit(&u->ring, &u->bufs);
+    if (u->ring.fd >= 0)
+        uring_deinit(&u->ring);
+    if (u->wake_fd >= 0)
+        close(u->wake_fd);
+
+    free(u->tx_free);
+    free(u->tx_hdr);
+    free(u->tx_iov);
+    free(u->tx_addr);
+    free(u->tx_buf);
+    free(u);
+}
+
+//one SQE keeps receiving until the kernel runs out of buffers or completion space
+static int udp_uring_arm_recv(udp_uring_t* u, int sockfd) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&u->ring);
+    if (sqe == NULL) {
+        uring_submit(&u->ring, 0);
+        if ((sqe = uring_get_sqe(&u->ring)) == NULL) {
+            LOG_ERROR("udp_uring_arm_recv(): submission queue full");
+            return -1;
+        }
+    }
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sockfd;
+    sqe->addr = (U64)(uintptr_t)&u->rx_hdr;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = URING_RECV_TAG;
+    return 0;
+}
+
+//send completions carry slot + 1, receive completions URING_RECV_TAG and the wakeup URING_WAKE_TAG
+static void* udp_uring_worker(void* arg) {
+
+    udp_worker_t* w = arg;
+    udp_uring_t* u = w->uring;
     char ipstr[INET_ADDRSTRLEN];
 
-    while(1) {
+    while (!__atomic_load_n(&workers_stop, __ATOMIC_ACQUIRE)) {
 
-        num_bytes = recvfrom(sockfd, buf, sizeof buf, 0, (struct sockaddr *)&peer_addr, &addr_size);
-        if (num_bytes == -1) {
-            LOG_ERROR("recvfrom()");
+        //publishes the replies of the last batch and waits for the next datagram
+        I32 r = uring_submit(&u->ring, 1);
+        if (r < 0) {
+            LOG_ERROR("io_uring_enter(): %s", strerror(-r));
             continue;
         }
-        
 
-        LOG_DEBUG("Receiving from IP address: %s:%u", inet_ntop(peer_addr.ss_family, &((struct sockaddr_in *)&peer_addr)->sin_addr, ipstr, sizeof ipstr), ((struct sockaddr_in *)&peer_addr)->sin_port);
-        handle_request((struct sockaddr_in *)&peer_addr, buf, num_bytes);
+        U32 ready = uring_cq_ready(&u->ring);
+        if (ready == 0)
+            continue;
+
+        U64 start = now_ns();
+        U32 num_msgs = 0, sent = 0, dropped = 0;
+        int rearm = 0;
+
+        for (U32 i = 0; i < ready; i++) {
+            struct io_uring_cqe* cqe = uring_cqe(&u->ring, i);
+
+            if (cqe->user_data == URING_WAKE_TAG)
+                continue;
+
+            if (cqe->user_data != URING_RECV_TAG) {
+                U32 slot = cqe->user_data - 1;
+                if (cqe->res < 0)
+                    LOG_ERROR("sendmsg(): %s", strerror(-cqe->res));
+                else
+                    sent++;
+                u->tx_free[u->tx_free_count++] = slot;
+                continue;
+            }
+
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                rearm = 1;
+
+            if (cqe->res < 0) {
+                if (cqe->res != -ENOBUFS)
+                    LOG_ERROR("recvmsg(): %s", strerror(-cqe->res));
+                continue;
+            }
+
+            if (!(cqe->flags & IORING_CQE_F_BUFFER))
+                continue;
+
+            U16 bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            char* buf = uring_buf(&u->bufs, bid);
+            struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*)buf;
+            struct sockaddr_in* addr = (struct sockaddr_in*)(out + 1);
+            const char* data = (const char*)(addr + 1);
+            U32 size = out->payloadlen < UDP_PACKET_SIZE ? out->payloadlen : UDP_PACKET_SIZE;
+
+            num_msgs++;
+
+            LOG_DEBUG("Receiving from IP address: %s:%u", inet_ntop(addr->sin_family, &addr->sin_addr, ipstr, sizeof ipstr), ntohs(addr->sin_port));
+
+            if (u->tx_free_count == 0) {
+                dropped++;
+                uring_buf_ring_add(&u->bufs, bid);
+                continue;
+            }
+
+            U32 slot = u->tx_free[u->tx_free_count - 1];
+            int res_len = handle_request(addr, data, size, u->tx_iov[slot].iov_base);
+            u->tx_addr[slot] = *addr;
+            uring_buf_ring_add(&u->bufs, bid);
+            if (res_len <= 0)
+                continue;
+
+            struct io_uring_sqe* sqe = uring_get_sqe(&u->ring);
+            if (sqe == NULL) {
+                uring_submit(&u->ring, 0);
+                sqe = uring_get_sqe(&u->ring);
+            }
+            if (sqe == NULL) {
+                dropped++;
+                continue;
+            }
+
+            u->tx_free_count--;
+            u->tx_iov[slot].iov_len = res_len;
+
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = w->sockfd;
+            sqe->addr = (U64)(uintptr_t)&u->tx_hdr[slot];
+            sqe->len = 1;
+            sqe->user_data = (U64)slot + 1;
+        }
+
+        uring_cq_advance(&u->ring, ready);
+        uring_buf_ring_commit(&u->bufs);
+
+        if (rearm)
+            udp_uring_arm_recv(u, w->sockfd);
+
+        U64 elapsed = now_ns() - start;
+
+        __atomic_fetch_add(&w->stats.batches, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&w->stats.packets, num_msgs, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&w->stats.responses, sent, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&w->stats.dropped, dropped, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&w->stats.latency_ns_total, elapsed, __ATOMIC_RELAXED);
+        stats_max(&w->stats.batch_max, num_msgs);
+        stats_max(&w->stats.latency_ns_max, elapsed);
     }
 
     pthread_exit(NULL);
 }
 
+I32 udp_server_init(uv_loop_t* loop, uint16_t port, uint16_t batch_size) {
+    struct sockaddr_in serv_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+    };
+
+    if (loop_server.running) {
+        LOG_ERROR("udp_server_init(): already running");
+        return -1;
+    }
+
+    conn_id_init();
+
+    if (batch_size == 0)
+        batch_size = 1;
+    if (batch_size > UDP_LOOP_MAX_BATCH)
+        batch_size = UDP_LOOP_MAX_BATCH;
+
+    loop_server.rx_size = (size_t)batch_size * UDP_LOOP_CHUNK_SIZE;
+    loop_server.rx_buf = malloc(loop_server.rx_size);
+    if (loop_server.rx_buf == NULL) {
+        LOG_FATAL("udp_server_init(): failed to allocate the receive buffer");
+        return -1;
+    }
+
+    int sockfd = udp_socket(&serv_addr);
+    if (sockfd < 0) {
+        free(loop_server.rx_buf);
+        loop_server.rx_buf = NULL;
+        return -1;
+    }
+
+    int r;
+    unsigned int flags = batch_size > 1 ? UV_UDP_RECVMMSG : 0;
+    if ((r = uv_udp_init_ex(loop, &loop_server.handle, AF_UNSPEC | flags)) != 0) {
+        LOG_FATAL("uv_udp_init_ex(): %s", uv_strerror(r));
+        close(sockfd);
+        free(loop_server.rx_buf);
+        loop_server.rx_buf = NULL;
+        return -1;
+    }
+
+    loop_server.running = 1;
+
+    if ((r = uv_udp_open(&loop_server.handle, sockfd)) != 0) {
+        LOG_FATAL("uv_udp_open(): %s", uv_strerror(r));
+        close(sockfd);
+        uv_close((uv_handle_t*)&loop_server.handle, udp_loop_on_close);
+        return -1;
+    }
+
+    //the handle owns the socket from here on
+    if ((r = uv_udp_recv_start(&loop_server.handle, udp_loop_on_alloc, udp_loop_on_recv)) != 0) {
+        LOG_FATAL("uv_udp_recv_start(): %s", uv_strerror(r));
+        uv_close((uv_handle_t*)&loop_server.handle, udp_loop_on_close);
+        return -1;
+    }
+
+    char ipstr[INET_ADDRSTRLEN];
+
+    LOG_INFO("Started udp server on the event loop. Listening on: %s:%u, batch size: %u", inet_ntop(serv_addr.sin_family, &serv_addr.sin_addr, ipstr, sizeof ipstr), port, batch_size);
+    return 0;
+}
+
+void udp_server_close() {
+    if (!loop_server.running || uv_is_closing((uv_handle_t*)&loop_server.handle))
+        return;
+
+    uv_udp_recv_stop(&loop_server.handle);
+    uv_close((uv_handle_t*)&loop_server.handle, udp_loop_on_close);
+}
+
+static void udp_loop_on_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+    buf->base = loop_server.rx_buf;
+    buf->len = loop_server.rx_size;
+}
+
+static void udp_loop_batch_done() {
+    U64 elapsed = now_ns() - loop_server.batch_start;
+
+    __atomic_fetch_add(&loop_server.stats.batches, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&loop_server.stats.latency_ns_total, elapsed, __ATOMIC_RELAXED);
+    stats_max(&loop_server.stats.batch_max, loop_server.batch);
+    stats_max(&loop_server.stats.latency_ns_max, elapsed);
+
+    loop_server.batch = 0;
+}
+
+//with recvmmsg every datagram of a batch comes as a UV_UDP_MMSG_CHUNK, then one UV_UDP_MMSG_FREE call
+static void udp_loop_on_recv(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf, const struct sockaddr* addr, unsigned flags) {
+
+    if (flags & UV_UDP_MMSG_FREE) {
+        if (loop_server.batch > 0)
+            udp_loop_batch_done();
+        return;
+    }
+
+    if (nread < 0) {
+        LOG_ERROR("uv_udp_recv(): %s", uv_strerror(nread));
+        return;
+    }
+
+    //the socket is drained
+    if (addr == NULL)
+        return;
+
+    if (loop_server.batch++ == 0)
+        loop_server.batch_start = now_ns();
+    __atomic_fetch_add(&loop_server.stats.packets, 1, __ATOMIC_RELAXED);
+
+    char ipstr[INET_ADDRSTRLEN];
+    struct sockaddr_in* from = (struct sockaddr_in*)addr;
+    LOG_DEBUG("Receiving from IP address: %s:%u", inet_ntop(from->sin_family, &from->sin_addr, ipstr, sizeof ipstr), ntohs(from->sin_port));
+
+    uint16_t size = nread < UDP_PACKET_SIZE ? nread : UDP_PACKET_SIZE;
+    int res_len = handle_request(from, buf->base, size, loop_server.tx_buf);
+    if (res_len > 0)
+        udp_loop_send(addr, res_len);
+
+    if (!(flags & UV_UDP_MMSG_CHUNK))
+        udp_loop_batch_done();
+}
+
+//replies go straight out with uv_udp_try_send, only a full socket buffer costs a copy and a queued send
+static void udp_loop_send(const struct sockaddr* addr, int len) {
+
+    uv_buf_t buf = uv_buf_init(loop_server.tx_buf, len);
+    int r = uv_udp_try_send(&loop_server.handle, &buf, 1, addr);
+    if (r >= 0) {
+        __atomic_fetch_add(&loop_server.stats.responses, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (r != UV_EAGAIN) {
+        LOG_ERROR("uv_udp_try_send(): %s", uv_strerror(r));
+        __atomic_fetch_add(&loop_server.stats.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    udp_loop_send_t* send = malloc(sizeof(udp_loop_send_t) + len);
+    if (send == NULL) {
+        __atomic_fetch_add(&loop_server.stats.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    memcpy(send->data, loop_server.tx_buf, len);
+    buf = uv_buf_init(send->data, len);
+
+    if ((r = uv_udp_send(&send->req, &loop_server.handle, &buf, 1, addr, udp_loop_on_send)) != 0) {
+        LOG_ERROR("uv_udp_send(): %s", uv_strerror(r));
+        __atomic_fetch_add(&loop_server.stats.dropped, 1, __ATOMIC_RELAXED);
+        free(send);
+    }
+}
+
+static void udp_loop_on_send(uv_udp_send_t* req, int status) {
+    if (status == 0) {
+        __atomic_fetch_add(&loop_server.stats.responses, 1, __ATOMIC_RELAXED);
+    } else if (status != UV_ECANCELED) {
+        LOG_ERROR("uv_udp_send(): %s", uv_strerror(status));
+        __atomic_fetch_add(&loop_server.stats.dropped, 1, __ATOMIC_RELAXED);
+    }
+
+    free(req);
+}
+
+static void udp_loop_on_close(uv_handle_t* handle) {
+    free(loop_server.rx_buf);
+    loop_server.rx_buf = NULL;
+    loop_server.running = 0;
+}
+
+void udp_get_stats(udp_server_stats_t* stats) {
+
+    memset(stats, 0, sizeof *stats);
+
+    for (U32 i = 0; i <= worker_count; i++) {
+        udp_server_stats_t* ws = i < worker_count ? &workers[i].stats : &loop_server.stats;
 
-void handle_request(struct sockaddr_in* addr, const char* data, uint16_t size) {
+        stats->batches += __atomic_load_n(&ws->batches, __ATOMIC_RELAXED);
+        stats->packets += __atomic_load_n(&ws->packets, __ATOMIC_RELAXED);
+        stats->responses += __atomic_load_n(&ws->responses, __ATOMIC_RELAXED);
+        stats->dropped += __atomic_load_n(&ws->dropped, __ATOMIC_RELAXED);
+        stats->latency_ns_total += __atomic_load_n(&ws->latency_ns_total, __ATOMIC_RELAXED);
+
+        uint64_t batch_max = __atomic_load_n(&ws->batch_max, __ATOMIC_RELAXED);
+        if (batch_max > stats->batch_max)
+            stats->batch_max = batch_max;
+
+        uint64_t latency_max = __atomic_load_n(&ws->latency_ns_max, __ATOMIC_RELAXED);
+        if (latency_max > stats->latency_ns_max)
+            stats->latency_ns_max = latency_max;
+    }
+}
+
+
+int handle_request(struct sockaddr_in* addr, const char* data, uint16_t size, char* res) {
     struct payload* req = (struct payload*)data;
+
+    if (size < sizeof(struct payload))
+        return 0;
+
+    uint32_t action = ntohl(req->action);
     
     //to je prot spoofingu ip-ja
-    if ( req->action != MSG_CONNECT) {
-        int64_t connec_id = 0;
-        make_connection_id(addr, (char*)&connec_id);
-        if (req->connection_id != connec_id)
-            return;    
-    }
+    if (action != MSG_CONNECT && !verify_connection_id(addr, req->connection_id, conn_id_now()))
+        return 0;
 
-    switch (req->action) {
+    switch (action) {
     case MSG_CONNECT:
         if (size < 16)
             break;
-        handle_connect(addr, (struct connection_request*)data);
-        break;
+        return handle_connect(addr, (struct connection_request*)data, res);
     case MSG_ANNOUNCE:
-        if (size < 20)
+        if (size < ANNOUNCE_REQUEST_SIZE)
             break;
-        handle_announce(addr, (struct announce_request*)data);
-        break;
+        return handle_announce(addr, (struct announce_request*)data, res);
     case MSG_SCRAPE:
-        if (size < 8)
+        if (size < sizeof(struct scrape_request) + 20)
             break;
-        handle_scrape(addr, (struct scrape_request*)data);
-        break;
+        return handle_scrape(addr, (struct scrape_request*)data, size, res);
     default:
         break;
     }
-}
-
 
-static void make_connection_id(struct sockaddr_in* addr, char* dest) {
-    for(uint8_t i = 0; i < 8; i++) {
-        dest[i] = (((uint8_t*)&addr->sin_addr.s_addr)[i % 4]) ^ key[i];
-        dest[i] = dest[i] ^ ((uint8_t*)&addr->sin_port)[i % 2];
-    }
+    return 0;
 }
 
 
+
 int64_t swap_int64( int64_t val )
 {
     val = ((val << 8) & 0xFF00FF00FF00FF00ULL ) | ((val >> 8) & 0x00FF00FF00FF00FFULL );
@@ -208,26 +922,109 @@ int64_t swap_int64( int64_t val )
     return (val << 32) | ((val >> 32) & 0xFFFFFFFFULL);
 }
 
-static void handle_connect(struct sockaddr_in* addr, struct connection_request* req) {
-    int64_t t = swap_int64(req->protocol_id);
+static int handle_connect(struct sockaddr_in* addr, struct connection_request* req, char* res) {
 
     if (swap_int64(req->protocol_id) != 0x41727101980)
-        return;
-    
+        return 0;
     
+    struct connection_response* response = (struct connection_response*)res;
+    response->action = htonl(MSG_CONNECT);
+    response->transaction_id = req->transaction_id;
+    response->connection_id = make_connection_id(addr, conn_id_now());
+
+    return sizeof *response;
+}
 
+static inline EVENT udp_event(int32_t event) {
+    switch (ntohl(event)) {
+    case 1: return EVENT_COMPLETED;
+    case 2: return EVENT_STARTED;
+    case 3: return EVENT_STOPPED;
+    default: return EVENT_NONE;
+    }
 }
 
-static void handle_announce(struct sockaddr_in* addr, struct announce_request* req) {
+static int handle_announce(struct sockaddr_in* addr, struct announce_request* req, char* res) {
+
+    int32_t num_want = ntohl(req->num_want);
+
+    tracker_announce_t announce = {
+        .info_hash = req->info_hash,
+        .peer_id = req->peer_id,
+        .ip = addr->sin_addr.s_addr,
+        .port = req->port,
+        .left = swap_int64(req->left),
+        .uploaded = swap_int64(req->uploaded),
+        .downloaded = swap_int64(req->downloaded),
+        .event = udp_event(req->event),
+        .numwant = num_want < 0 ? TRACKER_DEFAULT_NUMWANT : num_want,
+    };
+
+    struct announce_response* response = (struct announce_response*)res;
+    U32 max_peers = (UDP_PACKET_SIZE - sizeof *response) / COMPACT_PEER_LEN;
+    tracker_announce_result_t result;
+
+    //peers are copied straight behind the header
+    if (tracker_announce(&announce, (U8*)(response + 1), max_peers, &result) != 0)
+        return 0;
 
+    response->action = htonl(MSG_ANNOUNCE);
+    response->transaction_id = req->transaction_id;
+    response->interval = htonl(TRACKER_ANNOUNCE_INTERVAL);
+    response->leechers = htonl(result.leechers);
+    response->seeders = htonl(result.seeders);
+
+    return sizeof *response + result.peer_count * COMPACT_PEER_LEN;
 }
 
-static void handle_scrape(struct sockaddr_in* addr, struct scrape_request* req) {
+static int handle_scrape(struct sockaddr_in* addr, struct scrape_request* req, uint16_t size, char* res) {
+
+    U32 count = (size - sizeof *req) / sizeof req->info_hash[0];
+    if (count > TRACKER_MAX_SCRAPE)
+        count = TRACKER_MAX_SCRAPE;
+
+    tracker_scrape_result_t results[TRACKER_MAX_SCRAPE];
+    tracker_scrape(req->info_hash[0], count, results);
+
+    struct scrape_response* response = (struct scrape_response*)res;
+    response->action = htonl(MSG_SCRAPE);
+    response->transaction_id = req->transaction_id;
+
+    //unknown torrents are answered with zeros, entries follow the order of the request
+    for (U32 i = 0; i < count; i++) {
+        response->files[i].seeders = htonl(results[i].seeders);
+        response->files[i].completed = htonl(results[i].completed);
+        response->files[i].leechers = htonl(results[i].leechers);
+    }
 
+    return sizeof *response + count * sizeof response->files[0];
 }
 
+//shutdown() on an unconnected udp socket fails with ENOTCONN but still marks it shut
+//and wakes a blocked recvmmsg, which then returns without data. io_uring workers
+//wait on their eventfd as well
 void udp_deinit() {
-    pthread_join(thread_worker, NULL);
-    close(sockfd);
-}
+    __atomic_store_n(&workers_stop, 1, __ATOMIC_RELEASE);
+
+    for (U32 i = 0; i < worker_count; i++) {
+        if (workers[i].uring != NULL) {
+            U64 one = 1;
+            if (write(workers[i].uring->wake_fd, &one, sizeof one) != sizeof one)
+                LOG_ERROR("udp_deinit(): eventfd write: %s", strerror(errno));
+        }
+        else {
+            shutdown(workers[i].sockfd, SHUT_RD);
+        }
+    }
+
+    for (U32 i = 0; i < worker_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].sockfd);
+        udp_worker_free(&workers[i]);
+    }
 
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+    __atomic_store_n(&workers_stop, 0, __ATOMIC_RELAXED);
+}
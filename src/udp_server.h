@@ -3,8 +3,42 @@
 #ifndef UDP_SERVER_H
 #define UDP_SERVER_H
 
-void udp_init(uint16_t port);
+#include <uv.h>
 
+#include "types.h"
+
+#define UDP_DEFAULT_PORT 6969
+#define UDP_DEFAULT_BATCH 64
+#define UDP_LOOP_DEFAULT_BATCH 20
+
+typedef enum udp_backend_t {
+    UDP_BACKEND_RECVMMSG = 0,
+    UDP_BACKEND_IO_URING,           //multishot recvmsg on io_uring, recvmmsg when the kernel lacks it
+    UDP_BACKEND_IO_URING_SQPOLL     //as above, plus a kernel thread per worker that polls the submissions
+} udp_backend_t;
+
+typedef struct udp_server_stats_t {
+    uint64_t batches;
+    uint64_t packets;
+    uint64_t responses;
+    uint64_t dropped;       //replies not sent for lack of a free send slot
+    uint64_t batch_max;
+    uint64_t latency_ns_total;
+    uint64_t latency_ns_max;
+} udp_server_stats_t;
+
+//num_workers == 0 starts one worker per online cpu
+void udp_init(uint16_t port, uint16_t num_workers, uint16_t batch_size, int pin_cpus, udp_backend_t backend);
+
+//BEP 15 on a uv_udp_t of loop instead of worker threads, it shares the loop, its
+//timers and its shutdown with the http server. Datagrams are read with recvmmsg in
+//batches of up to batch_size (at most 20, libuv's limit)
+I32 udp_server_init(uv_loop_t* loop, uint16_t port, uint16_t batch_size);
+//stops receiving and closes the handle, the loop has to run once more to finish it
+void udp_server_close();
+
+//worker threads and the loop server together
+void udp_get_stats(udp_server_stats_t* stats);
 
 void udp_deinit();
 
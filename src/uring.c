@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int uring_setup(U32 entries, struct io_uring_params* params);
+static int uring_enter(int fd, U32 to_submit, U32 min_complete, U32 flags);
+static int uring_register(int fd, U32 opcode, void* arg, U32 nr_args);
+
+
+static int uring_setup(U32 entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, U32 to_submit, U32 min_complete, U32 flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, U32 opcode, void* arg, U32 nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+//the completion queue is four times the submission queue, multishot receives post
+//many completions per SQE
+I32 uring_init(uring_t* ring, U32 entries, U32 flags, U32 sq_thread_idle_ms) {
+    memset(ring, 0, sizeof *ring);
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    params.flags = flags | IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    params.sq_thread_idle = sq_thread_idle_ms;
+
+    ring->fd = uring_setup(entries, &params);
+    if (ring->fd < 0)
+        return -errno;
+
+    ring->setup_flags = params.flags;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(U32);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    I32 r;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        r = -errno;
+        ring->sq_ring = NULL;
+        goto fail;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            r = -errno;
+            ring->cq_ring = NULL;
+            goto fail;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        r = -errno;
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    char* sq = ring->sq_ring;
+    ring->sq_head = (U32*)(sq + params.sq_off.head);
+    ring->sq_tail = (U32*)(sq + params.sq_off.tail);
+    ring->sq_flags = (U32*)(sq + params.sq_off.flags);
+    ring->sq_mask = *(U32*)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+
+    //SQE i always sits in array slot i, the tail alone says what is submitted
+    U32* array = (U32*)(sq + params.sq_off.array);
+    for (U32 i = 0; i < params.sq_entries; i++)
+        array[i] = i;
+
+    char* cq = ring->cq_ring;
+    ring->cq_head = (U32*)(cq + params.cq_off.head);
+    ring->cq_tail = (U32*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(U32*)(cq + params.cq_off.ring_mask);
+    ring->cq_entries = params.cq_entries;
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return 0;
+
+fail:
+    uring_deinit(ring);
+    return r;
+}
+
+void uring_deinit(uring_t* ring) {
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+
+    memset(ring, 0, sizeof *ring);
+    ring->fd = -1;
+}
+
+struct io_uring_sqe* uring_get_sqe(uring_t* ring) {
+    U32 tail = *ring->sq_tail + ring->sq_pending;
+
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+        return NULL;
+
+    struct io_uring_sqe* sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    ring->sq_pending++;
+    return sqe;
+}
+
+//with SQPOLL the kernel thread picks the SQEs up by itself and only needs a wakeup
+//once it went idle, io_uring_enter is skipped when there is nothing to wait for
+I32 uring_submit(uring_t* ring, U32 wait_nr) {
+    U32 submitted = ring->sq_pending;
+    if (submitted > 0) {
+        __atomic_store_n(ring->sq_tail, *ring->sq_tail + submitted, __ATOMIC_RELEASE);
+        ring->sq_pending = 0;
+    }
+
+    U32 flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    if (ring->setup_flags & IORING_SETUP_SQPOLL) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (submitted > 0 && (__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP))
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        //the caller ran out of SQEs, wait until the kernel thread took some
+        if (wait_nr == 0 && *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+            flags |= IORING_ENTER_SQ_WAIT;
+        if (flags == 0)
+            return submitted;
+    } else if (submitted == 0 && wait_nr == 0) {
+        return 0;
+    }
+
+    int r;
+    do {
+        r = uring_enter(ring->fd, submitted, wait_nr, flags);
+    } while (r < 0 && errno == EINTR && wait_nr == 0);
+
+    if (r < 0)
+        return errno == EINTR ? (I32)submitted : -errno;
+    return r;
+}
+
+I32 uring_buf_ring_init(uring_t* ring, uring_buf_ring_t* br, U16 group, U32 count, U32 buf_size) {
+    memset(br, 0, sizeof *br);
+
+    if (count == 0 || (count & (count - 1)) != 0 || count > 32768)
+        return -EINVAL;
+
+    //the ring itself has to be page aligned
+    br->ring_size = count * sizeof(struct io_uring_buf);
+    br->ring = mmap(NULL, br->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br->ring == MAP_FAILED) {
+        br->ring = NULL;
+        return -errno;
+    }
+
+    br->bufs = malloc((size_t)count * buf_size);
+    if (br->bufs == NULL) {
+        munmap(br->ring, br->ring_size);
+        br->ring = NULL;
+        return -ENOMEM;
+    }
+
+    br->count = count;
+    br->buf_size = buf_size;
+    br->group = group;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (U64)(uintptr_t)br->ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+
+    if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        I32 r = -errno;
+        free(br->bufs);
+        munmap(br->ring, br->ring_size);
+        memset(br, 0, sizeof *br);
+        return r;
+    }
+
+    for (U32 i = 0; i < count; i++)
+        uring_buf_ring_add(br, i);
+    uring_buf_ring_commit(br);
+
+    return 0;
+}
+
+void uring_buf_ring_deinit(uring_t* ring, uring_buf_ring_t* br) {
+    if (br->ring == NULL)
+        return;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.bgid = br->group;
+    uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+    munmap(br->ring, br->ring_size);
+    free(br->bufs);
+    memset(br, 0, sizeof *br);
+}
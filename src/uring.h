@@ -0,0 +1,97 @@
+#ifndef URING_H
+#define URING_H
+
+#include "common.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring on the raw syscalls, only what the udp server uses.
+ * SQEs are filled locally and published to the kernel by uring_submit, so a whole
+ * batch of replies costs one io_uring_enter (none with SQPOLL while the kernel
+ * thread is awake). Completions are read in place between uring_cq_ready and
+ * uring_cq_advance.
+ */
+typedef struct uring_t {
+    int fd;
+    U32 setup_flags;
+
+    U32* sq_head;
+    U32* sq_tail;
+    U32* sq_flags;
+    U32 sq_mask;
+    U32 sq_entries;
+    U32 sq_pending;         //filled by uring_get_sqe, not yet published
+    struct io_uring_sqe* sqes;
+
+    U32* cq_head;
+    U32* cq_tail;
+    U32 cq_mask;
+    U32 cq_entries;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;          //same mapping as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+//ring of provided buffers, the kernel picks one for every datagram it receives
+typedef struct uring_buf_ring_t {
+    struct io_uring_buf_ring* ring;
+    size_t ring_size;
+    char* bufs;
+    U32 count;              //power of two
+    U32 buf_size;
+    U16 group;
+    U16 tail;
+} uring_buf_ring_t;
+
+
+//returns 0 or -errno, sq_thread_idle_ms is only used with IORING_SETUP_SQPOLL
+I32 uring_init(uring_t* ring, U32 entries, U32 flags, U32 sq_thread_idle_ms);
+void uring_deinit(uring_t* ring);
+
+//NULL when the submission queue is full, uring_submit makes room
+struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+//publishes the pending SQEs and waits for at least wait_nr completions
+I32 uring_submit(uring_t* ring, U32 wait_nr);
+
+static inline U32 uring_cq_ready(uring_t* ring) {
+    return __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) - *ring->cq_head;
+}
+
+//i-th completion not yet consumed
+static inline struct io_uring_cqe* uring_cqe(uring_t* ring, U32 i) {
+    return &ring->cqes[(*ring->cq_head + i) & ring->cq_mask];
+}
+
+static inline void uring_cq_advance(uring_t* ring, U32 count) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + count, __ATOMIC_RELEASE);
+}
+
+//count buffers of buf_size bytes, all handed to the kernel under group
+I32 uring_buf_ring_init(uring_t* ring, uring_buf_ring_t* br, U16 group, U32 count, U32 buf_size);
+void uring_buf_ring_deinit(uring_t* ring, uring_buf_ring_t* br);
+
+static inline char* uring_buf(uring_buf_ring_t* br, U16 bid) {
+    return br->bufs + (size_t)bid * br->buf_size;
+}
+
+//gives a buffer back, the kernel sees it after uring_buf_ring_commit
+static inline void uring_buf_ring_add(uring_buf_ring_t* br, U16 bid) {
+    struct io_uring_buf* buf = &br->ring->bufs[br->tail & (br->count - 1)];
+    buf->addr = (U64)(uintptr_t)uring_buf(br, bid);
+    buf->len = br->buf_size;
+    buf->bid = bid;
+    br->tail++;
+}
+
+static inline void uring_buf_ring_commit(uring_buf_ring_t* br) {
+    __atomic_store_n(&br->ring->tail, br->tail, __ATOMIC_RELEASE);
+}
+
+#endif